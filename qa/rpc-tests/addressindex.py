@@ -12,13 +12,15 @@ from test_framework.test_framework import BitcoinTestFramework
 from test_framework.util import *
 from test_framework.script import *
 from test_framework.mininode import *
+from test_framework.key import CECKey
+from test_framework.address import byte_to_base58
 import binascii
 
 class AddressIndexTest(BitcoinTestFramework):
 
     def setup_chain(self):
         print("Initializing test directory "+self.options.tmpdir)
-        initialize_chain_clean(self.options.tmpdir, 4)
+        initialize_chain_clean(self.options.tmpdir, 5)
 
     def setup_network(self):
         self.nodes = []
@@ -28,9 +30,12 @@ class AddressIndexTest(BitcoinTestFramework):
         # Nodes 2/3 are used for testing
         self.nodes.append(start_node(2, self.options.tmpdir, ["-debug", "-addressindex", "-relaypriority=0"]))
         self.nodes.append(start_node(3, self.options.tmpdir, ["-debug", "-addressindex"]))
+        # Node 4 enables the indexes on its existing chain at the end
+        self.nodes.append(start_node(4, self.options.tmpdir, ["-debug"]))
         connect_nodes(self.nodes[0], 1)
         connect_nodes(self.nodes[0], 2)
         connect_nodes(self.nodes[0], 3)
+        connect_nodes(self.nodes[0], 4)
 
         self.is_network_split = False
         self.sync_all()
@@ -105,10 +110,43 @@ class AddressIndexTest(BitcoinTestFramework):
         assert_equal(multitxids[4], txid2)
         assert_equal(multitxids[5], txidb2)
 
+        # Check that txids can be read in pages
+        print("Testing paging through txids with a cursor...")
+        page0 = self.nodes[1].getaddresstxids({"addresses": ["mo9ncXisMeAoXwqcV5EWuyncbmCcQN4rVs"], "limit": 2})
+        assert_equal(page0["txids"], [txid0, txid1])
+        page1 = self.nodes[1].getaddresstxids({"addresses": ["mo9ncXisMeAoXwqcV5EWuyncbmCcQN4rVs"], "limit": 2, "cursor": page0["cursor"]})
+        assert_equal(page1["txids"], [txid2])
+        assert("cursor" not in page1)
+
+        # Pages of several addresses follow the same block order as the whole list
+        pages = []
+        page = {"cursor": None}
+        while "cursor" in page:
+            query = {"addresses": ["2N2JD6wb56AfK4tfmM6PwdVmoYk2dCKf4Br", "mo9ncXisMeAoXwqcV5EWuyncbmCcQN4rVs"], "limit": 2}
+            if page["cursor"]:
+                query["cursor"] = page["cursor"]
+            page = self.nodes[1].getaddresstxids(query)
+            pages.append(page["txids"])
+        assert_equal(pages, [multitxids[0:2], multitxids[2:4], multitxids[4:6]])
+
+        deltapage = self.nodes[1].getaddressdeltas({"addresses": ["2N2JD6wb56AfK4tfmM6PwdVmoYk2dCKf4Br"], "limit": 1})
+        assert_equal(len(deltapage["deltas"]), 1)
+        assert_equal(deltapage["deltas"][0]["txid"], txidb0)
+        deltapage = self.nodes[1].getaddressdeltas({"addresses": ["2N2JD6wb56AfK4tfmM6PwdVmoYk2dCKf4Br"], "limit": 1, "cursor": deltapage["cursor"]})
+        assert_equal(deltapage["deltas"][0]["txid"], txidb1)
+
         # Check that balances are correct
         balance0 = self.nodes[1].getaddressbalance("2N2JD6wb56AfK4tfmM6PwdVmoYk2dCKf4Br")
         assert_equal(balance0["balance"], 45 * 100000000)
 
+        # Check that address summaries are maintained
+        summary0 = self.nodes[1].getaddresssummary("2N2JD6wb56AfK4tfmM6PwdVmoYk2dCKf4Br")
+        assert_equal(summary0[0]["balance"], 45 * 100000000)
+        assert_equal(summary0[0]["received"], 45 * 100000000)
+        assert_equal(summary0[0]["txcount"], 3)
+        assert_equal(summary0[0]["firstheight"], 107)
+        assert_equal(summary0[0]["lastheight"], 111)
+
         # Check that outputs with the same address will only return one txid
         print("Testing for txid uniqueness...")
         addressHash = bytes([99,73,164,24,252,69,120,209,10,55,43,84,180,92,40,12,200,196,56,47])
@@ -206,6 +244,11 @@ class AddressIndexTest(BitcoinTestFramework):
         balance4 = self.nodes[1].getaddressbalance(address2)
         assert_equal(balance4, balance1)
 
+        summary4 = self.nodes[1].getaddresssummary(address2)
+        assert_equal(summary4[0]["balance"], amount)
+        assert_equal(summary4[0]["txcount"], 1)
+        assert_equal(summary4[0]["lastheight"], 113)
+
         utxos2 = self.nodes[1].getaddressutxos({"addresses": [address2]})
         assert_equal(len(utxos2), 1)
         assert_equal(utxos2[0]["satoshis"], amount)
@@ -225,6 +268,29 @@ class AddressIndexTest(BitcoinTestFramework):
         assert_equal(utxos3[1]["height"], 264)
         assert_equal(utxos3[2]["height"], 265)
 
+        # Check filtering of utxos while they are read
+        utxos_conf = self.nodes[1].getaddressutxos({"addresses": [address2], "minconf": 2})
+        assert_equal([utxo["height"] for utxo in utxos_conf], [114, 264])
+        utxos_range = self.nodes[1].getaddressutxos({"addresses": [address2], "start": 200, "end": 264})
+        assert_equal([utxo["height"] for utxo in utxos_range], [264])
+        utxos_min = self.nodes[1].getaddressutxos({"addresses": [address2], "minsatoshis": 5000000000})
+        assert_equal(len(utxos_min), 2)
+        # Bounds that nothing can meet return nothing rather than everything
+        utxos_deep = self.nodes[1].getaddressutxos({"addresses": [address2], "minconf": self.nodes[1].getblockcount() + 2})
+        assert_equal(utxos_deep, [])
+        utxos_early = self.nodes[1].getaddressutxos({"addresses": [address2], "maxtime": 1})
+        assert_equal(utxos_early, [])
+
+        # Check value ordering, with paging and a target amount
+        utxos_value = self.nodes[1].getaddressutxos({"addresses": [address2], "order": "value"})
+        assert_equal([utxo["satoshis"] for utxo in utxos_value], [5000000000, 5000000000, amount])
+        page = self.nodes[1].getaddressutxos({"addresses": [address2], "order": "value", "limit": 2})
+        assert_equal(page["utxos"], utxos_value[0:2])
+        page = self.nodes[1].getaddressutxos({"addresses": [address2], "order": "value", "limit": 2, "cursor": page["cursor"]})
+        assert_equal(page["utxos"], utxos_value[2:])
+        utxos_target = self.nodes[1].getaddressutxos({"addresses": [address2], "order": "value", "target": 6000000000})
+        assert_equal(utxos_target, utxos_value[0:2])
+
         # Check mempool indexing
         print("Testing mempool indexing...")
 
@@ -269,11 +335,23 @@ class AddressIndexTest(BitcoinTestFramework):
         assert_equal(mempool[2]["txid"], memtxid2)
         assert_equal(mempool[2]["index"], 1)
 
+        updates = self.nodes[2].getaddressmempoolupdates({"addresses": [address3]})
+        assert_equal(updates["complete"], True)
+        assert_equal(len(updates["deltas"]), 3)
+        assert_equal(updates["deltas"][0]["txid"], memtxid1)
+        assert_equal(updates["deltas"][0]["removed"], False)
+        assert_equal(updates["deltas"][2]["sequence"] <= updates["sequence"], True)
+
         blk_hashes = self.nodes[2].generate(1);
         self.sync_all();
         mempool2 = self.nodes[2].getaddressmempool({"addresses": [address3]})
         assert_equal(len(mempool2), 0)
 
+        updates2 = self.nodes[2].getaddressmempoolupdates({"addresses": [address3], "sequence": updates["sequence"]})
+        assert_equal(len(updates2["deltas"]), 3)
+        assert_equal(updates2["deltas"][0]["removed"], True)
+        assert_equal(updates2["deltas"][0]["sequence"] > updates["sequence"], True)
+
         tx = CTransaction()
         tx.vin = [
             CTxIn(COutPoint(int(memtxid2, 16), 0)),
@@ -293,6 +371,40 @@ class AddressIndexTest(BitcoinTestFramework):
         assert_equal(mempool3[1]["prevtxid"], memtxid2)
         assert_equal(mempool3[1]["prevout"], 1)
 
+        # watch sets
+        print("Testing watch sets...")
+        assert_equal(self.nodes[1].addwatchaddresses({"name": "payments", "addresses": [address2, address2]})["added"], 1)
+        assert_equal(self.nodes[1].listwatchsets(), [{"name": "payments", "addresses": 1}])
+        watch_txid = self.nodes[0].sendtoaddress(address2, 3)
+        watch_block = self.nodes[0].generate(1)[0]
+        self.sync_all()
+
+        matches = self.nodes[1].getwatchsetmatches({"name": "payments", "blockhash": watch_block})
+        assert_equal(len(matches), 1)
+        assert_equal(matches[0]["deltas"][0]["txid"], watch_txid)
+        assert_equal(matches[0]["deltas"][0]["satoshis"], 300000000)
+        assert_equal(len(self.nodes[1].getwatchsetmatches({"name": "payments", "start": 1})), 1)
+        assert_equal(self.nodes[1].removewatchaddresses({"name": "payments", "addresses": [address2]})["removed"], 1)
+        assert_equal(self.nodes[1].listwatchsets(), [])
+
+        # a set created again under the same name starts without matches
+        self.nodes[1].addwatchaddresses({"name": "payments", "addresses": [address2]})
+        assert_equal(self.nodes[1].getwatchsetmatches({"name": "payments", "start": 1}), [])
+
+        # disconnecting a block erases its matches, also of addresses removed from the set since
+        self.nodes[0].sendtoaddress(address2, 3)
+        watch_block = self.nodes[0].generate(1)[0]
+        self.sync_all()
+        assert_equal(len(self.nodes[1].getwatchsetmatches({"name": "payments", "blockhash": watch_block})), 1)
+        idle_address = "myAUWSHnwsQrhuMWv4Br6QsCnpB41vFwHn"
+        self.nodes[1].addwatchaddresses({"name": "payments", "addresses": [idle_address]})
+        self.nodes[1].removewatchaddresses({"name": "payments", "addresses": [address2]})
+        self.nodes[1].invalidateblock(watch_block)
+        self.nodes[1].reconsiderblock(watch_block)
+        assert_equal(self.nodes[1].getwatchsetmatches({"name": "payments", "blockhash": watch_block}), [])
+        self.nodes[1].removewatchaddresses({"name": "payments", "addresses": [idle_address]})
+        assert_equal(self.nodes[1].listwatchsets(), [])
+
         # sending and receiving to the same address
         privkey1 = "cQY2s58LhzUCmEXN8jtAp1Etnijx78YRZ466w4ikX1V4UpTpbsf8"
         address1 = "myAUWSHnwsQrhuMWv4Br6QsCnpB41vFwHn"
@@ -338,10 +450,124 @@ class AddressIndexTest(BitcoinTestFramework):
         assert_equal(deltas_with_info["end"]["hash"], end_block_hash)
 
         utxos_with_info = self.nodes[1].getaddressutxos({"addresses": [address2], "chainInfo": True})
-        expected_tip_block_hash = self.nodes[1].getblockhash(267);
-        assert_equal(utxos_with_info["height"], 267)
+        expected_tip_block_hash = self.nodes[1].getblockhash(268);
+        assert_equal(utxos_with_info["height"], 268)
         assert_equal(utxos_with_info["hash"], expected_tip_block_hash)
 
+        # Outputs that are filed under the hash of a key or script without being P2PKH or P2SH
+        print("Testing P2PK, P2WPKH, P2WSH and bare multisig outputs...")
+        key5 = CECKey()
+        key5.set_secretbytes(b"\x05" * 32)
+        key5.set_compressed(True)
+        pubkey5 = key5.get_pubkey()
+        key6 = CECKey()
+        key6.set_secretbytes(b"\x06" * 32)
+        key6.set_compressed(True)
+        pubkey6 = key6.get_pubkey()
+        address5 = self.nodes[1].decodescript(bytes_to_hex_str(CScript([pubkey5, OP_CHECKSIG])))["addresses"][0]
+        address6 = self.nodes[1].decodescript(bytes_to_hex_str(CScript([pubkey6, OP_CHECKSIG])))["addresses"][0]
+        witness_script = CScript([OP_DUP, OP_HASH160, hash160(pubkey6), OP_EQUALVERIFY, OP_CHECKSIG])
+        # Witness outputs have address versions of their own, apart from P2PKH and P2SH
+        address7 = byte_to_base58(hash160(witness_script), 0x89)
+        address8 = byte_to_base58(hash160(pubkey5), 0x87)
+        assert(address7 != self.nodes[1].decodescript(bytes_to_hex_str(witness_script))["p2sh"])
+        change_script = hex_str_to_bytes(self.nodes[0].validateaddress(self.nodes[0].getnewaddress())["scriptPubKey"])
+
+        unspent = self.nodes[0].listunspent()
+        tx = CTransaction()
+        tx.vin = [CTxIn(COutPoint(int(unspent[0]["txid"], 16), unspent[0]["vout"]))]
+        tx.vout = [
+            CTxOut(10000000, CScript([pubkey5, OP_CHECKSIG])),
+            CTxOut(20000000, CScript([OP_0, hash160(pubkey5)])),
+            CTxOut(30000000, CScript([OP_0, sha256(witness_script)])),
+            CTxOut(40000000, CScript([OP_1, pubkey5, pubkey6, OP_2, OP_CHECKMULTISIG])),
+            CTxOut(int(unspent[0]["amount"] * 100000000) - 100000000 - 1000000, change_script)
+        ]
+        tx.rehash()
+        signed_tx = self.nodes[0].signrawtransaction(binascii.hexlify(tx.serialize()).decode("utf-8"))
+        script_txid = self.nodes[0].sendrawtransaction(signed_tx["hex"], True)
+        script_block = self.nodes[0].generate(1)[0]
+        self.sync_all()
+
+        deltas5 = self.nodes[1].getaddressdeltas({"addresses": [address5]})
+        assert_equal([(delta["txid"], delta["index"], delta["satoshis"]) for delta in deltas5],
+                     [(script_txid, 0, 10000000), (script_txid, 3, 40000000)])
+        deltas6 = self.nodes[1].getaddressdeltas({"addresses": [address6]})
+        assert_equal([(delta["txid"], delta["index"], delta["satoshis"]) for delta in deltas6], [(script_txid, 3, 40000000)])
+        deltas7 = self.nodes[1].getaddressdeltas({"addresses": [address7]})
+        assert_equal([(delta["txid"], delta["index"], delta["satoshis"]) for delta in deltas7], [(script_txid, 2, 30000000)])
+        deltas8 = self.nodes[1].getaddressdeltas({"addresses": [address8]})
+        assert_equal([(delta["txid"], delta["index"], delta["satoshis"]) for delta in deltas8], [(script_txid, 1, 20000000)])
+        assert_equal(deltas8[0]["address"], address8)
+
+        assert_equal([utxo["outputIndex"] for utxo in self.nodes[1].getaddressutxos({"addresses": [address5]})], [0, 3])
+        assert_equal([utxo["outputIndex"] for utxo in self.nodes[1].getaddressutxos({"addresses": [address6]})], [3])
+        assert_equal([utxo["outputIndex"] for utxo in self.nodes[1].getaddressutxos({"addresses": [address7]})], [2])
+        assert_equal([utxo["outputIndex"] for utxo in self.nodes[1].getaddressutxos({"addresses": [address8]})], [1])
+
+        # The bare multisig output counts in full for each of its keys
+        assert_equal(self.nodes[1].getaddressbalance(address5)["balance"], 50000000)
+        assert_equal(self.nodes[1].getaddressbalance(address6)["balance"], 40000000)
+        assert_equal(self.nodes[1].getaddressbalance(address7)["balance"], 30000000)
+        assert_equal(self.nodes[1].getaddressbalance(address8)["balance"], 20000000)
+        assert_equal(self.nodes[1].getaddresssummary(address6)[0]["received"], 40000000)
+
+        # Disconnecting the block removes the outputs again, and connecting it restores them
+        for node in self.nodes:
+            node.invalidateblock(script_block)
+        self.sync_all()
+        for address in [address5, address6, address7, address8]:
+            assert_equal(self.nodes[1].getaddressdeltas({"addresses": [address]}), [])
+            assert_equal(self.nodes[1].getaddressutxos({"addresses": [address]}), [])
+            assert_equal(self.nodes[1].getaddressbalance(address)["balance"], 0)
+
+        for node in self.nodes:
+            node.reconsiderblock(script_block)
+        self.sync_all()
+        assert_equal(self.nodes[1].getaddressdeltas({"addresses": [address5]}), deltas5)
+        assert_equal(self.nodes[1].getaddressdeltas({"addresses": [address6]}), deltas6)
+        assert_equal(self.nodes[1].getaddressdeltas({"addresses": [address7]}), deltas7)
+        assert_equal(self.nodes[1].getaddressdeltas({"addresses": [address8]}), deltas8)
+        assert_equal(self.nodes[1].getaddressbalance(address5)["balance"], 50000000)
+        assert_equal(self.nodes[1].getaddressbalance(address6)["balance"], 40000000)
+
+        # Build the indexes of the existing chain with one and with several threads
+        print("Testing building the indexes with one and several threads...")
+        addresses = set(["mo9ncXisMeAoXwqcV5EWuyncbmCcQN4rVs", "2N2JD6wb56AfK4tfmM6PwdVmoYk2dCKf4Br",
+                         address1, address2, address3, address4, address5, address6, address7, address8])
+        addresses.update(self.nodes[0].getaddressesbyaccount(""))
+        addresses.update([utxo["address"] for utxo in self.nodes[0].listunspent()])
+        addresses = sorted(addresses)
+
+        stop_node(self.nodes[0], 0)
+        stop_node(self.nodes[4], 4)
+        self.nodes[0] = start_node(0, self.options.tmpdir, ["-debug", "-addressindex", "-spentindex", "-indexbuildthreads=1"])
+        self.nodes[4] = start_node(4, self.options.tmpdir, ["-debug", "-addressindex", "-spentindex", "-indexbuildthreads=4"])
+        for node in [self.nodes[0], self.nodes[4]]:
+            for i in range(60):
+                info = node.getindexinfo()
+                if info["address"]["synced"] and info["spent"]["synced"]:
+                    break
+                time.sleep(1)
+            assert_equal(node.getindexinfo()["address"]["synced"], True)
+            assert_equal(node.getindexinfo()["spent"]["synced"], True)
+
+        for address in addresses:
+            deltas = self.nodes[0].getaddressdeltas({"addresses": [address]})
+            assert_equal(self.nodes[4].getaddressdeltas({"addresses": [address]}), deltas)
+            assert_equal(self.nodes[1].getaddressdeltas({"addresses": [address]}), deltas)
+            utxos = self.nodes[0].getaddressutxos({"addresses": [address]})
+            assert_equal(self.nodes[4].getaddressutxos({"addresses": [address]}), utxos)
+            assert_equal(self.nodes[1].getaddressutxos({"addresses": [address]}), utxos)
+            summary = self.nodes[0].getaddresssummary(address)
+            assert_equal(self.nodes[4].getaddresssummary(address), summary)
+            assert_equal(self.nodes[1].getaddresssummary(address), summary)
+            assert_equal(self.nodes[4].getaddressbalance(address), self.nodes[0].getaddressbalance(address))
+
+            outputs = [{"txid": delta["txid"], "index": delta["index"]} for delta in deltas if delta["satoshis"] > 0]
+            if len(outputs) > 0:
+                assert_equal(self.nodes[4].getspentinfo(outputs), self.nodes[0].getspentinfo(outputs))
+
         print("Passed\n")
 
 
@@ -229,6 +229,9 @@ class RESTTest (BitcoinTestFramework):
         assert_greater_than(int(response_hex.getheader('content-length')), 160)
         response_hex_str = response_hex.read()
         assert_equal(encode(response_str, "hex_codec")[0:160], response_hex_str[0:160])
+        # the whole block is served as stored, the same as getblock without verbose
+        assert_equal(encode(response_str, "hex_codec"), response_hex_str.rstrip())
+        assert_equal(response_hex_str.decode("utf-8").rstrip(), self.nodes[0].getblock(bb_hash, False))
 
         # compare with hex block header
         response_header_hex = http_get_call(url.hostname, url.port, '/rest/headers/1/'+bb_hash+self.FORMAT_SEPARATOR+"hex", True)
@@ -71,6 +71,12 @@ class SpentIndexTest(BitcoinTestFramework):
         assert_equal(info["index"], 0)
         assert_equal(info["height"], 106)
 
+        # Check that a batch comes back in request order, with null for unspent outputs
+        infos = self.nodes[1].getspentinfo([{"txid": txid, "index": 0},
+                                            {"txid": unspent[0]["txid"], "index": unspent[0]["vout"]}])
+        assert_equal(infos[0], None)
+        assert_equal(infos[1], info)
+
         print("Testing getrawtransaction method...")
 
         # Check that verbose raw transaction includes spent info
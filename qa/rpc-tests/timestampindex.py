@@ -54,6 +54,25 @@ class TimestampIndexTest(BitcoinTestFramework):
 
         assert_equal(hashes, blockhashes)
 
+        print("Checking limited and descending scans...")
+        assert_equal(self.nodes[1].getblockhashes(high, low, {"limit": 5}), blockhashes[:5])
+        latest = self.nodes[1].getblockhashes(high, low, {"limit": 10, "descending": True, "logicalTimes": True})
+        assert_equal([item["blockhash"] for item in latest], blockhashes[::-1][:10])
+        assert_equal(latest[0]["logicalts"] > latest[1]["logicalts"], True)
+
+        print("Enabling timestamp index on an existing node...")
+        stop_node(self.nodes[2], 2)
+        self.nodes[2] = start_node(2, self.options.tmpdir, ["-debug", "-timestampindex"])
+        for i in range(60):
+            if self.nodes[2].getindexinfo()["timestamp"]["synced"]:
+                break
+            time.sleep(1)
+        info = self.nodes[2].getindexinfo()["timestamp"]
+        assert_equal(info["enabled"], True)
+        assert_equal(info["synced"], True)
+        assert_equal(info["height"], self.nodes[2].getblockcount())
+        assert_equal(self.nodes[2].getblockhashes(high, low), blockhashes)
+
         print("Passed\n")
 
 
@@ -66,6 +66,14 @@ class TxIndexTest(BitcoinTestFramework):
         assert_equal(verbose["vout"][0]["valueSat"], 5000000000);
         assert_equal(verbose["vout"][0]["value"], 50);
 
+        # A second lookup is answered from the transaction lookup cache
+        info = self.nodes[3].gettxlookupcacheinfo()
+        self.nodes[3].getrawtransaction(unspent[0]["txid"], 1)
+        after = self.nodes[3].gettxlookupcacheinfo()
+        assert_equal(after["hits"], info["hits"] + 1)
+        assert_equal(after["misses"], info["misses"])
+        assert(after["size"] >= 1)
+
         print("Passed\n")
 
 
@@ -87,6 +87,18 @@ struct CAddressUnspentValue {
     bool IsNull() const {
         return (satoshis == -1);
     }
+
+    //! An erase row for an output that is spent, which keeps the amount its value-ordered row is keyed by
+    static CAddressUnspentValue Spent(CAmount sats) {
+        CAddressUnspentValue value;
+        value.satoshis = sats;
+        value.blockHeight = -1;
+        return value;
+    }
+
+    bool IsSpent() const {
+        return (blockHeight == -1);
+    }
 };
 
 struct CAddressIndexKey {
@@ -223,6 +235,284 @@ struct CAddressIndexIteratorHeightKey {
     }
 };
 
+/**
+ * Position in the address index rows of several addresses merged into block
+ * order, behind the rows of the transaction txhash at position txindex of the
+ * block at blockHeight. It is the cursor of paged address index queries.
+ */
+struct CAddressIndexPageKey {
+    int blockHeight;
+    unsigned int txindex;
+    uint256 txhash;
+
+    size_t GetSerializeSize(int nType, int nVersion) const {
+        return 40;
+    }
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const {
+        ser_writedata32be(s, blockHeight);
+        ser_writedata32be(s, txindex);
+        txhash.Serialize(s, nType, nVersion);
+    }
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion) {
+        blockHeight = ser_readdata32be(s);
+        txindex = ser_readdata32be(s);
+        txhash.Unserialize(s, nType, nVersion);
+    }
+
+    CAddressIndexPageKey(int height, unsigned int blockindex, uint256 txid) {
+        blockHeight = height;
+        txindex = blockindex;
+        txhash = txid;
+    }
+
+    CAddressIndexPageKey() {
+        SetNull();
+    }
+
+    void SetNull() {
+        blockHeight = 0;
+        txindex = 0;
+        txhash.SetNull();
+    }
+};
+
+/**
+ * Key of the value-ordered copy of the unspent index. The amount is stored
+ * inverted and big-endian, so that the outputs of an address are iterated
+ * largest first.
+ */
+struct CAddressUnspentValueKey {
+    unsigned int type;
+    uint160 hashBytes;
+    CAmount satoshis;
+    uint256 txhash;
+    size_t index;
+
+    size_t GetSerializeSize(int nType, int nVersion) const {
+        return 65;
+    }
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const {
+        ser_writedata8(s, type);
+        hashBytes.Serialize(s, nType, nVersion);
+        uint64_t inverted = ~(uint64_t)satoshis;
+        ser_writedata32be(s, inverted >> 32);
+        ser_writedata32be(s, inverted & 0xffffffff);
+        txhash.Serialize(s, nType, nVersion);
+        ser_writedata32(s, index);
+    }
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion) {
+        type = ser_readdata8(s);
+        hashBytes.Unserialize(s, nType, nVersion);
+        uint64_t inverted = (uint64_t)ser_readdata32be(s) << 32;
+        inverted |= ser_readdata32be(s);
+        satoshis = (CAmount)~inverted;
+        txhash.Unserialize(s, nType, nVersion);
+        index = ser_readdata32(s);
+    }
+
+    CAddressUnspentValueKey(const CAddressUnspentKey &key, CAmount amount) {
+        type = key.type;
+        hashBytes = key.hashBytes;
+        satoshis = amount;
+        txhash = key.txhash;
+        index = key.index;
+    }
+
+    CAddressUnspentValueKey() {
+        SetNull();
+    }
+
+    void SetNull() {
+        type = 0;
+        hashBytes.SetNull();
+        satoshis = 0;
+        txhash.SetNull();
+        index = 0;
+    }
+
+    CAddressUnspentKey GetUnspentKey() const {
+        return CAddressUnspentKey(type, hashBytes, txhash, index);
+    }
+};
+
+/** Restrictions applied while scanning the unspent outputs of an address */
+struct CAddressUnspentFilter {
+    //! only outputs confirmed in [nMinHeight, nMaxHeight], nMaxHeight < 0 for no upper bound
+    int nMinHeight;
+    int nMaxHeight;
+    //! only outputs worth at least this much
+    CAmount nMinValue;
+    //! stop once the selected outputs add up to this much, 0 for no target
+    CAmount nTargetValue;
+    //! scan the value-ordered copy of the index, largest outputs first
+    bool fByValue;
+
+    CAddressUnspentFilter() {
+        SetNull();
+    }
+
+    void SetNull() {
+        nMinHeight = 0;
+        nMaxHeight = -1;
+        nMinValue = 0;
+        nTargetValue = 0;
+        fByValue = false;
+    }
+
+    bool Matches(const CAddressUnspentValue &value) const {
+        if (value.blockHeight < nMinHeight)
+            return false;
+        if (nMaxHeight >= 0 && value.blockHeight > nMaxHeight)
+            return false;
+        return value.satoshis >= nMinValue;
+    }
+};
+
+struct CAddressSummaryValue {
+    CAmount balance;
+    CAmount received;
+    unsigned int txCount;
+    int firstHeight;
+    int lastHeight;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(balance);
+        READWRITE(received);
+        READWRITE(VARINT(txCount));
+        READWRITE(VARINT(firstHeight));
+        READWRITE(VARINT(lastHeight));
+    }
+
+    CAddressSummaryValue() {
+        SetNull();
+    }
+
+    void SetNull() {
+        balance = 0;
+        received = 0;
+        txCount = 0;
+        firstHeight = 0;
+        lastHeight = 0;
+    }
+
+    bool IsNull() const {
+        return (txCount == 0);
+    }
+};
+
+/** Membership of an address in a named watch set, ordered by address to find the sets of an address */
+struct CAddressWatchKey {
+    unsigned int type;
+    uint160 hashBytes;
+    std::string name;
+
+    size_t GetSerializeSize(int nType, int nVersion) const {
+        return 21 + ::GetSerializeSize(name, nType, nVersion);
+    }
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const {
+        ser_writedata8(s, type);
+        hashBytes.Serialize(s, nType, nVersion);
+        ::Serialize(s, name, nType, nVersion);
+    }
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion) {
+        type = ser_readdata8(s);
+        hashBytes.Unserialize(s, nType, nVersion);
+        ::Unserialize(s, name, nType, nVersion);
+    }
+
+    CAddressWatchKey(unsigned int addressType, uint160 addressHash, const std::string &setName) {
+        type = addressType;
+        hashBytes = addressHash;
+        name = setName;
+    }
+
+    CAddressWatchKey() {
+        SetNull();
+    }
+
+    void SetNull() {
+        type = 0;
+        hashBytes.SetNull();
+        name.clear();
+    }
+};
+
+/** The same membership ordered by set, to list and load the addresses of a set */
+struct CAddressWatchSetKey {
+    std::string name;
+    unsigned int type;
+    uint160 hashBytes;
+
+    size_t GetSerializeSize(int nType, int nVersion) const {
+        return ::GetSerializeSize(name, nType, nVersion) + 21;
+    }
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const {
+        ::Serialize(s, name, nType, nVersion);
+        ser_writedata8(s, type);
+        hashBytes.Serialize(s, nType, nVersion);
+    }
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion) {
+        ::Unserialize(s, name, nType, nVersion);
+        type = ser_readdata8(s);
+        hashBytes.Unserialize(s, nType, nVersion);
+    }
+
+    CAddressWatchSetKey(const std::string &setName, unsigned int addressType, uint160 addressHash) {
+        name = setName;
+        type = addressType;
+        hashBytes = addressHash;
+    }
+
+    CAddressWatchSetKey() {
+        SetNull();
+    }
+
+    void SetNull() {
+        name.clear();
+        type = 0;
+        hashBytes.SetNull();
+    }
+};
+
+/** The address index rows of one block that touch the addresses of a watch set */
+struct CAddressWatchMatchKey {
+    std::string name;
+    uint256 blockHash;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(name);
+        READWRITE(blockHash);
+    }
+
+    CAddressWatchMatchKey(const std::string &setName, const uint256 &hash) {
+        name = setName;
+        blockHash = hash;
+    }
+
+    CAddressWatchMatchKey() {
+        SetNull();
+    }
+
+    void SetNull() {
+        name.clear();
+        blockHash.SetNull();
+    }
+};
+
 struct CMempoolAddressDelta
 {
     int64_t time;
@@ -270,6 +560,38 @@ struct CMempoolAddressDeltaKey
     }
 };
 
+struct CAddressIndexKeyCompare
+{
+    bool operator()(const CAddressIndexKey& a, const CAddressIndexKey& b) const {
+        if (a.type != b.type)
+            return a.type < b.type;
+        if (a.hashBytes != b.hashBytes)
+            return a.hashBytes < b.hashBytes;
+        if (a.blockHeight != b.blockHeight)
+            return a.blockHeight < b.blockHeight;
+        if (a.txindex != b.txindex)
+            return a.txindex < b.txindex;
+        if (a.txhash != b.txhash)
+            return a.txhash < b.txhash;
+        if (a.index != b.index)
+            return a.index < b.index;
+        return a.spending < b.spending;
+    }
+};
+
+struct CAddressUnspentKeyCompare
+{
+    bool operator()(const CAddressUnspentKey& a, const CAddressUnspentKey& b) const {
+        if (a.type != b.type)
+            return a.type < b.type;
+        if (a.hashBytes != b.hashBytes)
+            return a.hashBytes < b.hashBytes;
+        if (a.txhash != b.txhash)
+            return a.txhash < b.txhash;
+        return a.index < b.index;
+    }
+};
+
 struct CMempoolAddressDeltaKeyCompare
 {
     bool operator()(const CMempoolAddressDeltaKey& a, const CMempoolAddressDeltaKey& b) const {
@@ -0,0 +1,188 @@
+// Copyright (c) 2009-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addresswatch.h"
+
+#include "random.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <algorithm>
+#include <limits>
+
+#include <boost/bind.hpp>
+
+CAddressWatchSets addressWatchSets;
+
+static std::vector<unsigned char> FilterKey(unsigned int type, const uint160 &hashBytes)
+{
+    std::vector<unsigned char> vKey(1 + hashBytes.size());
+    vKey[0] = (unsigned char)type;
+    std::copy(hashBytes.begin(), hashBytes.end(), vKey.begin() + 1);
+    return vKey;
+}
+
+CAddressWatchSets::CAddressWatchSets() : pdb(NULL), nFilterCapacity(0), nFilterElements(0)
+{
+}
+
+void CAddressWatchSets::CountEntry(const CAddressWatchSetKey &key)
+{
+    mapSets[key.name]++;
+}
+
+void CAddressWatchSets::InsertEntry(const CAddressWatchSetKey &key)
+{
+    filter.insert(FilterKey(key.type, key.hashBytes));
+    nFilterElements++;
+}
+
+bool CAddressWatchSets::RebuildFilter()
+{
+    AssertLockHeld(cs);
+
+    unsigned int nAddresses = 0;
+    for (std::map<std::string, unsigned int>::const_iterator it = mapSets.begin(); it != mapSets.end(); it++)
+        nAddresses += it->second;
+
+    // Leave room to grow before the filter has to be rebuilt again
+    nFilterCapacity = std::max(MIN_ADDRESS_WATCH_FILTER_ELEMENTS, 2 * nAddresses);
+    nFilterElements = 0;
+    filter = CBloomFilter(nFilterCapacity, ADDRESS_WATCH_FILTER_FP_RATE, GetRand(std::numeric_limits<unsigned int>::max()));
+    if (nAddresses == 0)
+        return true;
+
+    if (!pdb->ReadAddressWatchSets(boost::bind(&CAddressWatchSets::InsertEntry, this, _1)))
+        return error("%s: failed to read address watch sets", __func__);
+
+    LogPrintf("%s: %u addresses in %u watch sets\n", __func__, nFilterElements, mapSets.size());
+    return true;
+}
+
+bool CAddressWatchSets::Load(CBlockTreeDB *pdbIn)
+{
+    LOCK(cs);
+    pdb = pdbIn;
+    mapSets.clear();
+    if (!pdb->ReadAddressWatchSets(boost::bind(&CAddressWatchSets::CountEntry, this, _1)))
+        return error("%s: failed to read address watch sets", __func__);
+    return RebuildFilter();
+}
+
+void CAddressWatchSets::Clear()
+{
+    LOCK(cs);
+    pdb = NULL;
+    mapSets.clear();
+    filter = CBloomFilter();
+    nFilterCapacity = 0;
+    nFilterElements = 0;
+}
+
+bool CAddressWatchSets::Add(const std::string &name, const std::vector<std::pair<uint160, int> > &addresses, unsigned int &nAdded)
+{
+    LOCK(cs);
+    if (!pdb)
+        return false;
+
+    std::vector<std::pair<uint160, int> > vNew;
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = addresses.begin(); it != addresses.end(); it++)
+        if (!pdb->HaveAddressWatch(name, it->first, it->second))
+            vNew.push_back(*it);
+    // The same address may be given twice
+    std::sort(vNew.begin(), vNew.end());
+    vNew.erase(std::unique(vNew.begin(), vNew.end()), vNew.end());
+
+    nAdded = vNew.size();
+    if (vNew.empty())
+        return true;
+    if (!pdb->UpdateAddressWatchSet(name, vNew, true))
+        return error("%s: failed to write address watch set %s", __func__, name);
+    mapSets[name] += vNew.size();
+
+    if (nFilterElements + vNew.size() > nFilterCapacity)
+        return RebuildFilter();
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = vNew.begin(); it != vNew.end(); it++) {
+        filter.insert(FilterKey(it->second, it->first));
+        nFilterElements++;
+    }
+    return true;
+}
+
+bool CAddressWatchSets::Remove(const std::string &name, const std::vector<std::pair<uint160, int> > &addresses, unsigned int &nRemoved)
+{
+    LOCK(cs);
+    if (!pdb)
+        return false;
+
+    std::vector<std::pair<uint160, int> > vGone;
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = addresses.begin(); it != addresses.end(); it++)
+        if (pdb->HaveAddressWatch(name, it->first, it->second))
+            vGone.push_back(*it);
+    std::sort(vGone.begin(), vGone.end());
+    vGone.erase(std::unique(vGone.begin(), vGone.end()), vGone.end());
+
+    nRemoved = vGone.size();
+    if (vGone.empty())
+        return true;
+    if (!pdb->UpdateAddressWatchSet(name, vGone, false))
+        return error("%s: failed to write address watch set %s", __func__, name);
+    mapSets[name] -= vGone.size();
+    if (mapSets[name] == 0) {
+        // A set created again under the same name starts without matches
+        mapSets.erase(name);
+        if (!pdb->EraseAddressWatchMatches(name))
+            return error("%s: failed to erase the matches of address watch set %s", __func__, name);
+    }
+
+    // Removed addresses stay in the filter and are only turned away on disk,
+    // until they make up most of it
+    unsigned int nAddresses = 0;
+    for (std::map<std::string, unsigned int>::const_iterator it = mapSets.begin(); it != mapSets.end(); it++)
+        nAddresses += it->second;
+    if (nFilterElements > MIN_ADDRESS_WATCH_FILTER_ELEMENTS && nFilterElements > 4 * nAddresses)
+        return RebuildFilter();
+    return true;
+}
+
+void CAddressWatchSets::List(std::map<std::string, unsigned int> &sets) const
+{
+    LOCK(cs);
+    sets = mapSets;
+}
+
+bool CAddressWatchSets::IsEmpty() const
+{
+    LOCK(cs);
+    return mapSets.empty();
+}
+
+bool CAddressWatchSets::Match(const std::vector<std::pair<CAddressIndexKey, CAmount> > &rows,
+                              std::map<std::string, std::vector<std::pair<CAddressIndexKey, CAmount> > > &matches) const
+{
+    LOCK(cs);
+    if (mapSets.empty())
+        return true;
+
+    // The sets of each address that passed the filter, read once per call
+    std::map<std::pair<uint160, int>, std::vector<std::string> > mapNames;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = rows.begin(); it != rows.end(); it++) {
+        const CAddressIndexKey &key = it->first;
+        if (!filter.contains(FilterKey(key.type, key.hashBytes)))
+            continue;
+
+        std::pair<uint160, int> address(key.hashBytes, key.type);
+        std::map<std::pair<uint160, int>, std::vector<std::string> >::iterator itNames = mapNames.find(address);
+        if (itNames == mapNames.end()) {
+            itNames = mapNames.insert(std::make_pair(address, std::vector<std::string>())).first;
+            if (!pdb->ReadAddressWatchSetNames(key.hashBytes, key.type, itNames->second))
+                return error("%s: failed to read the watch sets of an address", __func__);
+        }
+
+        for (std::vector<std::string>::const_iterator itName = itNames->second.begin(); itName != itNames->second.end(); itName++)
+            matches[*itName].push_back(*it);
+    }
+
+    return true;
+}
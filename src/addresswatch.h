@@ -0,0 +1,71 @@
+// Copyright (c) 2009-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_ADDRESSWATCH_H
+#define BITCOIN_ADDRESSWATCH_H
+
+#include "addressindex.h"
+#include "bloom.h"
+#include "sync.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+class CBlockTreeDB;
+
+/** The smallest number of addresses the watch filter is sized for */
+static const unsigned int MIN_ADDRESS_WATCH_FILTER_ELEMENTS = 10000;
+/** False positive rate of the watch filter once it holds as many addresses as it was sized for */
+static const double ADDRESS_WATCH_FILTER_FP_RATE = 0.0001;
+/** Maximum length of the name of a watch set */
+static const unsigned int MAX_ADDRESS_WATCH_NAME_LENGTH = 64;
+
+/**
+ * Named sets of addresses whose address index rows are collected per block
+ * while the rows are produced. The sets are kept on disk; in memory there is
+ * only a bloom filter over every watched address, so that the cost per block
+ * depends on the size of the block and not on the size of the sets. Rows the
+ * filter lets through are confirmed against the disk.
+ */
+class CAddressWatchSets
+{
+private:
+    mutable CCriticalSection cs;
+    CBlockTreeDB *pdb;
+    CBloomFilter filter;
+    //! number of addresses the filter was sized for
+    unsigned int nFilterCapacity;
+    //! number of addresses inserted into the filter, including removed ones
+    unsigned int nFilterElements;
+    //! number of addresses in each set
+    std::map<std::string, unsigned int> mapSets;
+
+    void CountEntry(const CAddressWatchSetKey &key);
+    void InsertEntry(const CAddressWatchSetKey &key);
+    //! Size the filter for the current sets and fill it from disk
+    bool RebuildFilter();
+
+public:
+    CAddressWatchSets();
+
+    //! Read the sets from the given database, which the sets then keep using
+    bool Load(CBlockTreeDB *pdbIn);
+    void Clear();
+
+    //! Add addresses to a set, creating it if needed; nAdded counts the ones not in it yet
+    bool Add(const std::string &name, const std::vector<std::pair<uint160, int> > &addresses, unsigned int &nAdded);
+    //! Remove addresses from a set, which is gone once it is empty
+    bool Remove(const std::string &name, const std::vector<std::pair<uint160, int> > &addresses, unsigned int &nRemoved);
+    void List(std::map<std::string, unsigned int> &sets) const;
+    bool IsEmpty() const;
+
+    /** Sort the given address index rows into the sets their address belongs to */
+    bool Match(const std::vector<std::pair<CAddressIndexKey, CAmount> > &rows,
+               std::map<std::string, std::vector<std::pair<CAddressIndexKey, CAmount> > > &matches) const;
+};
+
+extern CAddressWatchSets addressWatchSets;
+
+#endif // BITCOIN_ADDRESSWATCH_H
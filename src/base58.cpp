@@ -279,20 +279,41 @@ CTxDestination CBitcoinAddress::Get() const
 
 bool CBitcoinAddress::GetIndexKey(uint160& hashBytes, int& type) const
 {
-    if (!IsValid()) {
+    if (vchData.size() != 20) {
         return false;
     } else if (vchVersion == Params().Base58Prefix(CChainParams::PUBKEY_ADDRESS)) {
-        memcpy(&hashBytes, &vchData[0], 20);
         type = 1;
-        return true;
     } else if (vchVersion == Params().Base58Prefix(CChainParams::SCRIPT_ADDRESS) ||
                vchVersion == Params().Base58Prefix(CChainParams::SCRIPT_ADDRESS2)) {
-        memcpy(&hashBytes, &vchData[0], 20);
         type = 2;
-        return true;
+    } else if (vchVersion == Params().Base58Prefix(CChainParams::WITNESS_KEY_ADDRESS)) {
+        type = 3;
+    } else if (vchVersion == Params().Base58Prefix(CChainParams::WITNESS_SCRIPT_ADDRESS)) {
+        type = 4;
+    } else {
+        return false;
     }
 
-    return false;
+    memcpy(&hashBytes, &vchData[0], 20);
+    return true;
+}
+
+bool CBitcoinAddress::SetIndexKey(const uint160& hashBytes, int type)
+{
+    switch (type) {
+    case 1:
+        return Set(CKeyID(hashBytes));
+    case 2:
+        return Set(CScriptID(hashBytes));
+    case 3:
+        SetData(Params().Base58Prefix(CChainParams::WITNESS_KEY_ADDRESS), &hashBytes, 20);
+        return true;
+    case 4:
+        SetData(Params().Base58Prefix(CChainParams::WITNESS_SCRIPT_ADDRESS), &hashBytes, 20);
+        return true;
+    default:
+        return false;
+    }
 }
 
 bool CBitcoinAddress::GetKeyID(CKeyID& keyID) const
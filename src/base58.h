@@ -100,6 +100,8 @@ public:
  * The data vector contains RIPEMD160(SHA256(pubkey)), where pubkey is the serialized public key.
  * Script-hash-addresses have version 5 (or 196 testnet).
  * The data vector contains RIPEMD160(SHA256(cscript)), where cscript is the serialized redemption script.
+ * The address and spent indexes also name P2WPKH and P2WSH outputs by the key or
+ * witness script hash under versions of their own, which are not valid to pay to.
  */
 class CBitcoinAddress : public CBase58Data {
 public:
@@ -117,6 +119,7 @@ public:
     CTxDestination Get() const;
     bool GetKeyID(CKeyID &keyID) const;
     bool GetIndexKey(uint160& hashBytes, int& type) const;
+    bool SetIndexKey(const uint160& hashBytes, int type);
     bool IsScript() const;
 };
 
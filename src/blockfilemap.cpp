@@ -0,0 +1,104 @@
+// Copyright (c) 2009-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilemap.h"
+
+#include "crypto/common.h"
+#include "main.h"
+#include "util.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CBlockFileMap blockFileMap;
+
+CMappedBlockFile::~CMappedBlockFile()
+{
+#ifndef WIN32
+    munmap(const_cast<unsigned char*>(pdata), nLength);
+#endif
+}
+
+/** Map the block or undo file of pos with its current size, up to MAX_BLOCKFILE_SIZE */
+static std::shared_ptr<const CMappedBlockFile> MapBlockFile(const CDiskBlockPos &pos, bool fUndo)
+{
+#ifdef WIN32
+    return std::shared_ptr<const CMappedBlockFile>();
+#else
+    boost::filesystem::path path = GetBlockPosFilename(pos, fUndo ? "rev" : "blk");
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return std::shared_ptr<const CMappedBlockFile>();
+    struct stat st;
+    size_t nLength = 0;
+    void* pdata = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        nLength = std::min((size_t)st.st_size, (size_t)MAX_BLOCKFILE_SIZE);
+        pdata = mmap(NULL, nLength, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (pdata == MAP_FAILED) {
+        LogPrintf("Unable to map %s\n", path.string());
+        return std::shared_ptr<const CMappedBlockFile>();
+    }
+    return std::make_shared<const CMappedBlockFile>((const unsigned char*)pdata, nLength);
+#endif
+}
+
+bool CBlockFileMap::GetRecord(const CDiskBlockPos &pos, bool fUndo, unsigned int nTrailer, CMappedRecord &record)
+{
+    // Every record follows the network magic and its size
+    if (pos.nPos < 8)
+        return false;
+
+    LOCK(cs);
+    std::shared_ptr<const CMappedBlockFile> &pfile = mapFiles[std::make_pair(pos.nFile, fUndo)];
+    bool fMapped = false;
+    while (true) {
+        if (!pfile) {
+            pfile = MapBlockFile(pos, fUndo);
+            if (!pfile) {
+                mapFiles.erase(std::make_pair(pos.nFile, fUndo));
+                return false;
+            }
+            fMapped = true;
+        }
+        if (pfile->nLength >= pos.nPos) {
+            uint64_t nEnd = (uint64_t)pos.nPos + ReadLE32(pfile->pdata + pos.nPos - 4) + nTrailer;
+            if (nEnd <= pfile->nLength) {
+                record.pfile = pfile;
+                record.pbegin = pfile->pdata + pos.nPos;
+                record.pend = pfile->pdata + nEnd;
+                return true;
+            }
+        }
+        // Map the file again in case it grew since it was mapped
+        if (fMapped)
+            return false;
+        pfile.reset();
+    }
+}
+
+void CBlockFileMap::Unmap(int nFile)
+{
+    LOCK(cs);
+    mapFiles.erase(std::make_pair(nFile, false));
+    mapFiles.erase(std::make_pair(nFile, true));
+}
+
+void CBlockFileMap::Clear()
+{
+    LOCK(cs);
+    mapFiles.clear();
+}
+
+size_t CBlockFileMap::Size() const
+{
+    LOCK(cs);
+    return mapFiles.size();
+}
@@ -0,0 +1,73 @@
+// Copyright (c) 2009-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILEMAP_H
+#define BITCOIN_BLOCKFILEMAP_H
+
+#include "sync.h"
+
+#include <stddef.h>
+
+#include <map>
+#include <memory>
+#include <utility>
+
+struct CDiskBlockPos;
+
+/** Default for -mmapblocks */
+static const bool DEFAULT_MMAP_BLOCKS = false;
+
+/** A block or undo file mapped read-only, unmapped once the last user lets go of it */
+class CMappedBlockFile
+{
+private:
+    // Disallow copies
+    CMappedBlockFile(const CMappedBlockFile&);
+    CMappedBlockFile& operator=(const CMappedBlockFile&);
+
+public:
+    const unsigned char* pdata;
+    size_t nLength;
+
+    CMappedBlockFile(const unsigned char* pdataIn, size_t nLengthIn) : pdata(pdataIn), nLength(nLengthIn) {}
+    ~CMappedBlockFile();
+};
+
+/** A record in a mapped file, which keeps the mapping alive while it is read */
+struct CMappedRecord
+{
+    std::shared_ptr<const CMappedBlockFile> pfile;
+    const unsigned char* pbegin;
+    const unsigned char* pend;
+};
+
+/**
+ * Read-only mappings of block and undo files, made the first time a record
+ * of a file is read. A file is mapped with the size it has at that time, at
+ * most MAX_BLOCKFILE_SIZE; it is mapped again once a record past the end of
+ * its mapping is read, because undo data can still be appended to older files.
+ */
+class CBlockFileMap
+{
+private:
+    mutable CCriticalSection cs;
+    //! mappings by file number, and whether it is the undo file
+    std::map<std::pair<int, bool>, std::shared_ptr<const CMappedBlockFile> > mapFiles;
+
+public:
+    /**
+     * Find the record at pos, which the size in the record header in front of
+     * it tells the length of, plus nTrailer bytes after it. Returns false if
+     * the file cannot be mapped or the record is not all in the mapping.
+     */
+    bool GetRecord(const CDiskBlockPos &pos, bool fUndo, unsigned int nTrailer, CMappedRecord &record);
+    //! Drop the mappings of a block file and its undo file
+    void Unmap(int nFile);
+    void Clear();
+    size_t Size() const;
+};
+
+extern CBlockFileMap blockFileMap;
+
+#endif // BITCOIN_BLOCKFILEMAP_H
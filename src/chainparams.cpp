@@ -127,6 +127,8 @@ public:
         base58Prefixes[PUBKEY_ADDRESS] = std::vector<unsigned char>(1,0x41); // prefix T
         base58Prefixes[SCRIPT_ADDRESS] = std::vector<unsigned char>(1,0x25); // prefix [F G]
         base58Prefixes[SCRIPT_ADDRESS2] = std::vector<unsigned char>(1,0x25); // prefix [F G]
+        base58Prefixes[WITNESS_KEY_ADDRESS] = std::vector<unsigned char>(1,0x49); // prefix W
+        base58Prefixes[WITNESS_SCRIPT_ADDRESS] = std::vector<unsigned char>(1,0x4b); // prefix X
         base58Prefixes[SECRET_KEY] =     std::vector<unsigned char>(1,0x46); // prefix compressed=B, uncompressed=3 
         base58Prefixes[EXT_PUBLIC_KEY] = boost::assign::list_of(0x04)(0x31)(0xd3)(0xa6).convert_to_container<std::vector<unsigned char> >(); // prefix teaL
         base58Prefixes[EXT_SECRET_KEY] = boost::assign::list_of(0x02)(0x2a)(0x0b)(0x33).convert_to_container<std::vector<unsigned char> >(); // prefix TeaL
@@ -233,6 +235,8 @@ public:
         base58Prefixes[PUBKEY_ADDRESS] = std::vector<unsigned char>(1,0x7f); // prefix t
         base58Prefixes[SCRIPT_ADDRESS] = std::vector<unsigned char>(1,0x60); // prefix [f g]
         base58Prefixes[SCRIPT_ADDRESS2] = std::vector<unsigned char>(1,0x60); // prefix [f g]
+        base58Prefixes[WITNESS_KEY_ADDRESS] = std::vector<unsigned char>(1,0x87); // prefix w
+        base58Prefixes[WITNESS_SCRIPT_ADDRESS] = std::vector<unsigned char>(1,0x89); // prefix x
         base58Prefixes[SECRET_KEY] =     std::vector<unsigned char>(1,0xe6); // prefix compressed=b, uncompressed=8
         base58Prefixes[EXT_PUBLIC_KEY] = boost::assign::list_of(0x04)(0x31)(0xee)(0xbd).convert_to_container<std::vector<unsigned char> >(); // prefix tesT
         base58Prefixes[EXT_SECRET_KEY] = boost::assign::list_of(0x02)(0x2a)(0x26)(0x49).convert_to_container<std::vector<unsigned char> >(); // prefix TesT
@@ -333,6 +337,8 @@ public:
         base58Prefixes[PUBKEY_ADDRESS] = std::vector<unsigned char>(1,0x7f); // prefix t
         base58Prefixes[SCRIPT_ADDRESS] = std::vector<unsigned char>(1,0x60); // prefix [f g]
         base58Prefixes[SCRIPT_ADDRESS2] = std::vector<unsigned char>(1,0x60); // prefix [f g]
+        base58Prefixes[WITNESS_KEY_ADDRESS] = std::vector<unsigned char>(1,0x87); // prefix w
+        base58Prefixes[WITNESS_SCRIPT_ADDRESS] = std::vector<unsigned char>(1,0x89); // prefix x
         base58Prefixes[SECRET_KEY] =     std::vector<unsigned char>(1,0xe6); // prefix compressed=b, uncompressed=8
         base58Prefixes[EXT_PUBLIC_KEY] = boost::assign::list_of(0x04)(0x31)(0xee)(0xbd).convert_to_container<std::vector<unsigned char> >(); // prefix tesT
         base58Prefixes[EXT_SECRET_KEY] = boost::assign::list_of(0x02)(0x2a)(0x26)(0x49).convert_to_container<std::vector<unsigned char> >(); // prefix TesT
@@ -47,6 +47,8 @@ public:
         PUBKEY_ADDRESS,
         SCRIPT_ADDRESS,
         SCRIPT_ADDRESS2,
+        WITNESS_KEY_ADDRESS,
+        WITNESS_SCRIPT_ADDRESS,
         SECRET_KEY,
         EXT_PUBLIC_KEY,
         EXT_SECRET_KEY,
@@ -8,6 +8,7 @@
 #include "random.h"
 
 #include <assert.h>
+#include <map>
 
 /**
  * calculate number of bytes for the bitmask, and its number of non-zero bytes
@@ -58,7 +59,10 @@ CCoinsViewCursor *CCoinsViewBacked::Cursor() const { return base->Cursor(); }
 
 SaltedTxidHasher::SaltedTxidHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), cachedCoinsUsage(0) { }
+CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false),
+    cacheCoinsPool(PoolNodeSize<CCoinsMap::value_type>()),
+    cacheCoins(0, SaltedTxidHasher(), std::equal_to<uint256>(), CCoinsMapAllocator(&cacheCoinsPool)),
+    cachedCoinsUsage(0), nTick(0) { }
 
 CCoinsViewCache::~CCoinsViewCache()
 {
@@ -71,13 +75,16 @@ size_t CCoinsViewCache::DynamicMemoryUsage() const {
 
 CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const {
     CCoinsMap::iterator it = cacheCoins.find(txid);
-    if (it != cacheCoins.end())
+    if (it != cacheCoins.end()) {
+        it->second.nLastUsed = nTick;
         return it;
+    }
     CCoins tmp;
     if (!base->GetCoins(txid, tmp))
         return cacheCoins.end();
     CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
     tmp.swap(ret->second.coins);
+    ret->second.nLastUsed = nTick;
     if (ret->second.coins.IsPruned()) {
         // The parent only has an empty entry for this txid; we can consider our
         // version as fresh.
@@ -87,6 +94,20 @@ CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const
     return ret;
 }
 
+void CCoinsViewCache::CacheFetchedCoins(const uint256 &txid, CCoins &coins) {
+    assert(!hasModifier);
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    if (!ret.second)
+        return;
+    coins.swap(ret.first->second.coins);
+    ret.first->second.nLastUsed = nTick;
+    if (ret.first->second.coins.IsPruned()) {
+        // As in FetchCoins, the parent only has an empty entry for this txid
+        ret.first->second.flags = CCoinsCacheEntry::FRESH;
+    }
+    cachedCoinsUsage += ret.first->second.coins.DynamicMemoryUsage();
+}
+
 bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) const {
     CCoinsMap::const_iterator it = FetchCoins(txid);
     if (it != cacheCoins.end()) {
@@ -112,8 +133,10 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
     } else {
         cachedCoinUsage = ret.first->second.coins.DynamicMemoryUsage();
     }
+    ret.first->second.SetStored();
     // Assume that whenever ModifyCoins is called, the entry will be modified.
     ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
+    ret.first->second.nLastUsed = nTick;
     return CCoinsModifier(*this, ret.first, cachedCoinUsage);
 }
 
@@ -127,8 +150,12 @@ CCoinsModifier CCoinsViewCache::ModifyNewCoins(const uint256 &txid, bool coinbas
     ret.first->second.coins.Clear();
     if (!coinbase) {
         ret.first->second.flags = CCoinsCacheEntry::FRESH;
+    } else {
+        // A duplicate coinbase replaces outputs that the parent view may have with different ones
+        ret.first->second.flags &= ~CCoinsCacheEntry::STORED;
     }
     ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
+    ret.first->second.nLastUsed = nTick;
     return CCoinsModifier(*this, ret.first, 0);
 }
 
@@ -163,6 +190,7 @@ uint256 CCoinsViewCache::GetBestBlock() const {
 
 void CCoinsViewCache::SetBestBlock(const uint256 &hashBlockIn) {
     hashBlock = hashBlockIn;
+    nTick++;
 }
 
 bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn) {
@@ -180,11 +208,15 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                     entry.coins.swap(it->second.coins);
                     cachedCoinsUsage += entry.coins.DynamicMemoryUsage();
                     entry.flags = CCoinsCacheEntry::DIRTY;
+                    entry.nLastUsed = nTick;
                     // We can mark it FRESH in the parent if it was FRESH in the child
                     // Otherwise it might have just been flushed from the parent's cache
                     // and already exist in the grandparent
                     if (it->second.flags & CCoinsCacheEntry::FRESH)
                         entry.flags |= CCoinsCacheEntry::FRESH;
+                    // For the same reason what the child knows about the outputs in our parent holds
+                    entry.flags |= it->second.flags & CCoinsCacheEntry::STORED;
+                    entry.nStored = it->second.nStored;
                 }
             } else {
                 // Found the entry in the parent cache
@@ -196,10 +228,16 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                     cacheCoins.erase(itUs);
                 } else {
                     // A normal modification.
+                    itUs->second.SetStored();
+                    // A FRESH child entry was created anew over our pruned one, e.g. by a transaction
+                    // connected again at another height, so the stored outputs may not match it
+                    if (it->second.flags & CCoinsCacheEntry::FRESH)
+                        itUs->second.flags &= ~CCoinsCacheEntry::STORED;
                     cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
                     itUs->second.coins.swap(it->second.coins);
                     cachedCoinsUsage += itUs->second.coins.DynamicMemoryUsage();
                     itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+                    itUs->second.nLastUsed = nTick;
                 }
             }
         }
@@ -207,16 +245,88 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
         mapCoins.erase(itOld);
     }
     hashBlock = hashBlockIn;
+    nTick++;
     return true;
 }
 
 bool CCoinsViewCache::Flush() {
     bool fOk = base->BatchWrite(cacheCoins, hashBlock);
     cacheCoins.clear();
+    // Hand the memory of the flushed entries back, rather than keeping it for entries to come
+    cacheCoinsPool.Clear();
     cachedCoinsUsage = 0;
     return fOk;
 }
 
+uint32_t CCoinsViewCache::OldestTickToKeep(size_t nKeepUsage) const {
+    // An empty map still counts its buckets
+    if (nKeepUsage >= DynamicMemoryUsage() || cacheCoins.empty())
+        return 0;
+    if (nKeepUsage == 0)
+        return nTick + 1;
+    // Add up the usage of the entries by the tick they were last used at,
+    // sharing the map itself out evenly between them
+    size_t nEntryUsage = memusage::DynamicUsage(cacheCoins) / cacheCoins.size();
+    std::map<uint32_t, size_t> mapUsageByTick;
+    for (CCoinsMap::const_iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++)
+        mapUsageByTick[it->second.nLastUsed] += nEntryUsage + it->second.coins.DynamicMemoryUsage();
+    size_t nUsage = 0;
+    for (std::map<uint32_t, size_t>::reverse_iterator it = mapUsageByTick.rbegin(); it != mapUsageByTick.rend(); it++) {
+        nUsage += it->second;
+        if (nUsage > nKeepUsage)
+            return it->first + 1;
+    }
+    return 0;
+}
+
+void CCoinsViewCache::TakeChanges(CCoinsMap &mapCoins, size_t nKeepUsage) {
+    assert(!hasModifier);
+    uint32_t nOldest = OldestTickToKeep(nKeepUsage);
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        bool fDirty = it->second.flags & CCoinsCacheEntry::DIRTY;
+        bool fPruned = it->second.coins.IsPruned();
+        // Spent coins are dropped too, as there is nothing left to look up
+        bool fDrop = it->second.nLastUsed < nOldest || (fDirty && fPruned);
+        if (fDrop)
+            cachedCoinsUsage -= it->second.coins.DynamicMemoryUsage();
+        // Coins created and spent since the last flush are not in the base, so there is nothing to write
+        if (fDirty && !(fPruned && (it->second.flags & CCoinsCacheEntry::FRESH))) {
+            CCoinsCacheEntry& entry = mapCoins[it->first];
+            if (fDrop)
+                entry.coins.swap(it->second.coins);
+            else
+                entry.coins = it->second.coins;
+            // FRESH and STORED tell the base there is nothing of the coins to look up before writing them
+            entry.flags = CCoinsCacheEntry::DIRTY | (it->second.flags & (CCoinsCacheEntry::FRESH | CCoinsCacheEntry::STORED));
+            entry.nStored = it->second.nStored;
+        }
+        if (fDrop) {
+            cacheCoins.erase(it++);
+            continue;
+        }
+        if (fDirty)
+            it->second.flags = 0;
+        it++;
+    }
+    if (cacheCoins.empty())
+        cacheCoinsPool.Clear();
+}
+
+void CCoinsViewCache::EvictUnmodified(size_t nKeepUsage) {
+    assert(!hasModifier);
+    uint32_t nOldest = OldestTickToKeep(nKeepUsage);
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        if (it->second.nLastUsed < nOldest && !(it->second.flags & CCoinsCacheEntry::DIRTY)) {
+            cachedCoinsUsage -= it->second.coins.DynamicMemoryUsage();
+            cacheCoins.erase(it++);
+        } else {
+            it++;
+        }
+    }
+    if (cacheCoins.empty())
+        cacheCoinsPool.Clear();
+}
+
 void CCoinsViewCache::Uncache(const uint256& hash)
 {
     CCoinsMap::iterator it = cacheCoins.find(hash);
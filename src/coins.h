@@ -10,7 +10,9 @@
 #include "core_memusage.h"
 #include "hash.h"
 #include "memusage.h"
+#include "prevector.h"
 #include "serialize.h"
+#include "support/allocators/pool.h"
 #include "uint256.h"
 
 #include <assert.h>
@@ -71,6 +73,15 @@
  *              * 8c988f1a4a4de2161e0f50aac7f17e7f9555caa4: address uint160
  *  - height = 120891
  */
+
+/**
+ * The outputs of a CCoins. Most cache entries hold a single unspent output,
+ * which is kept inline instead of in a heap array of its own. The sizes are
+ * 64 bits wide, so that the outputs keep their alignment in the packed
+ * prevector.
+ */
+typedef prevector<1, CTxOut, uint64_t, int64_t> CCoinsOutputs;
+
 class CCoins
 {
 public:
@@ -78,7 +89,7 @@ public:
     bool fCoinBase;
 
     //! unspent transaction outputs; spent outputs are .IsNull(); spent outputs at the end of the array are dropped
-    std::vector<CTxOut> vout;
+    alignas(CTxOut) CCoinsOutputs vout;
 
     //! at which height this transaction was included in the active block chain
     int nHeight;
@@ -89,7 +100,7 @@ public:
 
     void FromTx(const CTransaction &tx, int nHeightIn) {
         fCoinBase = tx.IsCoinBase();
-        vout = tx.vout;
+        vout.assign(tx.vout.begin(), tx.vout.end());
         nHeight = nHeightIn;
         nVersion = tx.nVersion;
         ClearUnspendable();
@@ -102,20 +113,20 @@ public:
 
     void Clear() {
         fCoinBase = false;
-        std::vector<CTxOut>().swap(vout);
+        CCoinsOutputs().swap(vout);
         nHeight = 0;
         nVersion = 0;
     }
 
     //! empty constructor
-    CCoins() : fCoinBase(false), vout(0), nHeight(0), nVersion(0) { }
+    CCoins() : fCoinBase(false), vout(), nHeight(0), nVersion(0) { }
 
     //!remove spent outputs at the end of vout
     void Cleanup() {
         while (vout.size() > 0 && vout.back().IsNull())
             vout.pop_back();
         if (vout.empty())
-            std::vector<CTxOut>().swap(vout);
+            CCoinsOutputs().swap(vout);
     }
 
     void ClearUnspendable() {
@@ -288,16 +299,36 @@ struct CCoinsCacheEntry
 {
     CCoins coins; // The actual cached data.
     unsigned char flags;
+    uint32_t nLastUsed; // The tick of the cache when this entry was last looked up or modified.
+    uint64_t nStored; // Which of the outputs are unspent in the parent view, if STORED is set.
 
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
         FRESH = (1 << 1), // The parent view does not have this entry (or it is pruned).
+        STORED = (1 << 2), // nStored tells which outputs the parent view has, so they need no lookup when written.
     };
 
-    CCoinsCacheEntry() : coins(), flags(0) {}
+    CCoinsCacheEntry() : coins(), flags(0), nLastUsed(0), nStored(0) {}
+
+    /**
+     * Remember which outputs are unspent in the parent view, before an entry that
+     * matches it is modified. Entries with more outputs than fit in nStored
+     * have them looked up in the parent view when they are written.
+     */
+    void SetStored() {
+        if ((flags & (DIRTY | FRESH)) || coins.vout.size() > 64)
+            return;
+        nStored = 0;
+        for (unsigned int i = 0; i < coins.vout.size(); i++)
+            if (!coins.vout[i].IsNull())
+                nStored |= (uint64_t)1 << i;
+        flags |= STORED;
+    }
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, SaltedTxidHasher> CCoinsMap;
+/** The nodes of a CCoinsMap come from a pool owned by its CCoinsViewCache, see CPoolResource */
+typedef pool_allocator<std::pair<const uint256, CCoinsCacheEntry> > CCoinsMapAllocator;
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, SaltedTxidHasher, std::equal_to<uint256>, CCoinsMapAllocator> CCoinsMap;
 
 /** Cursor for iterating over CoinsView state */
 class CCoinsViewCursor
@@ -398,11 +429,19 @@ protected:
      * declared as "const".  
      */
     mutable uint256 hashBlock;
+    /* Memory for the nodes of cacheCoins, which must be destroyed first. */
+    mutable CPoolResource cacheCoinsPool;
     mutable CCoinsMap cacheCoins;
 
     /* Cached dynamic memory usage for the inner CCoins objects. */
     mutable size_t cachedCoinsUsage;
 
+    /* Advances with every change of the best block, to tell how recently an entry was used. */
+    uint32_t nTick;
+
+    /* The oldest tick of the most recently used entries that take up at most nKeepUsage bytes. */
+    uint32_t OldestTickToKeep(size_t nKeepUsage) const;
+
 public:
     CCoinsViewCache(CCoinsView *baseIn);
     ~CCoinsViewCache();
@@ -421,6 +460,12 @@ public:
      */
     bool HaveCoinsInCache(const uint256 &txid) const;
 
+    /**
+     * Cache coins of txid that were read from the base ahead of their use,
+     * by swapping them in, unless an entry for txid is cached already.
+     */
+    void CacheFetchedCoins(const uint256 &txid, CCoins &coins);
+
     /**
      * Return a pointer to CCoins in the cache, or NULL if not found. This is
      * more efficient than GetCoins. Modifications to other cache entries are
@@ -453,6 +498,21 @@ public:
      */
     bool Flush();
 
+    /**
+     * Move the modifications applied to this cache into mapCoins, to be
+     * written to its base later, as a whole. The most recently used coins,
+     * up to nKeepUsage bytes, stay cached as unmodified ones; spent coins and
+     * the rest are dropped, so with 0 the cache is emptied as by Flush().
+     */
+    void TakeChanges(CCoinsMap &mapCoins, size_t nKeepUsage);
+
+    /**
+     * Drop the least recently used coins that are not modified, until what
+     * is left of them and the modified ones takes up about nKeepUsage bytes,
+     * or no unmodified ones older than that are left.
+     */
+    void EvictUnmodified(size_t nKeepUsage);
+
     /**
      * Removes the transaction with the given hash from the cache, if it is
      * not modified.
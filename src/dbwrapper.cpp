@@ -88,6 +88,15 @@ CDBWrapper::~CDBWrapper()
     options.env = NULL;
 }
 
+CDBSnapshot::CDBSnapshot(CDBWrapper& db) : pdb(db.pdb), psnapshot(db.pdb->GetSnapshot())
+{
+}
+
+CDBSnapshot::~CDBSnapshot()
+{
+    pdb->ReleaseSnapshot(psnapshot);
+}
+
 bool CDBWrapper::WriteBatch(CDBBatch& batch, bool fSync)
 {
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
@@ -125,7 +134,9 @@ bool CDBWrapper::IsEmpty()
 CDBIterator::~CDBIterator() { delete piter; }
 bool CDBIterator::Valid() { return piter->Valid(); }
 void CDBIterator::SeekToFirst() { piter->SeekToFirst(); }
+void CDBIterator::SeekToLast() { piter->SeekToLast(); }
 void CDBIterator::Next() { piter->Next(); }
+void CDBIterator::Prev() { piter->Prev(); }
 
 namespace dbwrapper_private {
 
@@ -148,4 +159,13 @@ const std::vector<unsigned char>& GetObfuscateKey(const CDBWrapper &w)
     return w.obfuscate_key;
 }
 
+bool IsObfuscated(const CDBWrapper &w)
+{
+    for (size_t i = 0; i < w.obfuscate_key.size(); i++) {
+        if (w.obfuscate_key[i] != 0)
+            return true;
+    }
+    return false;
+}
+
 };
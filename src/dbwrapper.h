@@ -39,6 +39,10 @@ void HandleError(const leveldb::Status& status);
  */
 const std::vector<unsigned char>& GetObfuscateKey(const CDBWrapper &w);
 
+/** Whether values in the database are XOR-obfuscated with a non-zero key.
+ */
+bool IsObfuscated(const CDBWrapper &w);
+
 };
 
 /** Batch of changes queued to be written to a CDBWrapper */
@@ -56,6 +60,11 @@ public:
      */
     CDBBatch(const CDBWrapper &parent) : parent(parent) { };
 
+    void Clear()
+    {
+        batch.Clear();
+    }
+
     template <typename K, typename V>
     void Write(const K& key, const V& value)
     {
@@ -90,6 +99,7 @@ class CDBIterator
 private:
     const CDBWrapper &parent;
     leveldb::Iterator *piter;
+    const bool fObfuscated;
 
 public:
 
@@ -98,13 +108,15 @@ public:
      * @param[in] piterIn          The original leveldb iterator.
      */
     CDBIterator(const CDBWrapper &parent, leveldb::Iterator *piterIn) :
-        parent(parent), piter(piterIn) { };
+        parent(parent), piter(piterIn), fObfuscated(dbwrapper_private::IsObfuscated(parent)) { };
     ~CDBIterator();
 
     bool Valid();
 
     void SeekToFirst();
 
+    void SeekToLast();
+
     template<typename K> void Seek(const K& key) {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
@@ -113,12 +125,18 @@ public:
         piter->Seek(slKey);
     }
 
+    void Seek(const leveldb::Slice& slKey) {
+        piter->Seek(slKey);
+    }
+
     void Next();
 
+    void Prev();
+
     template<typename K> bool GetKey(K& key) {
-        leveldb::Slice slKey = piter->key();
         try {
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            leveldb::Slice slKey = piter->key();
+            CSpanReader ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
             ssKey >> key;
         } catch (const std::exception&) {
             return false;
@@ -126,6 +144,11 @@ public:
         return true;
     }
 
+    /** The raw key at the current position, valid until the iterator moves. */
+    leveldb::Slice GetKeySlice() {
+        return piter->key();
+    }
+
     unsigned int GetKeySize() {
         return piter->key().size();
     }
@@ -133,6 +156,12 @@ public:
     template<typename V> bool GetValue(V& value) {
         leveldb::Slice slValue = piter->value();
         try {
+            if (!fObfuscated) {
+                // Keys and unobfuscated values are decoded in place, without a copy
+                CSpanReader ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+                ssValue >> value;
+                return true;
+            }
             CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
             ssValue.Xor(dbwrapper_private::GetObfuscateKey(parent));
             ssValue >> value;
@@ -148,9 +177,36 @@ public:
 
 };
 
+class CDBRange;
+class CDBWrapper;
+
+/**
+ * A consistent view of a database as of the moment it was taken. Cursors
+ * opened on it do not see later writes, so a query made of several scans
+ * reads a single state of the database without holding any lock. Destroy
+ * the cursors before the snapshot.
+ */
+class CDBSnapshot
+{
+private:
+    leveldb::DB* pdb;
+    const leveldb::Snapshot* psnapshot;
+
+    CDBSnapshot(const CDBSnapshot&);
+    void operator=(const CDBSnapshot&);
+
+public:
+    explicit CDBSnapshot(CDBWrapper& db);
+    ~CDBSnapshot();
+
+    friend class CDBWrapper;
+};
+
 class CDBWrapper
 {
     friend const std::vector<unsigned char>& dbwrapper_private::GetObfuscateKey(const CDBWrapper &w);
+    friend bool dbwrapper_private::IsObfuscated(const CDBWrapper &w);
+    friend class CDBSnapshot;
 private:
     //! custom environment this database is using (may be NULL in case of default environment)
     leveldb::Env* penv;
@@ -199,15 +255,18 @@ public:
     ~CDBWrapper();
 
     template <typename K, typename V>
-    bool Read(const K& key, V& value) const
+    bool Read(const K& key, V& value, const CDBSnapshot* psnapshot = NULL) const
     {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
+        leveldb::ReadOptions snapshotoptions = readoptions;
+        if (psnapshot)
+            snapshotoptions.snapshot = psnapshot->psnapshot;
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        leveldb::Status status = pdb->Get(snapshotoptions, slKey, &strValue);
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
@@ -273,16 +332,190 @@ public:
         return WriteBatch(batch, true);
     }
 
-    CDBIterator *NewIterator()
+    CDBIterator *NewIterator(const CDBSnapshot* psnapshot = NULL)
     {
-        return new CDBIterator(*this, pdb->NewIterator(iteroptions));
+        if (!psnapshot)
+            return new CDBIterator(*this, pdb->NewIterator(iteroptions));
+        leveldb::ReadOptions snapshotoptions = iteroptions;
+        snapshotoptions.snapshot = psnapshot->psnapshot;
+        return new CDBIterator(*this, pdb->NewIterator(snapshotoptions));
     }
 
+    /**
+     * Return a cursor over the keys in [key_begin, key_end), compared as
+     * serialized bytes, in descending order with fReverse, optionally as
+     * of a snapshot.
+     */
+    template <typename KB, typename KE>
+    CDBRange *NewRange(const KB& key_begin, const KE& key_end, bool fReverse = false, const CDBSnapshot* psnapshot = NULL);
+
+    /**
+     * Return a cursor over every key whose serialization starts with that of
+     * key_prefix.
+     */
+    template <typename K>
+    CDBRange *NewPrefixRange(const K& key_prefix, bool fReverse = false, const CDBSnapshot* psnapshot = NULL);
+
+    /**
+     * Like NewPrefixRange, for a lookup of the few keys under a prefix rather
+     * than a scan: the blocks it reads are kept in the block cache, as by Read.
+     */
+    template <typename K>
+    CDBRange *NewPrefixLookup(const K& key_prefix);
+
     /**
      * Return true if the database managed by this class contains no entries.
      */
     bool IsEmpty();
+
+    /**
+     * Compact the key range [key_begin, key_end], e.g. after erasing most of it.
+     */
+    template <typename K>
+    void CompactRange(const K& key_begin, const K& key_end)
+    {
+        CDataStream ssKeyBegin(SER_DISK, CLIENT_VERSION), ssKeyEnd(SER_DISK, CLIENT_VERSION);
+        ssKeyBegin << key_begin;
+        ssKeyEnd << key_end;
+        leveldb::Slice slKeyBegin(&ssKeyBegin[0], ssKeyBegin.size());
+        leveldb::Slice slKeyEnd(&ssKeyEnd[0], ssKeyEnd.size());
+        pdb->CompactRange(&slKeyBegin, &slKeyEnd);
+    }
 };
 
+/**
+ * Cursor restricted to a range of serialized keys. The bounds are checked
+ * with a byte comparison of the raw leveldb key, so a scan never has to
+ * decode a key only to find out that it belongs to another prefix. A reverse
+ * range visits the same keys from the last one down.
+ */
+class CDBRange
+{
+private:
+    CDBIterator *piter;
+    //! inclusive lower bound
+    std::string strBegin;
+    //! exclusive upper bound; empty means unbounded
+    std::string strEnd;
+    bool fReverse;
+
+    /** Position on the last key before strKey, or on the last key if strKey is empty */
+    void SeekBefore(const std::string& strKey)
+    {
+        if (strKey.empty()) {
+            piter->SeekToLast();
+            return;
+        }
+        piter->Seek(leveldb::Slice(strKey));
+        if (piter->Valid())
+            piter->Prev();
+        else
+            piter->SeekToLast();
+    }
+
+public:
+    template <typename K>
+    static std::string EncodeKey(const K& key)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(ssKey.GetSerializeSize(key));
+        ssKey << key;
+        return std::string(ssKey.begin(), ssKey.end());
+    }
+
+    /** Smallest key that is greater than every key starting with strPrefix. */
+    static std::string PrefixEnd(std::string strPrefix)
+    {
+        while (!strPrefix.empty()) {
+            unsigned char ch = strPrefix[strPrefix.size() - 1];
+            if (ch != 0xff) {
+                strPrefix[strPrefix.size() - 1] = ch + 1;
+                return strPrefix;
+            }
+            strPrefix.erase(strPrefix.size() - 1);
+        }
+        return strPrefix;
+    }
+
+    /**
+     * @param[in] piterIn   Iterator to wrap, owned by the range from now on.
+     * @param[in] strBegin  Serialized inclusive lower bound.
+     * @param[in] strEndIn  Serialized exclusive upper bound, empty for none.
+     * @param[in] fReverseIn Visit the keys in descending order.
+     */
+    CDBRange(CDBIterator *piterIn, const std::string& strBeginIn, const std::string& strEndIn, bool fReverseIn = false) :
+        piter(piterIn), strBegin(strBeginIn), strEnd(strEndIn), fReverse(fReverseIn)
+    {
+        if (fReverse)
+            SeekBefore(strEnd);
+        else
+            piter->Seek(leveldb::Slice(strBegin));
+    }
+
+    ~CDBRange() { delete piter; }
+
+    bool Valid()
+    {
+        if (!piter->Valid())
+            return false;
+        if (fReverse)
+            return piter->GetKeySlice().compare(leveldb::Slice(strBegin)) >= 0;
+        return strEnd.empty() || piter->GetKeySlice().compare(leveldb::Slice(strEnd)) < 0;
+    }
+
+    void Next()
+    {
+        if (fReverse)
+            piter->Prev();
+        else
+            piter->Next();
+    }
+
+    /**
+     * Reposition on the first key strictly after key in the direction of the
+     * range, e.g. to resume a paged scan.
+     */
+    template <typename K>
+    void SeekAfter(const K& key)
+    {
+        std::string strKey = EncodeKey(key);
+        if (fReverse) {
+            SeekBefore(strKey);
+            return;
+        }
+        piter->Seek(leveldb::Slice(strKey));
+        if (piter->Valid() && piter->GetKeySlice() == leveldb::Slice(strKey))
+            piter->Next();
+    }
+
+    template <typename K>
+    bool GetKey(K& key) { return piter->GetKey(key); }
+
+    template <typename V>
+    bool GetValue(V& value) { return piter->GetValue(value); }
+
+    unsigned int GetValueSize() { return piter->GetValueSize(); }
+};
+
+template <typename KB, typename KE>
+CDBRange *CDBWrapper::NewRange(const KB& key_begin, const KE& key_end, bool fReverse, const CDBSnapshot* psnapshot)
+{
+    return new CDBRange(NewIterator(psnapshot), CDBRange::EncodeKey(key_begin), CDBRange::EncodeKey(key_end), fReverse);
+}
+
+template <typename K>
+CDBRange *CDBWrapper::NewPrefixRange(const K& key_prefix, bool fReverse, const CDBSnapshot* psnapshot)
+{
+    std::string strPrefix = CDBRange::EncodeKey(key_prefix);
+    return new CDBRange(NewIterator(psnapshot), strPrefix, CDBRange::PrefixEnd(strPrefix), fReverse);
+}
+
+template <typename K>
+CDBRange *CDBWrapper::NewPrefixLookup(const K& key_prefix)
+{
+    std::string strPrefix = CDBRange::EncodeKey(key_prefix);
+    return new CDBRange(new CDBIterator(*this, pdb->NewIterator(readoptions)), strPrefix, CDBRange::PrefixEnd(strPrefix));
+}
+
 #endif // BITCOIN_DBWRAPPER_H
 
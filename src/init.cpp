@@ -9,8 +9,10 @@
 
 #include "init.h"
 
+#include "addresswatch.h"
 #include "addrman.h"
 #include "amount.h"
+#include "blockfilemap.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "checkpoints.h"
@@ -29,6 +31,7 @@
 #include "script/sigcache.h"
 #include "scheduler.h"
 #include "timedata.h"
+#include "txcache.h"
 #include "txdb.h"
 #include "txmempool.h"
 #include "torcontrol.h"
@@ -83,6 +86,9 @@ static CZMQNotificationInterface* pzmqNotificationInterface = NULL;
 #define MIN_CORE_FILEDESCRIPTORS 150
 #endif
 
+/** Files LevelDB keeps open per database however low max_open_files is set */
+static const int MIN_DB_OPEN_FILES = 74;
+
 /** Used to pass flags to the Bind() function */
 enum BindFlags {
     BF_NONE         = 0,
@@ -220,8 +226,14 @@ void Shutdown()
         pcoinsTip = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
+        delete pcoinsWriter;
+        pcoinsWriter = NULL;
         delete pcoinsdbview;
         pcoinsdbview = NULL;
+        addressWatchSets.Clear();
+        txLookupCache.Clear();
+        blockFileReadPool.Clear();
+        blockFileMap.Clear();
         delete pblocktree;
         pblocktree = NULL;
     }
@@ -305,11 +317,15 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-?", _("Print this help message and exit"));
     strUsage += HelpMessageOpt("-version", _("Print version and exit"));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
+    strUsage += HelpMessageOpt("-backgroundflush", strprintf(_("Write the coins cache to disk on a background thread, without stopping block and transaction processing (default: %u)"), DEFAULT_BACKGROUND_FLUSH));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
+    strUsage += HelpMessageOpt("-blockprefetch=<n>", strprintf(_("Read up to <n> blocks from disk ahead of connecting them, 0 to disable (default: %u, maximum: %u)"), DEFAULT_BLOCK_PREFETCH, MAX_BLOCK_PREFETCH));
     if (showDebug)
         strUsage += HelpMessageOpt("-blocksonly", strprintf(_("Whether to operate in a blocks only mode (default: %u)"), DEFAULT_BLOCKSONLY));
     strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), DEFAULT_CHECKBLOCKS));
     strUsage += HelpMessageOpt("-checklevel=<n>", strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), DEFAULT_CHECKLEVEL));
+    strUsage += HelpMessageOpt("-coinsfetchthreads=<n>", strprintf(_("Set the number of threads reading the coins spent by a block before connecting it (0 to %d, 0 or 1 = read them while connecting, default: %d)"),
+        MAX_COINS_FETCH_THREADS, DEFAULT_COINS_FETCH_THREADS));
     strUsage += HelpMessageOpt("-conf=<file>", strprintf(_("Specify configuration file (default: %s)"), BITCOIN_CONF_FILENAME));
     if (mode == HMM_BITCOIND)
     {
@@ -324,9 +340,16 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file on startup"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
     strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
+#ifndef WIN32
+    strUsage += HelpMessageOpt("-mmapblocks", strprintf(_("Read blocks and undo data from finished block files through read-only memory mappings (default: %u)"), DEFAULT_MMAP_BLOCKS));
+#endif
     strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
+    strUsage += HelpMessageOpt("-mempooladdresslog=<n>", strprintf(_("Keep the last <n> changes to the mempool address index for getaddressmempoolupdates (default: %u)"), DEFAULT_MEMPOOL_ADDRESS_LOG_SIZE));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
+    strUsage += HelpMessageOpt("-indexdir=<dir>", _("Store the databases of the transaction and optional indexes in <dir> (default: <datadir>/blocks/index). Moving them requires -reindex-chainstate"));
+    strUsage += HelpMessageOpt("-indexbuildthreads=<n>", strprintf(_("Set the number of threads reading blocks to build newly enabled indexes (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
+        -GetNumCores(), MAX_INDEX_BUILD_THREADS, DEFAULT_INDEX_BUILD_THREADS));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), BITCOIN_PID_FILENAME));
 #endif
@@ -335,10 +358,13 @@ std::string HelpMessage(HelpMessageMode mode)
             "(default: 0 = disable pruning blocks, >%u = target size in MiB to use for block files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
     strUsage += HelpMessageOpt("-reindex-chainstate", _("Rebuild chain state from the currently indexed blocks"));
     strUsage += HelpMessageOpt("-reindex", _("Rebuild chain state and block index from the blk*.dat files on disk"));
+    strUsage += HelpMessageOpt("-reindexthreads=<n>", strprintf(_("Set the number of threads scanning the blk*.dat files during -reindex (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
+        -GetNumCores(), MAX_REINDEX_THREADS, DEFAULT_REINDEX_THREADS));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
     strUsage += HelpMessageOpt("-txindex", strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), DEFAULT_TXINDEX));
+    strUsage += HelpMessageOpt("-txlookupcache=<n>", strprintf(_("Keep up to <n> MiB of transactions read through the transaction index in memory, 0 to disable (default: %u)"), DEFAULT_TX_LOOKUP_CACHE));
 
    strUsage += HelpMessageOpt("-addressindex", strprintf(_("Maintain a full address index, used to query for the balance, txids and unspent outputs for addresses (default: %u)"), DEFAULT_ADDRESSINDEX));
     strUsage += HelpMessageOpt("-timestampindex", strprintf(_("Maintain a timestamp index for block hashes, used to query blocks hashes by a range of timestamps (default: %u)"), DEFAULT_TIMESTAMPINDEX));
@@ -397,6 +423,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-zmqpubhashtx=<address>", _("Enable publish hash transaction in <address>"));
     strUsage += HelpMessageOpt("-zmqpubrawblock=<address>", _("Enable publish raw block in <address>"));
     strUsage += HelpMessageOpt("-zmqpubrawtx=<address>", _("Enable publish raw transaction in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubaddressdelta=<address>", _("Enable publish mempool address index changes in <address> (requires -addressindex)"));
+    strUsage += HelpMessageOpt("-zmqpubwatchset=<address>", _("Enable publish watch set matches of new blocks in <address> (requires -addressindex)"));
 #endif
 
     strUsage += HelpMessageGroup(_("Debugging/Testing options:"));
@@ -595,17 +623,10 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 
     // -reindex
     if (fReindex) {
-        int nFile = 0;
-        while (true) {
-            CDiskBlockPos pos(nFile, 0);
-            if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
-                break; // No block files left to reindex
-            FILE *file = OpenBlockFile(pos, true);
-            if (!file)
-                break; // This error is logged in OpenBlockFile
-            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(chainparams, file, &pos);
-            nFile++;
+        if (!ReindexBlockFiles(chainparams)) {
+            // Leave the reindexing flag set so that it starts over next time
+            LogPrintf("Reindexing failed\n");
+            return;
         }
         pblocktree->WriteReindexing(false);
         fReindex = false;
@@ -865,12 +886,22 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     int nUserMaxConnections = GetArg("-maxconnections", DEFAULT_MAX_PEER_CONNECTIONS);
     nMaxConnections = std::max(nUserMaxConnections, 0);
 
+    // The block index and the databases of the enabled indexes share -dbmaxopenfiles,
+    // LevelDB keeps at least MIN_DB_OPEN_FILES files open per database
+    int nBlockTreeDBs = 1 + GetBoolArg("-txindex", DEFAULT_TXINDEX) + GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX) +
+                        GetBoolArg("-spentindex", DEFAULT_SPENTINDEX) + GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX);
+    int nDBFileDescriptors = std::max((int)GetArg("-dbmaxopenfiles", DEFAULT_DB_MAX_OPEN_FILES), nBlockTreeDBs * MIN_DB_OPEN_FILES);
+    // Transaction lookups through -txindex keep block files open for reuse
+    int nCoreFileDescriptors = MIN_CORE_FILEDESCRIPTORS + (GetBoolArg("-txindex", DEFAULT_TXINDEX) ? MAX_BLOCK_FILE_READ_POOL : 0);
+
     // Trim requested connection counts, to fit into system limitations
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
-    int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
-    if (nFD < MIN_CORE_FILEDESCRIPTORS)
+    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - nCoreFileDescriptors)), 0);
+    int nFD = RaiseFileDescriptorLimit(nMaxConnections + nCoreFileDescriptors + nDBFileDescriptors);
+    if (nFD < nCoreFileDescriptors + nBlockTreeDBs * MIN_DB_OPEN_FILES)
         return InitError(_("Not enough file descriptors available."));
-    nMaxConnections = std::min(nFD - MIN_CORE_FILEDESCRIPTORS, nMaxConnections);
+    // Connections come first, the databases reopen files they cannot keep open
+    nDBFileDescriptors = std::max(std::min(nDBFileDescriptors, nFD - nCoreFileDescriptors - nMaxConnections), nBlockTreeDBs * MIN_DB_OPEN_FILES);
+    nMaxConnections = std::min(nFD - nCoreFileDescriptors - nDBFileDescriptors, nMaxConnections);
 
     if (nMaxConnections < nUserMaxConnections)
         InitWarning(strprintf(_("Reducing -maxconnections from %d to %d, because of system limitations."), nUserMaxConnections, nMaxConnections));
@@ -909,12 +940,23 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
     fCheckBlockIndex = GetBoolArg("-checkblockindex", chainparams.DefaultConsistencyChecks());
     fCheckpointsEnabled = GetBoolArg("-checkpoints", DEFAULT_CHECKPOINTS_ENABLED);
+    fMmapBlocks = GetBoolArg("-mmapblocks", DEFAULT_MMAP_BLOCKS);
+#ifdef WIN32
+    if (fMmapBlocks) {
+        InitWarning(_("-mmapblocks is not supported on this platform and is ignored."));
+        fMmapBlocks = false;
+    }
+#endif
 
     // mempool limits
     int64_t nMempoolSizeMax = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
     int64_t nMempoolSizeMin = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000 * 40;
     if (nMempoolSizeMax < 0 || nMempoolSizeMax < nMempoolSizeMin)
         return InitError(strprintf(_("-maxmempool must be at least %d MB"), std::ceil(nMempoolSizeMin / 1000000.0)));
+    int64_t nMempoolAddressLog = GetArg("-mempooladdresslog", DEFAULT_MEMPOOL_ADDRESS_LOG_SIZE);
+    if (nMempoolAddressLog < 0)
+        return InitError(_("-mempooladdresslog must not be negative"));
+    mempool.setAddressDeltaLogSize(nMempoolAddressLog);
 
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
     nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
@@ -925,6 +967,25 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    // -indexbuildthreads=0 means autodetect, 1 builds the indexes one block at a time
+    nIndexBuildThreads = GetArg("-indexbuildthreads", DEFAULT_INDEX_BUILD_THREADS);
+    if (nIndexBuildThreads <= 0)
+        nIndexBuildThreads += GetNumCores();
+    nIndexBuildThreads = std::max(1, std::min(nIndexBuildThreads, MAX_INDEX_BUILD_THREADS));
+
+    // -reindexthreads=0 means autodetect, 1 scans the block files one at a time
+    nReindexThreads = GetArg("-reindexthreads", DEFAULT_REINDEX_THREADS);
+    if (nReindexThreads <= 0)
+        nReindexThreads += GetNumCores();
+    nReindexThreads = std::max(1, std::min(nReindexThreads, MAX_REINDEX_THREADS));
+
+    // -coinsfetchthreads counts the thread connecting blocks, which reads along
+    nCoinsFetchThreads = std::min((int)GetArg("-coinsfetchthreads", DEFAULT_COINS_FETCH_THREADS), MAX_COINS_FETCH_THREADS);
+    if (nCoinsFetchThreads <= 1)
+        nCoinsFetchThreads = 0;
+
+    fBackgroundFlush = GetBoolArg("-backgroundflush", DEFAULT_BACKGROUND_FLUSH);
+
     fServer = GetBoolArg("-server", false);
 
     // block pruning; get the amount of disk space (in MiB) to allot for block & undo files
@@ -1087,6 +1148,17 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             threadGroup.create_thread(&ThreadScriptCheck);
     }
 
+    if (nCoinsFetchThreads) {
+        LogPrintf("Using %u threads to read the coins spent by blocks\n", nCoinsFetchThreads);
+        for (int i=0; i<nCoinsFetchThreads-1; i++)
+            threadGroup.create_thread(&ThreadCoinsFetch);
+    }
+
+    int64_t nBlockPrefetch = std::min(std::max(GetArg("-blockprefetch", DEFAULT_BLOCK_PREFETCH), (int64_t)0), (int64_t)MAX_BLOCK_PREFETCH);
+    if (nBlockPrefetch > 0)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "prefetch",
+                                              boost::function<void()>(boost::bind(&ThreadBlockPrefetch, (unsigned int)nBlockPrefetch))));
+
     // Start the lightweight task scheduler thread
     CScheduler::Function serviceLoop = boost::bind(&CScheduler::serviceQueue, &scheduler);
     threadGroup.create_thread(boost::bind(&TraceThread<CScheduler::Function>, "scheduler", serviceLoop));
@@ -1282,34 +1354,72 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
 
     // block tree db settings
-    int dbMaxOpenFiles = GetArg("-dbmaxopenfiles", DEFAULT_DB_MAX_OPEN_FILES);
+    int dbMaxOpenFiles = nDBFileDescriptors / nBlockTreeDBs;
     bool dbCompression = GetBoolArg("-dbcompression", DEFAULT_DB_COMPRESSION);
 
+    boost::filesystem::path indexDir;
+    if (mapArgs.count("-indexdir")) {
+        indexDir = boost::filesystem::system_complete(mapArgs["-indexdir"]);
+        if (!TryCreateDirectory(indexDir) && !boost::filesystem::is_directory(indexDir))
+            return InitError(strprintf(_("Cannot create index directory %s"), indexDir.string()));
+    }
+
     LogPrintf("Block index database configuration:\n");
-    LogPrintf("* Using %d max open files\n", dbMaxOpenFiles);
+    LogPrintf("* Using %d max open files for each of %d databases\n", dbMaxOpenFiles, nBlockTreeDBs);
+    if (!indexDir.empty())
+        LogPrintf("* Using %s for the index databases\n", indexDir.string());
     LogPrintf("* Compression is %s\n", dbCompression ? "enabled" : "disabled");
 
     // cache size calculations
     int64_t nTotalCache = (GetArg("-dbcache", nDefaultDbCache) << 20);
     nTotalCache = std::max(nTotalCache, nMinDbCache << 20); // total cache cannot be less than nMinDbCache
     nTotalCache = std::min(nTotalCache, nMaxDbCache << 20); // total cache cannot be greater than nMaxDbcache
-    int64_t nBlockTreeDBCache = nTotalCache / 8;
-    if (GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX) || GetBoolArg("-spentindex", DEFAULT_SPENTINDEX)) {
+    int64_t nBlockTreeDBCache = std::min(nTotalCache / 8, nMaxBlockDBCache << 20);
+    bool fTxIndexArg = GetBoolArg("-txindex", DEFAULT_TXINDEX);
+    bool fAddressIndexArg = GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX);
+    bool fSpentIndexArg = GetBoolArg("-spentindex", DEFAULT_SPENTINDEX);
+    bool fTimestampIndexArg = GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX);
+    int64_t nIndexDBCache = 0;
+    if (fAddressIndexArg || fSpentIndexArg) {
         // enable 3/4 of the cache if addressindex and/or spentindex is enabled
-        nBlockTreeDBCache = nTotalCache * 3 / 4;
-    } else {
-        nBlockTreeDBCache = std::min(nBlockTreeDBCache, (GetBoolArg("-txindex", DEFAULT_TXINDEX) ? nMaxBlockDBAndTxIndexCache : nMaxBlockDBCache) << 20);
+        nIndexDBCache = nTotalCache * 3 / 4 - nBlockTreeDBCache;
+    } else if (fTxIndexArg) {
+        nIndexDBCache = std::max(std::min(nTotalCache / 8, nMaxBlockDBAndTxIndexCache << 20) - nBlockTreeDBCache, (int64_t)0);
+    }
+    // Every optional index has its own database, share the index cache by how much each one is read
+    CIndexDBCacheSizes indexDBCache;
+    int nIndexWeights = (fTxIndexArg ? 2 : 0) + (fAddressIndexArg ? 4 : 0) + (fSpentIndexArg ? 2 : 0) + (fTimestampIndexArg ? 1 : 0);
+    if (nIndexWeights > 0) {
+        int64_t nIndexDBCacheShare = nIndexDBCache / nIndexWeights;
+        if (fTxIndexArg)
+            indexDBCache.nTxIndex = std::max((int64_t)indexDBCache.nTxIndex, nIndexDBCacheShare * 2);
+        if (fAddressIndexArg)
+            indexDBCache.nAddressIndex = std::max((int64_t)indexDBCache.nAddressIndex, nIndexDBCacheShare * 4);
+        if (fSpentIndexArg)
+            indexDBCache.nSpentIndex = std::max((int64_t)indexDBCache.nSpentIndex, nIndexDBCacheShare * 2);
+        if (fTimestampIndexArg)
+            indexDBCache.nTimestampIndex = std::max((int64_t)indexDBCache.nTimestampIndex, nIndexDBCacheShare);
     }
     nTotalCache -= nBlockTreeDBCache;
+    nTotalCache -= indexDBCache.nTxIndex + indexDBCache.nAddressIndex + indexDBCache.nSpentIndex + indexDBCache.nTimestampIndex;
+    nTotalCache = std::max(nTotalCache, (int64_t)0);
     int64_t nCoinDBCache = std::min(nTotalCache / 2, (nTotalCache / 4) + (1 << 23)); // use 25%-50% of the remainder for disk cache
     nCoinDBCache = std::min(nCoinDBCache, nMaxCoinsDBCache << 20); // cap total coins db cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheUsage = nTotalCache; // the rest goes to in-memory cache
+    // Decoded transactions from the transaction index are cached apart from -dbcache
+    int64_t nTxLookupCache = fTxIndexArg ? std::max(GetArg("-txlookupcache", DEFAULT_TX_LOOKUP_CACHE), (int64_t)0) << 20 : 0;
+    txLookupCache.SetMaxUsage(nTxLookupCache);
     LogPrintf("Cache configuration:\n");
     LogPrintf("* Max cache setting possible %.1fMiB\n", nMaxDbCache);
     LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for transaction index database\n", indexDBCache.nTxIndex * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for address index database\n", indexDBCache.nAddressIndex * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for spent index database\n", indexDBCache.nSpentIndex * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for timestamp index database\n", indexDBCache.nTimestampIndex * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for in-memory UTXO set\n", nCoinCacheUsage * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for transaction lookup cache\n", nTxLookupCache * (1.0 / 1024 / 1024));
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -1325,12 +1435,17 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                 delete pcoinsTip;
                 delete pcoinsdbview;
                 delete pcoinscatcher;
+                delete pcoinsWriter;
+                addressWatchSets.Clear();
+                txLookupCache.Clear();
                 delete pblocktree;
 
-                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex, dbCompression, dbMaxOpenFiles);
+                // The optional indexes follow the chain state, so they are rebuilt along with it
+                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex, dbCompression, dbMaxOpenFiles, indexDBCache, fReindexChainState, indexDir);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex || fReindexChainState);
 
-                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
+                pcoinsWriter = new CCoinsViewDBWriter(pcoinsdbview);
+                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsWriter);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
                 if (fReindex) {
@@ -1340,6 +1455,20 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                         CleanupBlockRevFiles();
                 }
 
+                if (!fReindex) {
+                    uiInterface.InitMessage(_("Upgrading index databases..."));
+                    if (!pblocktree->MoveIndexesToOwnDatabases()) {
+                        strLoadError = _("Error upgrading index databases");
+                        break;
+                    }
+                }
+
+                uiInterface.InitMessage(_("Upgrading coin database..."));
+                if (!pcoinsdbview->Upgrade()) {
+                    strLoadError = _("Error upgrading coin database");
+                    break;
+                }
+
                 if (!LoadBlockIndex()) {
                     strLoadError = _("Error loading block database");
                     break;
@@ -1362,21 +1491,39 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                     break;
                 }
 
-                // Check for changed -addressindex state
-                if (fAddressIndex != GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX)) {
-                    strLoadError = _("You need to rebuild the database using -reindex-chainstate to change -addressindex");
+                // Optional indexes that are newly enabled are built in the background,
+                // disabling one requires rebuilding the database without it
+                if (fAddressIndex && !GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX)) {
+                    strLoadError = _("You need to rebuild the database using -reindex-chainstate to disable -addressindex");
                     break;
                 }
 
-                // Check for changed -spentindex state
-                if (fSpentIndex != GetBoolArg("-spentindex", DEFAULT_SPENTINDEX)) {
-                    strLoadError = _("You need to rebuild the database using -reindex-chainstate to change -spentindex");
+                if (fSpentIndex && !GetBoolArg("-spentindex", DEFAULT_SPENTINDEX)) {
+                    strLoadError = _("You need to rebuild the database using -reindex-chainstate to disable -spentindex");
                     break;
                 }
 
-                // Check for changed -timestampindex state
-                if (fTimestampIndex != GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX)) {
-                    strLoadError = _("You need to rebuild the database using -reindex-chainstate to change -timestampindex");
+                if (fTimestampIndex && !GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX)) {
+                    strLoadError = _("You need to rebuild the database using -reindex-chainstate to disable -timestampindex");
+                    break;
+                }
+
+                if ((!fAddressIndex && fAddressIndexArg) || (!fSpentIndex && fSpentIndexArg) || (!fTimestampIndex && fTimestampIndexArg)) {
+                    if (fHavePruned) {
+                        strLoadError = _("Optional indexes cannot be built from pruned block files, rebuild the database using -reindex to enable them");
+                        break;
+                    }
+                    if ((!fAddressIndex && fAddressIndexArg && !EnableOptionalIndex(OPTIONAL_INDEX_ADDRESS)) ||
+                        (!fSpentIndex && fSpentIndexArg && !EnableOptionalIndex(OPTIONAL_INDEX_SPENT)) ||
+                        (!fTimestampIndex && fTimestampIndexArg && !EnableOptionalIndex(OPTIONAL_INDEX_TIMESTAMP))) {
+                        strLoadError = _("Error enabling optional indexes");
+                        break;
+                    }
+                }
+
+                // Watch sets are matched against the address index rows of new blocks
+                if (fAddressIndex && !addressWatchSets.Load(pblocktree)) {
+                    strLoadError = _("Error loading address watch sets");
                     break;
                 }
 
@@ -1525,8 +1672,13 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             vImportFiles.push_back(strFile);
     }
 
+    if (fBackgroundFlush)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "coinsdb", &ThreadWriteCoins));
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
 
+    // Build optional indexes that do not cover the active chain yet
+    threadGroup.create_thread(&ThreadBuildIndexes);
+
     // Wait for genesis block to be processed
     {
         boost::unique_lock<boost::mutex> lock(cs_GenesisWait);
@@ -5,15 +5,18 @@
 
 #include "main.h"
 
+#include "addresswatch.h"
 #include "addrman.h"
 #include "arith_uint256.h"
 #include "blockencodings.h"
+#include "blockfilemap.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "crypto/ripemd160.h"
 #include "hash.h"
 #include "init.h"
 #include "merkleblock.h"
@@ -23,11 +26,13 @@
 #include "pow.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
+#include "pubkey.h"
 #include "random.h"
 #include "script/script.h"
 #include "script/sigcache.h"
 #include "script/standard.h"
 #include "tinyformat.h"
+#include "txcache.h"
 #include "txdb.h"
 #include "txmempool.h"
 #include "ui_interface.h"
@@ -39,6 +44,7 @@
 #include "versionbits.h"
 
 #include <atomic>
+#include <deque>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -62,15 +68,23 @@ CCriticalSection cs_main;
 
 BlockMap mapBlockIndex;
 CChain chainActive;
+/** Tip of chainActive, published for readers without cs_main after every change */
+static std::atomic<const CBlockIndex*> pindexActiveTipView(NULL);
 CBlockIndex *pindexBestHeader = NULL;
 int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nIndexBuildThreads = 1;
+int nReindexThreads = 1;
+int nCoinsFetchThreads = 0;
+bool fBackgroundFlush = DEFAULT_BACKGROUND_FLUSH;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = false;
+bool fMmapBlocks = DEFAULT_MMAP_BLOCKS;
 bool fAddressIndex = false;
+bool fAddressSummaryIndex = false;
 bool fTimestampIndex = false;
 bool fSpentIndex = false;
 bool fHavePruned = false;
@@ -699,6 +713,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewDBWriter *pcoinsWriter = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1604,12 +1619,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return res;
 }
 
-bool GetTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes)
+bool GetTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes,
+                       unsigned int limit, bool fReverse)
 {
     if (!fTimestampIndex)
         return error("Timestamp index not enabled");
 
-    if (!pblocktree->ReadTimestampIndex(high, low, fActiveOnly, hashes))
+    boost::scoped_ptr<CDBSnapshot> psnapshot(pblocktree->NewIndexSnapshot(OPTIONAL_INDEX_TIMESTAMP));
+    if (!pblocktree->ReadTimestampIndex(high, low, fActiveOnly, hashes, limit, fReverse, psnapshot.get()))
         return error("Unable to get hashes for timestamps");
 
     return true;
@@ -1629,41 +1646,312 @@ bool GetSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value)
     return true;
 }
 
-bool HashOnchainActive(const uint256 &hash)
+bool GetSpentIndexes(const std::vector<CSpentIndexKey> &keys, std::vector<CSpentIndexValue> &values)
 {
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-
-    if (!chainActive.Contains(pblockindex)) {
+    if (!fSpentIndex)
         return false;
+
+    values.assign(keys.size(), CSpentIndexValue());
+    mempool.getSpentIndexes(keys, values);
+
+    // A spend in the mempool takes precedence, only look up the rest on disk
+    std::vector<CSpentIndexKey> vDiskKeys;
+    std::vector<size_t> vDiskPos;
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (values[i].IsNull()) {
+            vDiskKeys.push_back(keys[i]);
+            vDiskPos.push_back(i);
+        }
     }
 
+    std::vector<CSpentIndexValue> vDiskValues(vDiskKeys.size());
+    boost::scoped_ptr<CDBSnapshot> psnapshot(pblocktree->NewIndexSnapshot(OPTIONAL_INDEX_SPENT));
+    if (!pblocktree->ReadSpentIndexes(vDiskKeys, vDiskValues, psnapshot.get()))
+        return false;
+    for (size_t i = 0; i < vDiskPos.size(); i++)
+        values[vDiskPos[i]] = vDiskValues[i];
+
     return true;
 }
 
+const CBlockIndex* GetActiveTipView()
+{
+    return pindexActiveTipView.load();
+}
+
+bool IsInChainView(const CBlockIndex* pindexTip, const uint256 &hash, int nHeight)
+{
+    if (pindexTip == NULL || nHeight < 0 || nHeight > pindexTip->nHeight)
+        return false;
+    return pindexTip->GetAncestor(nHeight)->GetBlockHash() == hash;
+}
+
+CDBSnapshot *GetIndexSnapshot(OptionalIndex index)
+{
+    if (!IsOptionalIndexEnabled(index))
+        return NULL;
+
+    return pblocktree->NewIndexSnapshot(index);
+}
+
 bool GetAddressIndex(uint160 addressHash, int type,
-                     std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex, int start, int end)
+                     std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex, int start, int end,
+                     const CDBSnapshot *psnapshot)
 {
     if (!fAddressIndex)
         return error("address index not enabled");
 
-    if (!pblocktree->ReadAddressIndex(addressHash, type, addressIndex, start, end))
+    if (!pblocktree->ReadAddressIndex(addressHash, type, addressIndex, start, end, psnapshot))
         return error("unable to get txids for address");
 
     return true;
 }
 
+CAddressIndexMergeCursor *GetAddressIndexCursor(const std::vector<std::pair<uint160, int> > &addresses, int start, int end,
+                                                const CAddressIndexPageKey *pafter)
+{
+    if (!fAddressIndex) {
+        error("address index not enabled");
+        return NULL;
+    }
+
+    return pblocktree->AddressIndexCursor(addresses, start, end, pafter);
+}
+
+bool GetAddressSummary(uint160 addressHash, int type, CAddressSummaryValue &summary, const CDBSnapshot *psnapshot)
+{
+    if (!fAddressIndex || !fAddressSummaryIndex)
+        return false;
+
+    if (!pblocktree->ReadAddressSummaryIndex(addressHash, type, summary, psnapshot))
+        summary.SetNull();
+
+    return true;
+}
+
 bool GetAddressUnspent(uint160 addressHash, int type,
-                       std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs)
+                       std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs,
+                       const CAddressUnspentKey *pafter, unsigned int limit,
+                       const CAddressUnspentFilter &filter, const CDBSnapshot *psnapshot)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    if (!pblocktree->ReadAddressUnspentIndex(addressHash, type, unspentOutputs, pafter, limit, filter, psnapshot))
+        return error("unable to get txids for address");
+
+    return true;
+}
+
+bool GetAddressUnspentByValue(uint160 addressHash, int type,
+                              std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs,
+                              const CAddressUnspentValueKey *pafter, unsigned int limit,
+                              const CAddressUnspentFilter &filter, const CDBSnapshot *psnapshot)
 {
     if (!fAddressIndex)
         return error("address index not enabled");
 
-    if (!pblocktree->ReadAddressUnspentIndex(addressHash, type, unspentOutputs))
+    if (!pblocktree->ReadAddressUnspentValueIndex(addressHash, type, unspentOutputs, pafter, limit, filter, psnapshot))
         return error("unable to get txids for address");
 
     return true;
 }
 
+bool GetAddressWatchMatches(const std::string &name, const uint256 &blockHash,
+                            std::vector<std::pair<CAddressIndexKey, CAmount> > &matches)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    if (!pblocktree->ReadAddressWatchMatches(CAddressWatchMatchKey(name, blockHash), matches))
+        return error("unable to get watch set matches for block");
+
+    return true;
+}
+
+/**
+ * Last block of the active chain prefix that each optional index covers, NULL if
+ * it has not indexed any block yet. An index only follows ConnectBlock and
+ * DisconnectBlock while it is at the tip, ThreadBuildIndexes moves it otherwise.
+ */
+static const CBlockIndex* pindexIndexBest[OPTIONAL_INDEX_COUNT] = {};
+
+/**
+ * Blocks each optional index covered beyond pindexIndexBest before the node
+ * stopped without storing them in the block index, the next one last. The index
+ * moves over them as the chain connects them again.
+ */
+static std::vector<uint256> vIndexPending[OPTIONAL_INDEX_COUNT];
+
+const char *GetOptionalIndexName(OptionalIndex index)
+{
+    switch (index) {
+    case OPTIONAL_INDEX_ADDRESS: return "address";
+    case OPTIONAL_INDEX_SPENT: return "spent";
+    case OPTIONAL_INDEX_TIMESTAMP: return "timestamp";
+    default: return "unknown";
+    }
+}
+
+bool IsOptionalIndexEnabled(OptionalIndex index)
+{
+    switch (index) {
+    case OPTIONAL_INDEX_ADDRESS: return fAddressIndex;
+    case OPTIONAL_INDEX_SPENT: return fSpentIndex;
+    case OPTIONAL_INDEX_TIMESTAMP: return fTimestampIndex;
+    default: return false;
+    }
+}
+
+static bool SetIndexBestBlock(OptionalIndex index, const CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    if (!pblocktree->WriteIndexBestBlock(index, pindex ? pindex->GetBlockHash() : uint256()))
+        return error("%s: failed to write position of %s index", __func__, GetOptionalIndexName(index));
+    pindexIndexBest[index] = pindex;
+    return true;
+}
+
+/** Version of the rows of each optional index, existing indexes of an older version are rebuilt */
+static const int OPTIONAL_INDEX_VERSION[OPTIONAL_INDEX_COUNT] = {
+    2, // address: 2 added P2PK, P2WPKH, P2WSH and bare multisig outputs and the value-ordered unspent rows
+    2, // spent: 2 same address classification as the address index, without an address for bare multisig inputs
+    2, // timestamp: 2 keeps the height of each block, so chain membership is tested without cs_main
+};
+
+/** Start an empty optional index of the current version, ThreadBuildIndexes fills it */
+static bool InitOptionalIndex(OptionalIndex index)
+{
+    if (index == OPTIONAL_INDEX_ADDRESS) {
+        // An empty address index can maintain the summaries from the start
+        fAddressSummaryIndex = true;
+        if (!pblocktree->WriteFlag("addresssummaryindex", true))
+            return false;
+    }
+    return SetIndexBestBlock(index, NULL) && pblocktree->WriteIndexVersion(index, OPTIONAL_INDEX_VERSION[index]);
+}
+
+/** Build an index again that covers blocks the chain does not connect again */
+static bool ResetPendingIndex(OptionalIndex index)
+{
+    LogPrintf("%s: %s index covers blocks that are not connected again, rebuilding it\n", __func__, GetOptionalIndexName(index));
+    vIndexPending[index].clear();
+    return pblocktree->WipeIndex(index) && InitOptionalIndex(index);
+}
+
+/** Move an index with pending blocks over pindex, which the chain connects after its position */
+static bool TakePendingIndexBlock(OptionalIndex index, const CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    assert(!vIndexPending[index].empty() && pindex->pprev == pindexIndexBest[index]);
+    if (pindex->GetBlockHash() != vIndexPending[index].back())
+        return ResetPendingIndex(index);
+    // The index already has the rows of the block, and its stored position is the last pending block
+    vIndexPending[index].pop_back();
+    pindexIndexBest[index] = pindex;
+    return true;
+}
+
+bool EnableOptionalIndex(OptionalIndex index)
+{
+    LOCK(cs_main);
+
+    const char *flag = NULL;
+    switch (index) {
+    case OPTIONAL_INDEX_ADDRESS:
+        fAddressIndex = true;
+        flag = "addressindex";
+        break;
+    case OPTIONAL_INDEX_SPENT:
+        fSpentIndex = true;
+        flag = "spentindex";
+        break;
+    case OPTIONAL_INDEX_TIMESTAMP:
+        fTimestampIndex = true;
+        flag = "timestampindex";
+        break;
+    default:
+        return false;
+    }
+
+    LogPrintf("%s: %s index enabled, building it in the background\n", __func__, GetOptionalIndexName(index));
+    // Its database is not wiped along with the chain state while the index is disabled
+    return pblocktree->WipeIndex(index) && InitOptionalIndex(index) && pblocktree->WriteFlag(flag, true);
+}
+
+bool GetIndexSyncState(OptionalIndex index, int &nHeight)
+{
+    LOCK(cs_main);
+
+    const CBlockIndex* pindex = pindexIndexBest[index];
+    if (pindex && !chainActive.Contains(pindex))
+        pindex = chainActive.FindFork(pindex);
+    nHeight = pindex ? pindex->nHeight : -1;
+
+    return IsOptionalIndexEnabled(index) && pindexIndexBest[index] == chainActive.Tip();
+}
+
+/** Read the positions of the enabled optional indexes, pindexCoinsTip is where indexes without one are */
+static bool LoadIndexBestBlocks(const CBlockIndex* pindexCoinsTip)
+{
+    LOCK(cs_main);
+    for (int i = 0; i < OPTIONAL_INDEX_COUNT; i++) {
+        OptionalIndex index = (OptionalIndex)i;
+        pindexIndexBest[i] = NULL;
+        vIndexPending[i].clear();
+        if (!IsOptionalIndexEnabled(index))
+            continue;
+
+        int nVersion;
+        pblocktree->ReadIndexVersion(index, nVersion);
+        if (nVersion > OPTIONAL_INDEX_VERSION[i])
+            return error("%s: %s index version %d is not supported", __func__, GetOptionalIndexName(index), nVersion);
+
+        uint256 hash;
+        if (nVersion < OPTIONAL_INDEX_VERSION[i]) {
+            // Replace the rows of the older version by building the index again in the background
+            LogPrintf("%s: rebuilding %s index of version %d as version %d\n", __func__, GetOptionalIndexName(index), nVersion, OPTIONAL_INDEX_VERSION[i]);
+            if (!pblocktree->WipeIndex(index) || !InitOptionalIndex(index))
+                return error("%s: failed to reset %s index", __func__, GetOptionalIndexName(index));
+        } else if (!pblocktree->ReadIndexBestBlock(index, hash)) {
+            // Indexes created by older versions were always kept in sync with the chain state
+            if (pindexCoinsTip && !SetIndexBestBlock(index, pindexCoinsTip))
+                return false;
+        } else if (!hash.IsNull()) {
+            // The block index only stores the blocks connected since the last flush at the next one.
+            // Go back along the blocks the index recorded to one stored as connected, the index moves
+            // over the others as the chain connects them again.
+            uint256 hashBlock = hash;
+            BlockMap::iterator it = mapBlockIndex.find(hashBlock);
+            while (it == mapBlockIndex.end() || (it->second->pprev && !(it->second->nStatus & BLOCK_HAVE_UNDO))) {
+                vIndexPending[i].push_back(hashBlock);
+                uint256 hashPrev;
+                if (it != mapBlockIndex.end())
+                    hashPrev = it->second->pprev->GetBlockHash();
+                else if (!pblocktree->ReadIndexBlock(index, hashBlock, hashPrev) || hashPrev.IsNull())
+                    break;
+                hashBlock = hashPrev;
+                it = mapBlockIndex.find(hashBlock);
+            }
+            if (it != mapBlockIndex.end()) {
+                pindexIndexBest[i] = it->second;
+                if (!vIndexPending[i].empty())
+                    LogPrintf("%s: %s index covers %u more blocks once they are connected again\n", __func__, GetOptionalIndexName(index), vIndexPending[i].size());
+            } else {
+                // Without a record of the block there is no undoing its rows
+                LogPrintf("%s: %s index is at unknown block %s, rebuilding it\n", __func__, GetOptionalIndexName(index), hash.ToString());
+                vIndexPending[i].clear();
+                if (!pblocktree->WipeIndex(index) || !InitOptionalIndex(index))
+                    return error("%s: failed to reset %s index", __func__, GetOptionalIndexName(index));
+            }
+        }
+
+        LogPrintf("%s: %s index is at height %d\n", __func__, GetOptionalIndexName(index),
+                  pindexIndexBest[i] ? pindexIndexBest[i]->nHeight : -1);
+    }
+    return true;
+}
+
 
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::Params& consensusParams, uint256 &hashBlock, bool fAllowSlow)
@@ -1680,9 +1968,13 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
     }
 
     if (fTxIndex) {
+        if (txLookupCache.Get(hash, ptx, hashBlock)) {
+            txOut = *ptx;
+            return true;
+        }
         CDiskTxPos postx;
         if (pblocktree->ReadTxIndex(hash, postx)) {
-            CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+            CAutoFile file(blockFileReadPool.Acquire(postx), SER_DISK, CLIENT_VERSION);
             if (file.IsNull())
                 return error("%s: OpenBlockFile failed", __func__);
             CBlockHeader header;
@@ -1693,9 +1985,11 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
             } catch (const std::exception& e) {
                 return error("%s: Deserialize or I/O error - %s", __func__, e.what());
             }
+            blockFileReadPool.Release(postx.nFile, file.release());
             hashBlock = header.GetHash();
             if (txOut.GetHash() != hash)
                 return error("%s: txid mismatch", __func__);
+            txLookupCache.Insert(std::make_shared<const CTransaction>(txOut), hashBlock);
             return true;
         }
     }
@@ -1759,18 +2053,37 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHea
     return true;
 }
 
+/** Find the record at pos in a mapped block or undo file, if -mmapblocks is on and the file is finished */
+static bool GetMappedRecord(const CDiskBlockPos& pos, bool fUndo, unsigned int nTrailer, CMappedRecord& record)
+{
+    if (!fMmapBlocks)
+        return false;
+    {
+        LOCK(cs_LastBlockFile);
+        // Blocks are still appended to the last file
+        if (pos.nFile >= nLastBlockFile)
+            return false;
+    }
+    return blockFileMap.GetRecord(pos, fUndo, nTrailer, record);
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
-
     // Read block
     try {
-        filein >> block;
+        CMappedRecord record;
+        if (GetMappedRecord(pos, false, 0, record)) {
+            CSpanReader filein(record.pbegin, record.pend, SER_DISK, CLIENT_VERSION);
+            filein >> block;
+        } else {
+            // Open history file to read
+            CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+            filein >> block;
+        }
     }
     catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
@@ -1793,6 +2106,47 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
     return true;
 }
 
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vchBlock, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart)
+{
+    CDiskBlockPos pos = pindex->GetBlockPos();
+    // The network magic and the size of the block are stored in front of it
+    if (pos.nPos < 8)
+        return error("%s: no block header in front of %s", __func__, pos.ToString());
+
+    try {
+        CMappedRecord record;
+        if (GetMappedRecord(pos, false, 0, record)) {
+            if (memcmp(record.pbegin - 8, messageStart, MESSAGE_START_SIZE))
+                return error("%s: block magic mismatch at %s", __func__, pos.ToString());
+            vchBlock.assign(record.pbegin, record.pend);
+        } else {
+            // Open history file to read
+            CAutoFile filein(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - 8), true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+            CMessageHeader::MessageStartChars blockStart;
+            unsigned int nSize;
+            filein >> FLATDATA(blockStart) >> nSize;
+            if (memcmp(blockStart, messageStart, MESSAGE_START_SIZE))
+                return error("%s: block magic mismatch at %s", __func__, pos.ToString());
+            if (nSize > MAX_BLOCK_SERIALIZED_SIZE)
+                return error("%s: block size %u too large at %s", __func__, nSize, pos.ToString());
+            vchBlock.resize(nSize);
+            filein.read((char*)vchBlock.data(), nSize);
+        }
+    }
+    catch (const std::exception& e) {
+        return error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+
+    // The hash of a block is the hash of its serialized 80 byte header
+    static const size_t nHeaderSize = 80;
+    if (vchBlock.size() < nHeaderSize || Hash(vchBlock.begin(), vchBlock.begin() + nHeaderSize) != pindex->GetBlockHash())
+        return error("%s: block at %s does not match index for %s", __func__, pos.ToString(), pindex->ToString());
+
+    return true;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     int halvings = nHeight / consensusParams.nSubsidyHalvingInterval;
@@ -2168,16 +2522,22 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
 
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("%s: OpenUndoFile failed", __func__);
-
     // Read block
     uint256 hashChecksum;
     try {
-        filein >> blockundo;
-        filein >> hashChecksum;
+        CMappedRecord record;
+        if (GetMappedRecord(pos, true, sizeof(hashChecksum), record)) {
+            CSpanReader filein(record.pbegin, record.pend, SER_DISK, CLIENT_VERSION);
+            filein >> blockundo;
+            filein >> hashChecksum;
+        } else {
+            // Open history file to read
+            CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("%s: OpenUndoFile failed", __func__);
+            filein >> blockundo;
+            filein >> hashChecksum;
+        }
     }
     catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s", __func__, e.what());
@@ -2246,67 +2606,388 @@ static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const CO
     return fClean;
 }
 
-bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+/**
+ * Apply the address index rows of one block, or when connecting of a range of
+ * blocks, to the per-address summary records, and add the updated records to
+ * batch. The records are running totals, so the batch has to carry the position
+ * of the address index too, or the blocks would be counted again on a replay.
+ * The rows of an address that belong to the same transaction are expected to be
+ * adjacent, which is how ConnectBlock, DisconnectBlock and the index builder
+ * produce them. nHeight is the height of the disconnected block.
+ */
+static bool UpdateAddressSummaries(CDBBatch &batch, const std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex, int nHeight, bool fConnect)
 {
-    assert(pindex->GetBlockHash() == view.GetBestBlock());
+    typedef std::pair<unsigned int, uint160> AddressId;
+    struct BlockDelta {
+        CAmount balance;
+        CAmount received;
+        unsigned int txCount;
+        uint256 lastTx;
+        int firstHeight;
+        int lastHeight;
+        BlockDelta() : balance(0), received(0), txCount(0), firstHeight(0), lastHeight(0) {}
+    };
 
-    if (pfClean)
-        *pfClean = false;
+    std::map<AddressId, BlockDelta> mapDeltas;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = addressIndex.begin(); it != addressIndex.end(); it++) {
+        BlockDelta &delta = mapDeltas[std::make_pair(it->first.type, it->first.hashBytes)];
+        delta.balance += it->second;
+        if (it->second > 0)
+            delta.received += it->second;
+        if (delta.txCount == 0 || delta.lastTx != it->first.txhash) {
+            if (delta.txCount == 0 || it->first.blockHeight < delta.firstHeight)
+                delta.firstHeight = it->first.blockHeight;
+            delta.lastHeight = std::max(delta.lastHeight, it->first.blockHeight);
+            delta.txCount++;
+            delta.lastTx = it->first.txhash;
+        }
+    }
+
+    std::vector<std::pair<CAddressIndexIteratorKey, CAddressSummaryValue> > vSummaries;
+    vSummaries.reserve(mapDeltas.size());
+    for (std::map<AddressId, BlockDelta>::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); it++) {
+        const int type = it->first.first;
+        const uint160 &hashBytes = it->first.second;
+        CAddressSummaryValue summary;
+        if (!pblocktree->ReadAddressSummaryIndex(hashBytes, type, summary))
+            summary.SetNull();
+
+        if (fConnect) {
+            if (summary.IsNull())
+                summary.firstHeight = it->second.firstHeight;
+            summary.balance += it->second.balance;
+            summary.received += it->second.received;
+            summary.txCount += it->second.txCount;
+            summary.lastHeight = it->second.lastHeight;
+        } else {
+            if (summary.txCount < it->second.txCount)
+                return error("%s: address summary underflow for %s", __func__, hashBytes.GetHex());
+            summary.balance -= it->second.balance;
+            summary.received -= it->second.received;
+            summary.txCount -= it->second.txCount;
+            if (summary.IsNull()) {
+                summary.SetNull();
+            } else if (summary.lastHeight >= nHeight) {
+                if (!pblocktree->ReadAddressIndexLastHeight(hashBytes, type, nHeight, summary.lastHeight))
+                    return error("%s: unable to find previous activity for %s", __func__, hashBytes.GetHex());
+            }
+        }
+        vSummaries.push_back(std::make_pair(CAddressIndexIteratorKey(type, hashBytes), summary));
+    }
 
-    bool fClean = true;
+    pblocktree->UpdateAddressSummaryIndex(batch, vSummaries);
+    return true;
+}
 
-    CBlockUndo blockUndo;
-    CDiskBlockPos pos = pindex->GetUndoPos();
-    if (pos.IsNull())
-        return error("DisconnectBlock(): no undo data available");
-    if (!UndoReadFromDisk(blockUndo, pos, pindex->pprev->GetBlockHash()))
-        return error("DisconnectBlock(): failure reading undo data");
+void GetScriptIndexAddresses(const CScript &script, std::vector<std::pair<uint160, int> > &addresses)
+{
+    addresses.clear();
 
-    if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
-        return error("DisconnectBlock(): block and undo data inconsistent");
+    // The two most common templates do not need the solver
+    if (script.IsPayToScriptHash()) {
+        addresses.push_back(std::make_pair(uint160(vector<unsigned char>(script.begin()+2, script.begin()+22)), 2));
+        return;
+    } else if (script.IsPayToPublicKeyHash()) {
+        addresses.push_back(std::make_pair(uint160(vector<unsigned char>(script.begin()+3, script.begin()+23)), 1));
+        return;
+    }
 
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
-    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
-    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+    txnouttype whichType;
+    std::vector<std::vector<unsigned char> > vSolutions;
+    if (!Solver(script, whichType, vSolutions))
+        return;
 
-    // undo transactions in reverse order
-    for (int i = block.vtx.size() - 1; i >= 0; i--) {
+    switch (whichType) {
+    case TX_PUBKEY:
+        addresses.push_back(std::make_pair(uint160(CPubKey(vSolutions[0]).GetID()), 1));
+        break;
+    case TX_WITNESS_V0_KEYHASH:
+        // the witness program is the hash of the key
+        addresses.push_back(std::make_pair(uint160(vSolutions[0]), 3));
+        break;
+    case TX_WITNESS_V0_SCRIPTHASH: {
+        // RIPEMD160 of the witness program is Hash160 of the witness script
+        uint160 hashBytes;
+        CRIPEMD160().Write(&vSolutions[0][0], vSolutions[0].size()).Finalize(hashBytes.begin());
+        addresses.push_back(std::make_pair(hashBytes, 4));
+        break;
+    }
+    case TX_MULTISIG:
+        // every participant, without the required and total key counts
+        for (unsigned int i = 1; i + 1 < vSolutions.size(); i++) {
+            std::pair<uint160, int> address(CPubKey(vSolutions[i]).GetID(), 1);
+            if (std::find(addresses.begin(), addresses.end(), address) == addresses.end())
+                addresses.push_back(address);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Store the address index rows of watched addresses per watch set and block, or
+ * without fConnect erase the matches of the single block pindexLast again.
+ */
+static bool UpdateAddressWatchMatches(CDBBatch &batch, const CBlockIndex* pindexLast, bool fConnect,
+                                      const std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex)
+{
+    std::vector<std::pair<CAddressWatchMatchKey, std::vector<std::pair<CAddressIndexKey, CAmount> > > > vMatches;
+    if (!fConnect) {
+        // The addresses of a set may have changed since the block was connected,
+        // so erase the row of every set instead of the ones its rows match now
+        std::map<std::string, unsigned int> sets;
+        addressWatchSets.List(sets);
+        for (std::map<std::string, unsigned int>::const_iterator it = sets.begin(); it != sets.end(); it++)
+            vMatches.push_back(std::make_pair(CAddressWatchMatchKey(it->first, pindexLast->GetBlockHash()),
+                                              std::vector<std::pair<CAddressIndexKey, CAmount> >()));
+        pblocktree->UpdateAddressWatchMatches(batch, vMatches);
+        return true;
+    }
+
+    std::map<std::string, std::vector<std::pair<CAddressIndexKey, CAmount> > > mapMatches;
+    if (!addressWatchSets.Match(addressIndex, mapMatches))
+        return false;
+    if (mapMatches.empty())
+        return true;
+
+    for (std::map<std::string, std::vector<std::pair<CAddressIndexKey, CAmount> > >::const_iterator it = mapMatches.begin(); it != mapMatches.end(); it++) {
+        // Rows of a range of blocks are ordered by address, split them up by block
+        std::map<int, std::vector<std::pair<CAddressIndexKey, CAmount> > > mapBlocks;
+        for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator itRow = it->second.begin(); itRow != it->second.end(); itRow++)
+            mapBlocks[itRow->first.blockHeight].push_back(*itRow);
+
+        for (std::map<int, std::vector<std::pair<CAddressIndexKey, CAmount> > >::iterator itBlock = mapBlocks.begin(); itBlock != mapBlocks.end(); itBlock++) {
+            vMatches.push_back(std::make_pair(CAddressWatchMatchKey(it->first, pindexLast->GetAncestor(itBlock->first)->GetBlockHash()),
+                                              std::vector<std::pair<CAddressIndexKey, CAmount> >()));
+            vMatches.back().second.swap(itBlock->second);
+        }
+    }
+
+    pblocktree->UpdateAddressWatchMatches(batch, vMatches);
+    return true;
+}
+
+/**
+ * Collect the address and spent index rows of a block, taking the outputs spent
+ * by its inputs from the undo data. With fConnect the rows add the block to the
+ * indexes, otherwise they remove it again. The rows of each transaction are
+ * adjacent, as UpdateAddressSummaries expects, and rows for the same key are in
+ * the order they have to be applied.
+ */
+static void GetBlockIndexRows(const CBlock& block, const CBlockUndo& blockundo, int nHeight, bool fConnect,
+                              bool fAddress, bool fSpent,
+                              std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
+                              std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &addressUnspentIndex,
+                              std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > &spentIndex)
+{
+    std::vector<std::pair<uint160, int> > addresses;
+    for (unsigned int n = 0; n < block.vtx.size(); n++) {
+        // Undo the transactions in reverse order, so that outputs which are
+        // created and spent in this block end up erased from the unspent index
+        const unsigned int i = fConnect ? n : block.vtx.size() - 1 - n;
         const CTransaction &tx = block.vtx[i];
-        uint256 hash = tx.GetHash();
+        const uint256 txhash = tx.GetHash();
 
+        if (i > 0) {
+            const CTxUndo &txundo = blockundo.vtxundo[i-1];
+            for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                const CTxIn &input = tx.vin[j];
+                const CTxInUndo &undo = txundo.vprevout[j];
+                const CTxOut &prevout = undo.txout;
+                GetScriptIndexAddresses(prevout.scriptPubKey, addresses);
+
+                if (fAddress) {
+                    for (std::vector<std::pair<uint160, int> >::const_iterator it = addresses.begin(); it != addresses.end(); it++) {
+                        // spending activity
+                        addressIndex.push_back(make_pair(CAddressIndexKey(it->second, it->first, nHeight, i, txhash, j, true), prevout.nValue * -1));
 
+                        // the output leaves the unspent index, or is restored to it
+                        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(it->second, it->first, input.prevout.hash, input.prevout.n),
+                                                                fConnect ? CAddressUnspentValue::Spent(prevout.nValue) : CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, undo.nHeight)));
+                    }
+                }
 
-       if (fAddressIndex) {
+                if (fSpent) {
+                    // the spent index determines the txid and input that spent an output
+                    // and gives the amount and address of an input, none for bare multisig
+                    int addressType = addresses.size() == 1 ? addresses[0].second : 0;
+                    uint160 hashBytes = addresses.size() == 1 ? addresses[0].first : uint160();
+                    spentIndex.push_back(make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n),
+                                                   fConnect ? CSpentIndexValue(txhash, j, nHeight, prevout.nValue, addressType, hashBytes) : CSpentIndexValue()));
+                }
+            }
+        }
 
-            for (unsigned int k = tx.vout.size(); k-- > 0;) {
+        if (fAddress) {
+            for (unsigned int k = 0; k < tx.vout.size(); k++) {
                 const CTxOut &out = tx.vout[k];
+                GetScriptIndexAddresses(out.scriptPubKey, addresses);
+
+                for (std::vector<std::pair<uint160, int> >::const_iterator it = addresses.begin(); it != addresses.end(); it++) {
+                    // receiving activity
+                    addressIndex.push_back(make_pair(CAddressIndexKey(it->second, it->first, nHeight, i, txhash, k, false), out.nValue));
 
-                if (out.scriptPubKey.IsPayToScriptHash()) {
-                    vector<unsigned char> hashBytes(out.scriptPubKey.begin()+2, out.scriptPubKey.begin()+22);
+                    // the new output enters the unspent index, or is removed from it
+                    addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(it->second, it->first, txhash, k),
+                                                            fConnect ? CAddressUnspentValue(out.nValue, out.scriptPubKey, nHeight) : CAddressUnspentValue::Spent(out.nValue)));
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Write the block file information and the block index entries that changed
+ * since they were last written, after the block and undo data they refer to
+ * reached the disk. The optional indexes no longer need the records of the
+ * blocks they cover then.
+ */
+static bool WriteDirtyBlockInfo()
+{
+    AssertLockHeld(cs_main);
+    LOCK(cs_LastBlockFile);
+    std::vector<std::pair<int, const CBlockFileInfo*> > vFiles;
+    vFiles.reserve(setDirtyFileInfo.size());
+    for (set<int>::iterator it = setDirtyFileInfo.begin(); it != setDirtyFileInfo.end(); ) {
+        vFiles.push_back(make_pair(*it, &vinfoBlockFile[*it]));
+        setDirtyFileInfo.erase(it++);
+    }
+    std::vector<const CBlockIndex*> vBlocks;
+    vBlocks.reserve(setDirtyBlockIndex.size());
+    for (set<CBlockIndex*>::iterator it = setDirtyBlockIndex.begin(); it != setDirtyBlockIndex.end(); ) {
+        vBlocks.push_back(*it);
+        setDirtyBlockIndex.erase(it++);
+    }
+    if (!pblocktree->WriteBatchSync(vFiles, nLastBlockFile, vBlocks))
+        return false;
+    for (int i = 0; i < OPTIONAL_INDEX_COUNT; i++)
+        if (IsOptionalIndexEnabled((OptionalIndex)i) && vIndexPending[i].empty() && !pblocktree->EraseIndexBlocks((OptionalIndex)i))
+            return false;
+    return true;
+}
 
-                    // undo receiving activity
-                    addressIndex.push_back(make_pair(CAddressIndexKey(2, uint160(hashBytes), pindex->nHeight, i, hash, k, false), out.nValue));
+/**
+ * Write the rows of the blocks from pindexFirst up to pindexLast to each optional
+ * index selected in fIndex, and move the position of those indexes to pindexLast.
+ * Without fConnect the rows remove the single block pindexLast again. Each index
+ * gets its rows and its new position in one batch, so that a crash cannot leave
+ * rows behind that a replay of the blocks would apply a second time.
+ */
+static bool WriteBlockIndexRows(const CBlockIndex* pindexFirst, const CBlockIndex* pindexLast, bool fConnect, const bool fIndex[OPTIONAL_INDEX_COUNT],
+                                const std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
+                                const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &addressUnspentIndex,
+                                const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > &spentIndex)
+{
+    AssertLockHeld(cs_main);
+    assert(fConnect || pindexFirst == pindexLast);
 
-                    // undo unspent index
-                    addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(2, uint160(hashBytes), hash, k), CAddressUnspentValue()));
+    boost::scoped_ptr<CDBBatch> pbatch[OPTIONAL_INDEX_COUNT];
+    for (int i = 0; i < OPTIONAL_INDEX_COUNT; i++)
+        if (fIndex[i])
+            pbatch[i].reset(pblocktree->NewIndexBatch((OptionalIndex)i));
 
-                } else if (out.scriptPubKey.IsPayToPublicKeyHash()) {
-                    vector<unsigned char> hashBytes(out.scriptPubKey.begin()+3, out.scriptPubKey.begin()+23);
+    if (fIndex[OPTIONAL_INDEX_ADDRESS]) {
+        CDBBatch &batch = *pbatch[OPTIONAL_INDEX_ADDRESS];
+        if (fConnect)
+            pblocktree->WriteAddressIndex(batch, addressIndex);
+        else
+            pblocktree->EraseAddressIndex(batch, addressIndex);
+        pblocktree->UpdateAddressUnspentIndex(batch, addressUnspentIndex);
+        if (fAddressSummaryIndex && !UpdateAddressSummaries(batch, addressIndex, pindexLast->nHeight, fConnect))
+            return error("%s: failed to update address summary index", __func__);
+        if (!UpdateAddressWatchMatches(batch, pindexLast, fConnect, addressIndex))
+            return error("%s: failed to match address watch sets", __func__);
+    }
 
-                    // undo receiving activity
-                    addressIndex.push_back(make_pair(CAddressIndexKey(1, uint160(hashBytes), pindex->nHeight, i, hash, k, false), out.nValue));
+    if (fIndex[OPTIONAL_INDEX_SPENT])
+        pblocktree->UpdateSpentIndex(*pbatch[OPTIONAL_INDEX_SPENT], spentIndex);
 
-                    // undo unspent index
-                    addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(1, uint160(hashBytes), hash, k), CAddressUnspentValue()));
+    // Timestamps of disconnected blocks are kept, readers filter on the active chain
+    if (fIndex[OPTIONAL_INDEX_TIMESTAMP] && fConnect) {
+        unsigned int prevLogicalTS = 0;
 
-                } else {
-                    continue;
-                }
+        // retrieve logical timestamp of the previous block
+        if (pindexFirst->pprev)
+            if (!pblocktree->ReadTimestampBlockIndex(pindexFirst->pprev->GetBlockHash(), prevLogicalTS))
+                LogPrintf("%s: Failed to read previous block's logical timestamp\n", __func__);
 
+        for (int nHeight = pindexFirst->nHeight; nHeight <= pindexLast->nHeight; nHeight++) {
+            const CBlockIndex* pindex = pindexLast->GetAncestor(nHeight);
+            unsigned int logicalTS = pindex->nTime;
+            if (logicalTS <= prevLogicalTS) {
+                logicalTS = prevLogicalTS + 1;
+                LogPrintf("%s: Previous logical timestamp is newer Actual[%d] prevLogical[%d] Logical[%d]\n", __func__, pindex->nTime, prevLogicalTS, logicalTS);
             }
 
-        } 
+            pblocktree->WriteTimestampIndex(*pbatch[OPTIONAL_INDEX_TIMESTAMP], CTimestampIndexKey(logicalTS, pindex->GetBlockHash()), pindex->nHeight);
+            pblocktree->WriteTimestampBlockIndex(*pbatch[OPTIONAL_INDEX_TIMESTAMP], CTimestampBlockIndexKey(pindex->GetBlockHash()), CTimestampBlockIndexValue(logicalTS));
+
+            prevLogicalTS = logicalTS;
+        }
+    }
+
+    // The block index only stores the blocks at the next flush, until then each
+    // index keeps the chain it covers for LoadIndexBestBlocks
+    if (fConnect) {
+        for (int nHeight = pindexFirst->nHeight; nHeight <= pindexLast->nHeight; nHeight++) {
+            const CBlockIndex* pindex = pindexLast->GetAncestor(nHeight);
+            for (int i = 0; i < OPTIONAL_INDEX_COUNT; i++)
+                if (fIndex[i])
+                    pblocktree->WriteIndexBlock(*pbatch[i], pindex->GetBlockHash(), pindex->pprev ? pindex->pprev->GetBlockHash() : uint256());
+        }
+    }
+
+    const CBlockIndex* pindexBest = fConnect ? pindexLast : pindexLast->pprev;
+    for (int i = 0; i < OPTIONAL_INDEX_COUNT; i++) {
+        if (!fIndex[i])
+            continue;
+        if (!pblocktree->WriteIndexBatch((OptionalIndex)i, *pbatch[i], pindexBest->GetBlockHash()))
+            return error("%s: failed to write %s index", __func__, GetOptionalIndexName((OptionalIndex)i));
+        pindexIndexBest[i] = pindexBest;
+    }
+
+    return true;
+}
+
+/**
+ * Add the block to (fConnect) or remove it from each optional index selected in
+ * fIndex, and move the position of those indexes accordingly.
+ */
+static bool UpdateBlockIndexes(const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex, bool fConnect, const bool fIndex[OPTIONAL_INDEX_COUNT])
+{
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+    GetBlockIndexRows(block, blockundo, pindex->nHeight, fConnect, fIndex[OPTIONAL_INDEX_ADDRESS], fIndex[OPTIONAL_INDEX_SPENT],
+                      addressIndex, addressUnspentIndex, spentIndex);
+
+    return WriteBlockIndexRows(pindex, pindex, fConnect, fIndex, addressIndex, addressUnspentIndex, spentIndex);
+}
+
+bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+{
+    assert(pindex->GetBlockHash() == view.GetBestBlock());
+
+    if (pfClean)
+        *pfClean = false;
+
+    bool fClean = true;
+
+    CBlockUndo blockUndo;
+    CDiskBlockPos pos = pindex->GetUndoPos();
+    if (pos.IsNull())
+        return error("DisconnectBlock(): no undo data available");
+    if (!UndoReadFromDisk(blockUndo, pos, pindex->pprev->GetBlockHash()))
+        return error("DisconnectBlock(): failure reading undo data");
+
+    if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
+        return error("DisconnectBlock(): block and undo data inconsistent");
 
+    // undo transactions in reverse order
+    for (int i = block.vtx.size() - 1; i >= 0; i--) {
+        const CTransaction &tx = block.vtx[i];
+        uint256 hash = tx.GetHash();
 
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
@@ -2337,62 +3018,289 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
                 const CTxInUndo &undo = txundo.vprevout[j];
                 if (!ApplyTxInUndo(undo, view, out))
                     fClean = false;
+            }
+        }
+    }
 
-                const CTxIn input = tx.vin[j];
+    // move best block pointer to prevout block
+    view.SetBestBlock(pindex->pprev->GetBlockHash());
 
-                if (fSpentIndex) {
-                    // undo and delete the spent index
-                    spentIndex.push_back(make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n), CSpentIndexValue()));
-                }
+    if (pfClean) {
+        *pfClean = fClean;
+        return true;
+    }
 
-                if (fAddressIndex) {
-                    const CTxOut &prevout = view.GetOutputFor(tx.vin[j]);
-                    if (prevout.scriptPubKey.IsPayToScriptHash()) {
-                        vector<unsigned char> hashBytes(prevout.scriptPubKey.begin()+2, prevout.scriptPubKey.begin()+22);
+    // Remove the block from the optional indexes that end with it; indexes that are
+    // further ahead on this branch are rewound by the index builder
+    bool fIndex[OPTIONAL_INDEX_COUNT];
+    bool fAnyIndex = false;
+    for (int i = 0; i < OPTIONAL_INDEX_COUNT; i++) {
+        fIndex[i] = IsOptionalIndexEnabled((OptionalIndex)i) && pindexIndexBest[i] == pindex;
+        // The rows of the pending blocks after it cannot be removed without them
+        if (fIndex[i] && !vIndexPending[i].empty()) {
+            if (!ResetPendingIndex((OptionalIndex)i))
+                return AbortNode(state, "Failed to reset optional index");
+            fIndex[i] = false;
+        }
+        fAnyIndex |= fIndex[i];
+    }
+    if (fAnyIndex && !UpdateBlockIndexes(block, blockUndo, pindex, false, fIndex))
+        return AbortNode(state, "Failed to remove block from optional indexes");
 
-                        // undo spending activity
-                        addressIndex.push_back(make_pair(CAddressIndexKey(2, uint160(hashBytes), pindex->nHeight, i, hash, j, true), prevout.nValue * -1));
+    return fClean;
+}
 
-                        // restore unspent index
-                        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(2, uint160(hashBytes), input.prevout.hash, input.prevout.n), CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, undo.nHeight)));
+/** Number of blocks each thread of the index builder reads per round while the indexes are far behind */
+static const int INDEX_BUILD_BLOCKS_PER_THREAD = 16;
 
+/** Consecutive blocks whose index rows are collected by one thread of the index builder */
+struct CIndexBuildRun
+{
+    std::vector<CDiskBlockPos> vBlockPos;
+    std::vector<CDiskBlockPos> vUndoPos;
+    std::vector<uint256> vHashPrev;
+    int nFirstHeight;
+    bool fConnect;
+    bool fAddress;
+    bool fSpent;
+    bool fFailed;
+
+    /** Rows in key order; unspent rows only keep the last state of each output */
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    std::map<CAddressUnspentKey, CAddressUnspentValue, CAddressUnspentKeyCompare> addressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
 
-                    } else if (prevout.scriptPubKey.IsPayToPublicKeyHash()) {
-                        vector<unsigned char> hashBytes(prevout.scriptPubKey.begin()+3, prevout.scriptPubKey.begin()+23);
+    CIndexBuildRun() : nFirstHeight(0), fConnect(true), fAddress(false), fSpent(false), fFailed(false) {}
+};
 
-                        // undo spending activity
-                        addressIndex.push_back(make_pair(CAddressIndexKey(1, uint160(hashBytes), pindex->nHeight, i, hash, j, true), prevout.nValue * -1));
+static bool AddressIndexRowLess(const std::pair<CAddressIndexKey, CAmount> &a, const std::pair<CAddressIndexKey, CAmount> &b)
+{
+    return CAddressIndexKeyCompare()(a.first, b.first);
+}
 
-                        // restore unspent index
-                        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(1, uint160(hashBytes), input.prevout.hash, input.prevout.n), CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, undo.nHeight)));
+static bool SpentIndexRowLess(const std::pair<CSpentIndexKey, CSpentIndexValue> &a, const std::pair<CSpentIndexKey, CSpentIndexValue> &b)
+{
+    return CSpentIndexKeyCompare()(a.first, b.first);
+}
 
-                    } else {
+static void CollectIndexRun(CIndexBuildRun *run)
+{
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
+
+    for (size_t i = 0; i < run->vBlockPos.size(); i++) {
+        CBlock block;
+        CBlockUndo blockundo;
+        if (!ReadBlockFromDisk(block, run->vBlockPos[i], consensusParams) ||
+            !UndoReadFromDisk(blockundo, run->vUndoPos[i], run->vHashPrev[i])) {
+            run->fFailed = true;
+            return;
+        }
+
+        addressUnspentIndex.clear();
+        GetBlockIndexRows(block, blockundo, run->nFirstHeight + i, run->fConnect, run->fAddress, run->fSpent,
+                          run->addressIndex, addressUnspentIndex, run->spentIndex);
+
+        // Outputs created and spent within the run end up erased
+        for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it = addressUnspentIndex.begin(); it != addressUnspentIndex.end(); it++)
+            run->addressUnspentIndex[it->first] = it->second;
+    }
+
+    std::sort(run->addressIndex.begin(), run->addressIndex.end(), AddressIndexRowLess);
+    std::sort(run->spentIndex.begin(), run->spentIndex.end(), SpentIndexRowLess);
+}
+
+/** Merge the sorted rows of consecutive runs into single runs in key order, so they are written to the database sequentially */
+static bool MergeIndexRuns(std::vector<CIndexBuildRun> &vRuns,
+                           std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
+                           std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &addressUnspentIndex,
+                           std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > &spentIndex)
+{
+    std::map<CAddressUnspentKey, CAddressUnspentValue, CAddressUnspentKeyCompare> mapUnspent;
+    for (std::vector<CIndexBuildRun>::iterator run = vRuns.begin(); run != vRuns.end(); run++) {
+        if (run->fFailed)
+            return false;
+
+        size_t nSorted = addressIndex.size();
+        addressIndex.insert(addressIndex.end(), run->addressIndex.begin(), run->addressIndex.end());
+        std::inplace_merge(addressIndex.begin(), addressIndex.begin() + nSorted, addressIndex.end(), AddressIndexRowLess);
+        std::vector<std::pair<CAddressIndexKey, CAmount> >().swap(run->addressIndex);
+
+        nSorted = spentIndex.size();
+        spentIndex.insert(spentIndex.end(), run->spentIndex.begin(), run->spentIndex.end());
+        std::inplace_merge(spentIndex.begin(), spentIndex.begin() + nSorted, spentIndex.end(), SpentIndexRowLess);
+        std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >().swap(run->spentIndex);
+
+        // Later runs hold the later state of outputs that appear in several runs
+        for (std::map<CAddressUnspentKey, CAddressUnspentValue, CAddressUnspentKeyCompare>::const_iterator it = run->addressUnspentIndex.begin(); it != run->addressUnspentIndex.end(); it++)
+            mapUnspent[it->first] = it->second;
+        run->addressUnspentIndex.clear();
+    }
+    addressUnspentIndex.assign(mapUnspent.begin(), mapUnspent.end());
+    return true;
+}
+
+void ThreadWriteCoins()
+{
+    if (!pcoinsWriter->ThreadWrite())
+        AbortNode("Failed to write to coin database");
+}
+
+void ThreadBuildIndexes()
+{
+    RenameThread("tealcoin-indexbld");
+    int64_t nLastProgress = 0;
+
+    while (true) {
+        boost::this_thread::interruption_point();
+
+        // Reindexing and importing connect the blocks themselves, and with them the indexes
+        if (fImporting || fReindex) {
+            MilliSleep(1000);
+            continue;
+        }
+
+        // Find the next blocks to add to or remove from the indexes that are furthest behind,
+        // together with all other indexes at the same position
+        const CBlockIndex* pindex = NULL;
+        const CBlockIndex* pindexLast = NULL;
+        const CBlockIndex* pindexPrevBest = NULL;
+        bool fConnect = true;
+        bool fPending = false;
+        bool fIndex[OPTIONAL_INDEX_COUNT];
+        std::vector<CIndexBuildRun> vRuns;
+        {
+            LOCK(cs_main);
+            if (chainActive.Tip() != NULL) {
+                // Move the indexes with pending blocks over the ones the chain has connected again,
+                // and build those again whose pending blocks the chain went past on another branch
+                for (int i = 0; i < OPTIONAL_INDEX_COUNT; i++) {
+                    while (IsOptionalIndexEnabled((OptionalIndex)i) && !vIndexPending[i].empty()) {
+                        const CBlockIndex* pindexBest = pindexIndexBest[i];
+                        const CBlockIndex* pindexNext = chainActive.Contains(pindexBest) ? chainActive.Next(pindexBest) : NULL;
+                        bool fReset = !chainActive.Contains(pindexBest) && chainActive.Height() >= pindexBest->nHeight;
+                        if (pindexNext == NULL && !fReset)
+                            break;
+                        if (fReset ? !ResetPendingIndex((OptionalIndex)i) : !TakePendingIndexBlock((OptionalIndex)i, pindexNext)) {
+                            AbortNode("Failed to reset optional index");
+                            return;
+                        }
+                    }
+                    fPending |= !vIndexPending[i].empty();
+                }
+
+                for (int i = 0; i < OPTIONAL_INDEX_COUNT; i++) {
+                    const CBlockIndex* pindexBest = pindexIndexBest[i];
+                    if (!IsOptionalIndexEnabled((OptionalIndex)i) || pindexBest == chainActive.Tip() || !vIndexPending[i].empty())
                         continue;
+                    if (pindex == NULL || (pindexBest ? pindexBest->nHeight : -1) < (pindexPrevBest ? pindexPrevBest->nHeight : -1)) {
+                        pindexPrevBest = pindexBest;
+                        // An index that was left on a stale branch is rewound to the active chain first
+                        fConnect = pindexBest == NULL || chainActive.Contains(pindexBest);
+                        pindex = !fConnect ? pindexBest : pindexBest ? chainActive.Next(pindexBest) : chainActive.Genesis();
                     }
                 }
+            }
+
+            if (pindex == NULL) {
+                if (chainActive.Tip() != NULL && !fPending) {
+                    LogPrintf("%s: optional indexes are synced at height %d\n", __func__, chainActive.Height());
+                    return;
+                }
+                // Nothing to build on until the genesis block or the pending blocks are connected
+            } else {
+                for (int i = 0; i < OPTIONAL_INDEX_COUNT; i++)
+                    fIndex[i] = IsOptionalIndexEnabled((OptionalIndex)i) && pindexIndexBest[i] == pindexPrevBest;
+
+                // The genesis block has nothing to index
+                if (pindex->pprev == NULL) {
+                    for (int i = 0; i < OPTIONAL_INDEX_COUNT; i++)
+                        if (fIndex[i] && !SetIndexBestBlock((OptionalIndex)i, pindex)) {
+                            AbortNode("Failed to write optional index position");
+                            return;
+                        }
+                    continue;
+                }
+
+                // While the indexes are far behind, connect ranges of blocks with one run of blocks per thread
+                pindexLast = pindex;
+                int nThreads = 1;
+                if (fConnect && nIndexBuildThreads > 1) {
+                    int nBlocks = std::min(chainActive.Height() - pindexPrevBest->nHeight, nIndexBuildThreads * INDEX_BUILD_BLOCKS_PER_THREAD);
+                    pindexLast = chainActive[pindexPrevBest->nHeight + nBlocks];
+                    nThreads = (nBlocks + INDEX_BUILD_BLOCKS_PER_THREAD - 1) / INDEX_BUILD_BLOCKS_PER_THREAD;
+                }
 
+                int nBlocks = pindexLast->nHeight - pindex->nHeight + 1;
+                vRuns.resize(nThreads);
+                for (int nHeight = pindex->nHeight; nHeight <= pindexLast->nHeight; nHeight++) {
+                    const CBlockIndex* pindexBlock = fConnect ? chainActive[nHeight] : pindex;
+                    if (!(pindexBlock->nStatus & BLOCK_HAVE_DATA) || !(pindexBlock->nStatus & BLOCK_HAVE_UNDO)) {
+                        AbortNode(strprintf("Block %s is not available to build the optional indexes", pindexBlock->GetBlockHash().ToString()));
+                        return;
+                    }
+                    CIndexBuildRun &run = vRuns[(int64_t)(nHeight - pindex->nHeight) * nThreads / nBlocks];
+                    if (run.vBlockPos.empty())
+                        run.nFirstHeight = nHeight;
+                    run.vBlockPos.push_back(pindexBlock->GetBlockPos());
+                    run.vUndoPos.push_back(pindexBlock->GetUndoPos());
+                    run.vHashPrev.push_back(pindexBlock->pprev->GetBlockHash());
+                }
+                for (std::vector<CIndexBuildRun>::iterator run = vRuns.begin(); run != vRuns.end(); run++) {
+                    run->fConnect = fConnect;
+                    run->fAddress = fIndex[OPTIONAL_INDEX_ADDRESS];
+                    run->fSpent = fIndex[OPTIONAL_INDEX_SPENT];
+                }
             }
         }
-    }
-
-    // move best block pointer to prevout block
-    view.SetBestBlock(pindex->pprev->GetBlockHash());
 
-    if (pfClean) {
-        *pfClean = fClean;
-        return true;
-    }
+        if (pindex == NULL) {
+            MilliSleep(1000);
+            continue;
+        }
 
-    if (fAddressIndex) {
-        if (!pblocktree->EraseAddressIndex(addressIndex)) {
-            return AbortNode(state, "Failed to delete address index");
+        // Read the blocks and collect their rows without holding cs_main
+        if (vRuns.size() == 1) {
+            CollectIndexRun(&vRuns[0]);
+        } else {
+            boost::thread_group workers;
+            for (size_t i = 0; i < vRuns.size(); i++)
+                workers.create_thread(boost::bind(&CollectIndexRun, &vRuns[i]));
+            // The workers use vRuns, so wait for them even when shutting down
+            boost::this_thread::disable_interruption di;
+            workers.join_all();
         }
-        if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)) {
-            return AbortNode(state, "Failed to write address unspent index");
+
+        std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
+        std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+        if (!MergeIndexRuns(vRuns, addressIndex, addressUnspentIndex, spentIndex)) {
+            AbortNode(strprintf("Failed to read blocks %d to %d to build the optional indexes", pindex->nHeight, pindexLast->nHeight));
+            return;
         }
-    }
 
-    return fClean;
+        {
+            LOCK(cs_main);
+            // The chain or the indexes may have moved on while the blocks were read, in which case they are picked again
+            bool fStale = fConnect ? !chainActive.Contains(pindexLast) : chainActive.Contains(pindex);
+            for (int i = 0; i < OPTIONAL_INDEX_COUNT; i++)
+                if (fIndex[i] && pindexIndexBest[i] != pindexPrevBest)
+                    fStale = true;
+            if (fStale)
+                continue;
+
+            if (!WriteBlockIndexRows(pindex, pindexLast, fConnect, fIndex, addressIndex, addressUnspentIndex, spentIndex)) {
+                AbortNode("Failed to write optional indexes");
+                return;
+            }
+
+            if (GetTime() - nLastProgress >= 10) {
+                LogPrintf("%s: optional indexes at height %d of %d\n", __func__,
+                          fConnect ? pindexLast->nHeight : pindex->nHeight - 1, chainActive.Height());
+                nLastProgress = GetTime();
+            }
+        }
+    }
 }
 
 void static FlushBlockFile(bool fFinalize = false)
@@ -2427,6 +3335,96 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+/** Coins of a transaction read for PrefetchInputs */
+struct CFetchedCoins
+{
+    uint256 txid;
+    CCoins coins;
+    bool fFound;
+
+    CFetchedCoins() : fFound(false) {}
+};
+
+/** Reads the coins of one transaction from a view, as a job of coinsfetchqueue */
+class CCoinsFetch
+{
+private:
+    const CCoinsView* view;
+    CFetchedCoins* pfetched;
+
+public:
+    CCoinsFetch() : view(NULL), pfetched(NULL) {}
+    CCoinsFetch(const CCoinsView* viewIn, CFetchedCoins* pfetchedIn) : view(viewIn), pfetched(pfetchedIn) {}
+
+    bool operator()() {
+        try {
+            pfetched->fFound = view->GetCoins(pfetched->txid, pfetched->coins);
+        } catch (const std::runtime_error& e) {
+            // Leave it to ConnectBlock to run into the error again, and report it
+            return false;
+        }
+        return true;
+    }
+
+    void swap(CCoinsFetch& fetch) {
+        std::swap(view, fetch.view);
+        std::swap(pfetched, fetch.pfetched);
+    }
+};
+
+static CCheckQueue<CCoinsFetch> coinsfetchqueue(16);
+
+void ThreadCoinsFetch() {
+    RenameThread("tealcoin-coinsfetch");
+    coinsfetchqueue.Thread();
+}
+
+/**
+ * Read the coins spent by a block that are not cached yet from several
+ * threads at once, and cache them, so that connecting the block finds them
+ * in memory instead of waiting for the database one input at a time.
+ */
+static void PrefetchInputs(const CBlock& block)
+{
+    AssertLockHeld(cs_main);
+    if (!nCoinsFetchThreads || !pcoinsWriter)
+        return;
+
+    std::set<uint256> setCreated, setMissing;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        setCreated.insert(tx.GetHash());
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            const uint256& hash = txin.prevout.hash;
+            if (!setCreated.count(hash) && !pcoinsTip->HaveCoinsInCache(hash))
+                setMissing.insert(hash);
+        }
+    }
+    if (setMissing.size() < 2)
+        return;
+    int64_t nStart = GetTimeMicros();
+
+    // Read below the cache, which only the writer's lock guards; a background
+    // write just moves coins from its batch to the database meanwhile
+    std::vector<CFetchedCoins> vFetched(setMissing.size());
+    std::vector<CCoinsFetch> vFetches;
+    vFetches.reserve(setMissing.size());
+    size_t i = 0;
+    for (std::set<uint256>::const_iterator it = setMissing.begin(); it != setMissing.end(); it++, i++) {
+        vFetched[i].txid = *it;
+        vFetches.push_back(CCoinsFetch(pcoinsWriter, &vFetched[i]));
+    }
+    CCheckQueueControl<CCoinsFetch> control(&coinsfetchqueue);
+    control.Add(vFetches);
+    control.Wait();
+    BOOST_FOREACH(CFetchedCoins& fetched, vFetched)
+        if (fetched.fFound)
+            pcoinsTip->CacheFetchedCoins(fetched.txid, fetched.coins);
+    LogPrint("bench", "    - Prefetch %u inputs: %.2fms\n", (unsigned int)vFetched.size(), (GetTimeMicros() - nStart) * 0.001);
+}
+
 // Protected by cs_main
 VersionBitsCache versionbitscache;
 
@@ -2480,6 +3478,9 @@ static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
+/** Blocks -reindex stored from their headers, whose transactions ConnectBlock checks in context first */
+static std::set<const CBlockIndex*> setBlockIndexFromHeaders;
+
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
                   CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck)
 {
@@ -2490,6 +3491,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Check it again in case a previous version let a bad block in
     if (!CheckBlock(block, state, chainparams.GetConsensus(), !fJustCheck, !fJustCheck))
         return error("%s: Consensus::CheckBlock: %s", __func__, FormatStateMessage(state));
+    if (!fJustCheck && setBlockIndexFromHeaders.count(pindex)) {
+        if (!ContextualCheckBlock(block, state, pindex->pprev))
+            return error("%s: Consensus::ContextualCheckBlock: %s", __func__, FormatStateMessage(state));
+        setBlockIndexFromHeaders.erase(pindex);
+    }
 
     // verify that the view's current state corresponds to the previous block
     uint256 hashPrevBlock = pindex->pprev == NULL ? uint256() : pindex->pprev->GetBlockHash();
@@ -2498,8 +3504,15 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Special case for the genesis block, skipping connection of its transactions
     // (its coinbase is unspendable)
     if (block.GetHash() == chainparams.GetConsensus().hashGenesisBlock) {
-        if (!fJustCheck)
+        if (!fJustCheck) {
             view.SetBestBlock(pindex->GetBlockHash());
+            // The genesis block has nothing to index, just start the optional indexes from it
+            for (int i = 0; i < OPTIONAL_INDEX_COUNT; i++) {
+                if (IsOptionalIndexEnabled((OptionalIndex)i) && pindexIndexBest[i] == NULL)
+                    if (!SetIndexBestBlock((OptionalIndex)i, pindex))
+                        return AbortNode(state, "Failed to write optional index position");
+            }
+        }
         return true;
     }
 
@@ -2598,16 +3611,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(block.vtx.size());
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
-    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
-    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
 
     std::vector<PrecomputedTransactionData> txdata;
     txdata.reserve(block.vtx.size()); // Required so that pointers to individual PrecomputedTransactionData don't get invalidated
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
         const CTransaction &tx = block.vtx[i];
-        const uint256 txhash = tx.GetHash();
 
         nInputs += tx.vin.size();
 
@@ -2640,43 +3649,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 return state.DoS(100, error("%s: contains a non-BIP68-final transaction", __func__),
                                  REJECT_INVALID, "bad-txns-nonfinal");
             }
-
-            if (fAddressIndex || fSpentIndex)
-            {
-                for (size_t j = 0; j < tx.vin.size(); j++) {
-
-                    const CTxIn input = tx.vin[j];
-                    const CTxOut &prevout = view.GetOutputFor(tx.vin[j]);
-                    uint160 hashBytes;
-                    int addressType;
-
-                    if (prevout.scriptPubKey.IsPayToScriptHash()) {
-                        hashBytes = uint160(vector <unsigned char>(prevout.scriptPubKey.begin()+2, prevout.scriptPubKey.begin()+22));
-                        addressType = 2;
-                    } else if (prevout.scriptPubKey.IsPayToPublicKeyHash()) {
-                        hashBytes = uint160(vector <unsigned char>(prevout.scriptPubKey.begin()+3, prevout.scriptPubKey.begin()+23));
-                        addressType = 1;
-                    } else {
-                        hashBytes.SetNull();
-                        addressType = 0;
-                    }
-
-                    if (fAddressIndex && addressType > 0) {
-                        // record spending activity
-                        addressIndex.push_back(make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, txhash, j, true), prevout.nValue * -1));
-
-                        // remove address from unspent index
-                        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(addressType, hashBytes, input.prevout.hash, input.prevout.n), CAddressUnspentValue()));
-                    }
-
-                    if (fSpentIndex) {
-                        // add the spent index to determine the txid and input that spent an output
-                        // and to find the amount and address from an input
-                        spentIndex.push_back(make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n), CSpentIndexValue(txhash, j, pindex->nHeight, prevout.nValue, addressType, hashBytes)));
-                    }
-                }
-
-            }
         }
 
         // GetTransactionSigOpCost counts 3 types of sigops:
@@ -2701,36 +3673,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             control.Add(vChecks);
         }
 
-        if (fAddressIndex) {
-            for (unsigned int k = 0; k < tx.vout.size(); k++) {
-                const CTxOut &out = tx.vout[k];
-
-                if (out.scriptPubKey.IsPayToScriptHash()) {
-                    vector<unsigned char> hashBytes(out.scriptPubKey.begin()+2, out.scriptPubKey.begin()+22);
-
-                    // record receiving activity
-                    addressIndex.push_back(make_pair(CAddressIndexKey(2, uint160(hashBytes), pindex->nHeight, i, txhash, k, false), out.nValue));
-
-                    // record unspent output
-                    addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(2, uint160(hashBytes), txhash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
-
-                } else if (out.scriptPubKey.IsPayToPublicKeyHash()) {
-                    vector<unsigned char> hashBytes(out.scriptPubKey.begin()+3, out.scriptPubKey.begin()+23);
-
-                    // record receiving activity
-                    addressIndex.push_back(make_pair(CAddressIndexKey(1, uint160(hashBytes), pindex->nHeight, i, txhash, k, false), out.nValue));
-
-                    // record unspent output
-                    addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(1, uint160(hashBytes), txhash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
-
-                } else {
-                    continue;
-                }
-
-            }
-        }
-
-
         CTxUndo undoDummy;
         if (i > 0) {
             blockundo.vtxundo.push_back(CTxUndo());
@@ -2777,44 +3719,29 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         setDirtyBlockIndex.insert(pindex);
     }
 
-    if (fTxIndex)
+    if (fTxIndex) {
         if (!pblocktree->WriteTxIndex(vPos))
             return AbortNode(state, "Failed to write transaction index");
-
-    if (fAddressIndex) {
-        if (!pblocktree->WriteAddressIndex(addressIndex)) {
-            return AbortNode(state, "Failed to write address index");
-        }
-
-        if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)) {
-            return AbortNode(state, "Failed to write address unspent index");
-        }
+        // A transaction can be cached from a block that has since been disconnected
+        for (std::vector<std::pair<uint256, CDiskTxPos> >::const_iterator it = vPos.begin(); it != vPos.end(); it++)
+            txLookupCache.Erase(it->first);
     }
 
-    if (fSpentIndex)
-        if (!pblocktree->UpdateSpentIndex(spentIndex))
-            return AbortNode(state, "Failed to write transaction index");
-
-    if (fTimestampIndex) {
-        unsigned int logicalTS = pindex->nTime;
-        unsigned int prevLogicalTS = 0;
-
-        // retrieve logical timestamp of the previous block
-        if (pindex->pprev)
-            if (!pblocktree->ReadTimestampBlockIndex(pindex->pprev->GetBlockHash(), prevLogicalTS))
-                LogPrintf("%s: Failed to read previous block's logical timestamp\n", __func__);
-
-        if (logicalTS <= prevLogicalTS) {
-            logicalTS = prevLogicalTS + 1;
-            LogPrintf("%s: Previous logical timestamp is newer Actual[%d] prevLogical[%d] Logical[%d]\n", __func__, pindex->nTime, prevLogicalTS, logicalTS);
+    // Extend the optional indexes that cover the chain up to the previous block
+    bool fIndex[OPTIONAL_INDEX_COUNT];
+    bool fAnyIndex = false;
+    for (int i = 0; i < OPTIONAL_INDEX_COUNT; i++) {
+        fIndex[i] = IsOptionalIndexEnabled((OptionalIndex)i) && pindexIndexBest[i] == pindex->pprev;
+        // An index that covered the block before the node stopped already has its rows
+        if (fIndex[i] && !vIndexPending[i].empty()) {
+            if (!TakePendingIndexBlock((OptionalIndex)i, pindex))
+                return AbortNode(state, "Failed to reset optional index");
+            fIndex[i] = false;
         }
-
-        if (!pblocktree->WriteTimestampIndex(CTimestampIndexKey(logicalTS, pindex->GetBlockHash())))
-            return AbortNode(state, "Failed to write timestamp index");
-
-        if (!pblocktree->WriteTimestampBlockIndex(CTimestampBlockIndexKey(pindex->GetBlockHash()), CTimestampBlockIndexValue(logicalTS)))
-            return AbortNode(state, "Failed to write blockhash index");
+        fAnyIndex |= fIndex[i];
     }
+    if (fAnyIndex && !UpdateBlockIndexes(block, blockundo, pindex, true, fIndex))
+        return AbortNode(state, "Failed to write block to optional indexes");
 
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
@@ -2886,11 +3813,23 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     if (nLastSetChain == 0) {
         nLastSetChain = nNow;
     }
-    size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+    // A batch still being written takes memory from the cache until it is done
+    size_t nPendingUsage = pcoinsWriter ? pcoinsWriter->PendingUsage() : 0;
+    size_t cacheSize = pcoinsTip->DynamicMemoryUsage() + nPendingUsage;
     // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
     bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCoinCacheUsage;
     // The cache is over the limit, we have to write now.
     bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCoinCacheUsage;
+    if (fCacheLarge || fCacheCritical) {
+        // First drop the least recently used coins that are not modified, which takes no write,
+        // and only flush if the modified ones still fill most of the cache.
+        int64_t nStart = GetTimeMicros();
+        pcoinsTip->EvictUnmodified(nCoinCacheUsage / 2);
+        cacheSize = pcoinsTip->DynamicMemoryUsage() + nPendingUsage;
+        fCacheLarge = fCacheLarge && cacheSize > nCoinCacheUsage * 3 / 4;
+        fCacheCritical = fCacheCritical && cacheSize > nCoinCacheUsage * 3 / 4;
+        LogPrint("bench", "    - Evict coins: %.2fms (%.1fMiB left)\n", (GetTimeMicros() - nStart) * 0.001, cacheSize * (1.0 / (1<<20)));
+    }
     // It's been a while since we wrote the block index to disk. Do this frequently, so we don't need to redownload after a crash.
     bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && nNow > nLastWrite + (int64_t)DATABASE_WRITE_INTERVAL * 1000000;
     // It's been very long since we flushed the cache. Do this infrequently, to optimize cache usage.
@@ -2905,22 +3844,8 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         // First make sure all block and undo data is flushed to disk.
         FlushBlockFile();
         // Then update all block file information (which may refer to block and undo files).
-        {
-            std::vector<std::pair<int, const CBlockFileInfo*> > vFiles;
-            vFiles.reserve(setDirtyFileInfo.size());
-            for (set<int>::iterator it = setDirtyFileInfo.begin(); it != setDirtyFileInfo.end(); ) {
-                vFiles.push_back(make_pair(*it, &vinfoBlockFile[*it]));
-                setDirtyFileInfo.erase(it++);
-            }
-            std::vector<const CBlockIndex*> vBlocks;
-            vBlocks.reserve(setDirtyBlockIndex.size());
-            for (set<CBlockIndex*>::iterator it = setDirtyBlockIndex.begin(); it != setDirtyBlockIndex.end(); ) {
-                vBlocks.push_back(*it);
-                setDirtyBlockIndex.erase(it++);
-            }
-            if (!pblocktree->WriteBatchSync(vFiles, nLastBlockFile, vBlocks)) {
-                return AbortNode(state, "Files to write to block index database");
-            }
+        if (!WriteDirtyBlockInfo()) {
+            return AbortNode(state, "Files to write to block index database");
         }
         // Finally remove any pruned files
         if (fFlushForPrune)
@@ -2937,7 +3862,19 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
-        if (!pcoinsTip->Flush())
+        if (pcoinsWriter) {
+            // Keep the cache warm, down to the most recently used half of it if it has to shrink,
+            // and write the changes without cs_main unless asked to finish
+            int64_t nStart = GetTimeMicros();
+            CCoinsWriteBatch* pbatch = new CCoinsWriteBatch();
+            pbatch->hashBlock = pcoinsTip->GetBestBlock();
+            pcoinsTip->TakeChanges(pbatch->mapCoins, (fCacheLarge || fCacheCritical) ? nCoinCacheUsage / 2 : std::numeric_limits<size_t>::max());
+            if (!pcoinsWriter->StartWrite(pbatch))
+                return AbortNode(state, "Failed to write to coin database");
+            if ((mode == FLUSH_STATE_ALWAYS || !fBackgroundFlush) && !pcoinsWriter->WaitForWrite())
+                return AbortNode(state, "Failed to write to coin database");
+            LogPrint("bench", "    - Flush coins: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
+        } else if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
     }
@@ -2966,6 +3903,7 @@ void PruneAndFlush() {
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex *pindexNew, const CChainParams& chainParams) {
     chainActive.SetTip(pindexNew);
+    pindexActiveTipView.store(pindexNew);
 
     // New best block
     nTimeBestReceived = GetTime();
@@ -3078,6 +4016,155 @@ bool static DisconnectTip(CValidationState& state, const CChainParams& chainpara
     return true;
 }
 
+/**
+ * Reads the blocks ActivateBestChainStep is about to connect ahead of time on
+ * its own thread, so that connecting a block does not wait for the disk and
+ * the disk is not idle while a block is validated. Blocks that were not read
+ * in time are read by ConnectTip as before.
+ */
+class CBlockPrefetcher
+{
+private:
+    struct CItem {
+        const CBlockIndex* pindex;
+        CDiskBlockPos pos;
+        std::shared_ptr<CBlock> pblock;
+        unsigned int nSize;
+        bool fFailed;
+
+        CItem(const CBlockIndex* pindexIn, const CDiskBlockPos& posIn) : pindex(pindexIn), pos(posIn), nSize(0), fFailed(false) {}
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    //! blocks in the order they are going to be connected
+    std::deque<CItem> queue;
+    //! serialized size of the blocks read and not taken yet
+    size_t nSize;
+    //! block the thread is reading, if any
+    const CBlockIndex* pindexReading;
+    //! number of blocks to read ahead, 0 while the thread is not running
+    unsigned int nMaxBlocks;
+
+public:
+    CBlockPrefetcher() : nSize(0), pindexReading(NULL), nMaxBlocks(0) {}
+
+    /** Replace the blocks to read ahead, given in the order they are going to be connected */
+    void Request(const std::vector<std::pair<const CBlockIndex*, CDiskBlockPos> >& vBlocks)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nMaxBlocks == 0)
+            return;
+        std::deque<CItem> queueNew;
+        for (size_t i = 0; i < vBlocks.size() && i < nMaxBlocks; i++) {
+            // Keep blocks that were already read
+            std::deque<CItem>::iterator it = queue.begin();
+            while (it != queue.end() && it->pindex != vBlocks[i].first)
+                it++;
+            queueNew.push_back(it != queue.end() ? *it : CItem(vBlocks[i].first, vBlocks[i].second));
+        }
+        queue.swap(queueNew);
+        nSize = 0;
+        for (std::deque<CItem>::const_iterator it = queue.begin(); it != queue.end(); it++)
+            nSize += it->nSize;
+        cond.notify_all();
+    }
+
+    /** Take the block of pindex if it was read ahead, waiting for it if it is being read */
+    bool Take(const CBlockIndex* pindex, CBlock& block)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (true) {
+            std::deque<CItem>::iterator it = queue.begin();
+            while (it != queue.end() && it->pindex != pindex)
+                it++;
+            if (it == queue.end())
+                return false;
+            if (!it->pblock && !it->fFailed && pindexReading == pindex) {
+                cond.wait(lock);
+                continue;
+            }
+
+            // Blocks in front of it are not going to be connected anymore
+            bool fRead = it->pblock != NULL;
+            if (fRead)
+                block = std::move(*it->pblock);
+            queue.erase(queue.begin(), it + 1);
+            nSize = 0;
+            for (std::deque<CItem>::const_iterator itSize = queue.begin(); itSize != queue.end(); itSize++)
+                nSize += itSize->nSize;
+            cond.notify_all();
+            return fRead;
+        }
+    }
+
+    void Thread(unsigned int nMaxBlocksIn)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nMaxBlocks = nMaxBlocksIn;
+        }
+        try {
+            const Consensus::Params& consensusParams = Params().GetConsensus();
+            while (true) {
+                const CBlockIndex* pindex = NULL;
+                CDiskBlockPos pos;
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    while (pindex == NULL) {
+                        if (nSize < MAX_BLOCK_PREFETCH_SIZE) {
+                            for (std::deque<CItem>::const_iterator it = queue.begin(); it != queue.end(); it++) {
+                                if (!it->pblock && !it->fFailed) {
+                                    pindex = it->pindex;
+                                    pos = it->pos;
+                                    break;
+                                }
+                            }
+                        }
+                        if (pindex == NULL)
+                            cond.wait(lock);
+                    }
+                    pindexReading = pindex;
+                }
+
+                std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+                bool fOk = ReadBlockFromDisk(*pblock, pos, consensusParams) && pblock->GetHash() == pindex->GetBlockHash();
+
+                boost::unique_lock<boost::mutex> lock(mutex);
+                pindexReading = NULL;
+                for (std::deque<CItem>::iterator it = queue.begin(); it != queue.end(); it++) {
+                    if (it->pindex != pindex)
+                        continue;
+                    if (fOk) {
+                        it->pblock = pblock;
+                        it->nSize = ::GetSerializeSize(*pblock, SER_DISK, CLIENT_VERSION);
+                        nSize += it->nSize;
+                    } else {
+                        it->fFailed = true;
+                    }
+                    break;
+                }
+                cond.notify_all();
+            }
+        } catch (const boost::thread_interrupted&) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nMaxBlocks = 0;
+            queue.clear();
+            nSize = 0;
+            pindexReading = NULL;
+            cond.notify_all();
+            throw;
+        }
+    }
+};
+
+static CBlockPrefetcher blockprefetcher;
+
+void ThreadBlockPrefetch(unsigned int nBlocks)
+{
+    blockprefetcher.Thread(nBlocks);
+}
+
 static int64_t nTimeReadFromDisk = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
@@ -3095,7 +4182,7 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     int64_t nTime1 = GetTimeMicros();
     CBlock block;
     if (!pblock) {
-        if (!ReadBlockFromDisk(block, pindexNew, chainparams.GetConsensus()))
+        if (!blockprefetcher.Take(pindexNew, block) && !ReadBlockFromDisk(block, pindexNew, chainparams.GetConsensus()))
             return AbortNode(state, "Failed to read block");
         pblock = &block;
     }
@@ -3104,6 +4191,7 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     int64_t nTime3;
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
     {
+        PrefetchInputs(*pblock);
         CCoinsViewCache view(pcoinsTip);
         bool rv = ConnectBlock(*pblock, state, pindexNew, view, chainparams);
         GetMainSignals().BlockChecked(*pblock, state);
@@ -3250,6 +4338,14 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
         }
         nHeight = nTargetHeight;
 
+        // Have the blocks read ahead that are not in memory already
+        std::vector<std::pair<const CBlockIndex*, CDiskBlockPos> > vPrefetch;
+        BOOST_REVERSE_FOREACH(CBlockIndex *pindexConnect, vpindexToConnect) {
+            if ((pindexConnect != pindexMostWork || !pblock) && (pindexConnect->nStatus & BLOCK_HAVE_DATA))
+                vPrefetch.push_back(std::make_pair(pindexConnect, pindexConnect->GetBlockPos()));
+        }
+        blockprefetcher.Request(vPrefetch);
+
         // Connect new blocks.
         BOOST_REVERSE_FOREACH(CBlockIndex *pindexConnect, vpindexToConnect) {
             if (!ConnectTip(state, chainparams, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL)) {
@@ -3509,9 +4605,10 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
 }
 
 /** Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS). */
-bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBlockIndex *pindexNew, const CDiskBlockPos& pos)
+/** Mark the data of a block with nTx transactions as stored at pos */
+static bool ReceivedBlockTransactions(unsigned int nTx, CValidationState& state, CBlockIndex *pindexNew, const CDiskBlockPos& pos)
 {
-    pindexNew->nTx = block.vtx.size();
+    pindexNew->nTx = nTx;
     pindexNew->nChainTx = 0;
     pindexNew->nFile = pos.nFile;
     pindexNew->nDataPos = pos.nPos;
@@ -3557,6 +4654,11 @@ bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBl
     return true;
 }
 
+bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBlockIndex *pindexNew, const CDiskBlockPos& pos)
+{
+    return ReceivedBlockTransactions(block.vtx.size(), state, pindexNew, pos);
+}
+
 bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAddSize, unsigned int nHeight, uint64_t nTime, bool fKnown = false)
 {
     LOCK(cs_LastBlockFile);
@@ -3939,7 +5041,7 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL, bool fCheckPOW=true)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -3958,7 +5060,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return true;
         }
 
-        if (!CheckBlockHeader(block, state, chainparams.GetConsensus()))
+        if (!CheckBlockHeader(block, state, chainparams.GetConsensus(), fCheckPOW))
             return error("%s: Consensus::CheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
 
         // Get prev block index
@@ -4171,6 +5273,7 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
     for (set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        blockFileMap.Unmap(*it);
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -4391,6 +5494,12 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("addressindex", fAddressIndex);
     LogPrintf("%s: address index %s\n", __func__, fAddressIndex ? "enabled" : "disabled");
 
+    // Address summaries are only usable if they were maintained since the index was created
+    fAddressSummaryIndex = false;
+    pblocktree->ReadFlag("addresssummaryindex", fAddressSummaryIndex);
+    if (fAddressIndex)
+        LogPrintf("%s: address summary index %s\n", __func__, fAddressSummaryIndex ? "enabled" : "disabled");
+
     // Check whether we have a timestamp index
     pblocktree->ReadFlag("timestampindex", fTimestampIndex);
     LogPrintf("%s: timestamp index %s\n", __func__, fTimestampIndex ? "enabled" : "disabled");
@@ -4401,9 +5510,12 @@ bool static LoadBlockIndexDB()
 
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
+    if (!LoadIndexBestBlocks(it == mapBlockIndex.end() ? NULL : it->second))
+        return false;
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    pindexActiveTipView.store(it->second);
 
     PruneBlockIndexCandidates();
 
@@ -4607,6 +5719,7 @@ void UnloadBlockIndex()
     LOCK(cs_main);
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
+    pindexActiveTipView.store(NULL);
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
     mempool.clear();
@@ -4614,8 +5727,10 @@ void UnloadBlockIndex()
     mapOrphanTransactionsByPrev.clear();
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
+    setBlockIndexFromHeaders.clear();
     vinfoBlockFile.clear();
     nLastBlockFile = 0;
+    blockFileMap.Clear();
     nBlockSequenceId = 1;
     mapBlockSource.clear();
     mapBlocksInFlight.clear();
@@ -4634,6 +5749,8 @@ void UnloadBlockIndex()
     }
     mapBlockIndex.clear();
     fHavePruned = false;
+    for (int i = 0; i < OPTIONAL_INDEX_COUNT; i++)
+        pindexIndexBest[i] = NULL;
 }
 
 bool LoadBlockIndex()
@@ -4665,6 +5782,10 @@ bool InitBlockIndex(const CChainParams& chainparams)
     pblocktree->WriteFlag("addressindex", fAddressIndex);
     LogPrintf("%s: address index %s\n", __func__, fAddressIndex ? "enabled" : "disabled");
 
+    // A new address index always maintains the per-address summary records
+    fAddressSummaryIndex = fAddressIndex;
+    pblocktree->WriteFlag("addresssummaryindex", fAddressSummaryIndex);
+
     // Use the provided setting for -timestampindex in the new database
     fTimestampIndex = GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX);
     pblocktree->WriteFlag("timestampindex", fTimestampIndex);
@@ -4674,6 +5795,13 @@ bool InitBlockIndex(const CChainParams& chainparams)
     pblocktree->WriteFlag("spentindex", fSpentIndex);
     LogPrintf("%s: spent index %s\n", __func__, fSpentIndex ? "enabled" : "disabled");
 
+    // The optional indexes of a new database start out empty and follow the chain from genesis.
+    // A crash before the first flush of the chain state also gets here, with indexes that have
+    // a position and rows already, which are kept.
+    for (int i = 0; i < OPTIONAL_INDEX_COUNT; i++)
+        if (IsOptionalIndexEnabled((OptionalIndex)i) && pindexIndexBest[i] == NULL && !InitOptionalIndex((OptionalIndex)i))
+            return false;
+
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -4816,6 +5944,223 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
     return nLoaded > 0;
 }
 
+/** A block found by the -reindex scan, from its header */
+struct CReindexBlock
+{
+    CBlockHeader header;
+    uint256 hash;
+    unsigned int nSize;
+    unsigned int nTx;
+    CDiskBlockPos pos;
+};
+
+/** The blocks found in one block file by the -reindex scan, in the order they are stored */
+struct CReindexFile
+{
+    int nFile;
+    std::vector<CReindexBlock> vBlocks;
+};
+
+/**
+ * Find the blocks in a block file, reading their headers and transaction counts
+ * only and seeking over the transactions. The proof of work of the headers is
+ * checked here, while the files are scanned in parallel.
+ */
+static void ScanBlockFile(const CChainParams& chainparams, CReindexFile& file)
+{
+    CDiskBlockPos pos(file.nFile, 0);
+    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return; // This error is logged in OpenBlockFile
+
+    try {
+        if (fseek(filein.Get(), 0, SEEK_END))
+            throw std::runtime_error("ScanBlockFile(): seek failed");
+        long nFileSize = ftell(filein.Get());
+        long nRewind = 0;
+        while (nRewind < nFileSize) {
+            boost::this_thread::interruption_point();
+
+            if (fseek(filein.Get(), nRewind, SEEK_SET))
+                throw std::runtime_error("ScanBlockFile(): seek failed");
+            long nPos = nRewind;
+            nRewind++; // start one byte further next time, in case of failure
+            unsigned int nSize = 0;
+            try {
+                // locate a header
+                unsigned char buf[MESSAGE_START_SIZE];
+                filein >> FLATDATA(buf);
+                nPos += MESSAGE_START_SIZE;
+                while (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE)) {
+                    memmove(buf, buf + 1, MESSAGE_START_SIZE - 1);
+                    filein >> buf[MESSAGE_START_SIZE - 1];
+                    nPos++;
+                }
+                nRewind = nPos - MESSAGE_START_SIZE + 1;
+                // read size
+                filein >> nSize;
+                nPos += sizeof(nSize);
+                if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE || nPos + nSize > nFileSize)
+                    continue;
+            } catch (const std::exception&) {
+                // no valid block header found; don't complain
+                break;
+            }
+            try {
+                // read the header and the number of transactions, which must all be in the file
+                CReindexBlock block;
+                filein >> block.header;
+                block.nTx = ReadCompactSize(filein);
+                block.hash = block.header.GetHash();
+                block.nSize = nSize;
+                block.pos = CDiskBlockPos(file.nFile, nPos);
+                if (block.hash != chainparams.GetConsensus().hashGenesisBlock &&
+                    !CheckProofOfWork(block.header.GetPoWHash(), block.header.nBits, chainparams.GetConsensus())) {
+                    LogPrintf("%s: block %s at %s has an invalid proof of work\n", __func__, block.hash.ToString(), block.pos.ToString());
+                    continue;
+                }
+                file.vBlocks.push_back(block);
+                nRewind = nPos + nSize;
+            } catch (const std::exception& e) {
+                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+            }
+        }
+    } catch (const std::runtime_error& e) {
+        AbortNode(std::string("System error: ") + e.what());
+    }
+}
+
+/** Scan the block files given out by *pnNext until none are left */
+static void ThreadScanBlockFiles(const CChainParams* chainparams, std::vector<CReindexFile>* pvFiles, std::atomic<size_t>* pnNext)
+{
+    while (true) {
+        size_t i = (*pnNext)++;
+        if (i >= pvFiles->size())
+            return;
+        ScanBlockFile(*chainparams, (*pvFiles)[i]);
+        LogPrint("reindex", "%s: found %u blocks in blk%05u.dat\n", __func__, (*pvFiles)[i].vBlocks.size(), (unsigned int)(*pvFiles)[i].nFile);
+    }
+}
+
+/**
+ * Store a block found by the -reindex scan in the block index from its header,
+ * unless it is already there. Its transactions are read and checked when it is
+ * connected. Returns false if the header is not accepted.
+ */
+static bool LoadReindexBlock(const CChainParams& chainparams, const CReindexBlock& block, int& nLoaded, bool& fError)
+{
+    bool fAccepted;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(block.hash);
+        if (mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            if (block.hash != chainparams.GetConsensus().hashGenesisBlock && mi->second->nHeight % 1000 == 0)
+                LogPrint("reindex", "Block Import: already had block %s at height %d\n", block.hash.ToString(), mi->second->nHeight);
+            return true;
+        }
+
+        // The proof of work was checked by the scan
+        CValidationState state;
+        CBlockIndex* pindex = NULL;
+        CDiskBlockPos blockPos = block.pos;
+        fAccepted = AcceptBlockHeader(block.header, state, chainparams, &pindex, false) &&
+                    FindBlockPos(state, blockPos, block.nSize + 8, pindex->nHeight, block.header.GetBlockTime(), true) &&
+                    ReceivedBlockTransactions(block.nTx, state, pindex, blockPos);
+        if (fAccepted) {
+            setBlockIndexFromHeaders.insert(pindex);
+            nLoaded++;
+        }
+        fError = state.IsError();
+    }
+
+    // Activate the genesis block so normal node progress can continue
+    if (fAccepted && block.hash == chainparams.GetConsensus().hashGenesisBlock) {
+        CValidationState state;
+        if (!ActivateBestChain(state, chainparams))
+            fError = true;
+    }
+
+    NotifyHeaderTip();
+    return fAccepted;
+}
+
+bool ReindexBlockFiles(const CChainParams& chainparams)
+{
+    int64_t nStart = GetTimeMillis();
+
+    std::vector<CReindexFile> vFiles;
+    while (boost::filesystem::exists(GetBlockPosFilename(CDiskBlockPos(vFiles.size(), 0), "blk"))) {
+        vFiles.push_back(CReindexFile());
+        vFiles.back().nFile = vFiles.size() - 1;
+    }
+
+    // Find the blocks in all files at once, from their headers only
+    int nThreads = std::max(1, std::min(nReindexThreads, (int)vFiles.size()));
+    LogPrintf("Scanning %u block files with %d threads...\n", vFiles.size(), nThreads);
+    std::atomic<size_t> nNext(0);
+    if (nThreads == 1) {
+        ThreadScanBlockFiles(&chainparams, &vFiles, &nNext);
+    } else {
+        boost::thread_group workers;
+        for (int i = 0; i < nThreads; i++)
+            workers.create_thread(boost::bind(&ThreadScanBlockFiles, &chainparams, &vFiles, &nNext));
+        try {
+            workers.join_all();
+        } catch (const boost::thread_interrupted&) {
+            // The workers use vFiles, so stop them before it goes away
+            workers.interrupt_all();
+            workers.join_all();
+            throw;
+        }
+    }
+
+    size_t nBlocks = 0;
+    for (std::vector<CReindexFile>::const_iterator it = vFiles.begin(); it != vFiles.end(); it++)
+        nBlocks += it->vBlocks.size();
+    LogPrintf("Found %u blocks in %u block files in %dms\n", nBlocks, vFiles.size(), GetTimeMillis() - nStart);
+
+    // Store the blocks in the order they were written, each child once its parent is stored
+    int nLoaded = 0;
+    bool fError = false;
+    std::multimap<uint256, const CReindexBlock*> mapBlocksUnknownParent;
+    for (std::vector<CReindexFile>::const_iterator file = vFiles.begin(); file != vFiles.end() && !fError; file++) {
+        LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)file->nFile);
+        for (std::vector<CReindexBlock>::const_iterator it = file->vBlocks.begin(); it != file->vBlocks.end() && !fError; it++) {
+            boost::this_thread::interruption_point();
+
+            if (it->hash != chainparams.GetConsensus().hashGenesisBlock) {
+                LOCK(cs_main);
+                if (mapBlockIndex.find(it->header.hashPrevBlock) == mapBlockIndex.end()) {
+                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, it->hash.ToString(),
+                            it->header.hashPrevBlock.ToString());
+                    mapBlocksUnknownParent.insert(std::make_pair(it->header.hashPrevBlock, &*it));
+                    continue;
+                }
+            }
+
+            // Process the block and the successors of it encountered earlier
+            std::deque<const CReindexBlock*> queue;
+            queue.push_back(&*it);
+            while (!queue.empty() && !fError) {
+                const CReindexBlock* pblock = queue.front();
+                queue.pop_front();
+                if (!LoadReindexBlock(chainparams, *pblock, nLoaded, fError))
+                    continue;
+                std::pair<std::multimap<uint256, const CReindexBlock*>::iterator, std::multimap<uint256, const CReindexBlock*>::iterator> range = mapBlocksUnknownParent.equal_range(pblock->hash);
+                for (std::multimap<uint256, const CReindexBlock*>::iterator itChild = range.first; itChild != range.second; itChild++) {
+                    LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__, itChild->second->hash.ToString(),
+                            pblock->hash.ToString());
+                    queue.push_back(itChild->second);
+                }
+                mapBlocksUnknownParent.erase(range.first, range.second);
+            }
+        }
+    }
+
+    LogPrintf("Loaded %i blocks from %u block files in %dms\n", nLoaded, vFiles.size(), GetTimeMillis() - nStart);
+    return !fError;
+}
+
 void static CheckBlockIndex(const Consensus::Params& consensusParams)
 {
     if (!fCheckBlockIndex) {
@@ -5142,14 +6487,18 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 // it's available before trying to send.
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
-                    // Send block from disk
+                    // Send block from disk, as stored if the peer wants all of it
                     CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
+                    std::vector<unsigned char> vchBlock;
+                    if (inv.type == MSG_WITNESS_BLOCK) {
+                        if (!ReadRawBlockFromDisk(vchBlock, (*mi).second, Params().MessageStart()))
+                            assert(!"cannot load block from disk");
+                    } else if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
                         assert(!"cannot load block from disk");
                     if (inv.type == MSG_BLOCK)
                         pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
                     else if (inv.type == MSG_WITNESS_BLOCK)
-                        pfrom->PushMessage(NetMsgType::BLOCK, block);
+                        pfrom->PushMessage(NetMsgType::BLOCK, CFlatData(vchBlock));
                     else if (inv.type == MSG_FILTERED_BLOCK)
                     {
                         bool send = false;
@@ -32,10 +32,13 @@
 
 #include <boost/unordered_map.hpp>
 
+class CAddressIndexMergeCursor;
 class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
 class CChainParams;
+class CDBSnapshot;
+class CCoinsViewDBWriter;
 class CInv;
 class CScriptCheck;
 class CTxMemPool;
@@ -85,6 +88,26 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Default for -blockprefetch, the number of blocks read ahead of the one being connected */
+static const unsigned int DEFAULT_BLOCK_PREFETCH = 16;
+/** Maximum for -blockprefetch */
+static const unsigned int MAX_BLOCK_PREFETCH = 32;
+/** Serialized size of the blocks read ahead above which no further blocks are read */
+static const size_t MAX_BLOCK_PREFETCH_SIZE = 32 * 1024 * 1024;
+/** Maximum number of threads reading blocks to build the optional indexes */
+static const int MAX_INDEX_BUILD_THREADS = 32;
+/** -indexbuildthreads default (number of index building threads, 0 = auto) */
+static const int DEFAULT_INDEX_BUILD_THREADS = 0;
+/** Maximum number of threads scanning block files during -reindex */
+static const int MAX_REINDEX_THREADS = 16;
+/** -reindexthreads default (number of block file scanning threads, 0 = auto) */
+static const int DEFAULT_REINDEX_THREADS = 0;
+/** Maximum number of threads reading the coins spent by a block before it is connected */
+static const int MAX_COINS_FETCH_THREADS = 16;
+/** -coinsfetchthreads default (number of coins reading threads, 0 or 1 = read them while connecting) */
+static const int DEFAULT_COINS_FETCH_THREADS = 4;
+/** Default for -backgroundflush, writing flushed coins without holding cs_main */
+static const bool DEFAULT_BACKGROUND_FLUSH = true;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -175,8 +198,16 @@ extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern int nIndexBuildThreads;
+extern int nReindexThreads;
+extern int nCoinsFetchThreads;
+extern bool fBackgroundFlush;
 extern bool fTxIndex;
+/** Whether to read blocks and undo data of finished block files through read-only mappings */
+extern bool fMmapBlocks;
 extern bool fAddressIndex;
+/** True if the address index also maintains per-address summary records */
+extern bool fAddressSummaryIndex;
 extern bool fSpentIndex;
 extern bool fTimestampIndex;
 extern bool fIsBareMultisigStd;
@@ -249,6 +280,8 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Rebuild the block index from the block files (blk?????.dat) for -reindex */
+bool ReindexBlockFiles(const CChainParams& chainparams);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex(const CChainParams& chainparams);
 /** Load the block tree and coins database from disk */
@@ -265,6 +298,8 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the thread reading the coins spent by a block ahead of connecting it */
+void ThreadCoinsFetch();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core.
@@ -447,19 +482,91 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
-bool GetTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes);
+bool GetTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes,
+                       unsigned int limit = 0, bool fReverse = false);
 bool GetSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
-bool HashOnchainActive(const uint256 &hash);
+/** Resolve the spends of many outputs at once, values[i] is null if keys[i] is unspent */
+bool GetSpentIndexes(const std::vector<CSpentIndexKey> &keys, std::vector<CSpentIndexValue> &values);
+/**
+ * The tip of the active chain as last published, for readers that do not hold
+ * cs_main. Block index entries are never freed while the node runs and their
+ * ancestors never change, so the returned entry stays safe to walk.
+ */
+const CBlockIndex* GetActiveTipView();
+/** Whether the block with the given hash and height is on the chain ending in pindexTip */
+bool IsInChainView(const CBlockIndex* pindexTip, const uint256 &hash, int nHeight);
 bool GetAddressIndex(uint160 addressHash, int type,
                      std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
-                     int start = 0, int end = 0);
+                     int start = 0, int end = 0, const CDBSnapshot *psnapshot = NULL);
+/**
+ * Return a cursor over the address index rows of all addresses in block order,
+ * behind the transaction pafter if given, or NULL if there is no address index
+ */
+CAddressIndexMergeCursor *GetAddressIndexCursor(const std::vector<std::pair<uint160, int> > &addresses,
+                                                int start = 0, int end = 0, const CAddressIndexPageKey *pafter = NULL);
+bool GetAddressSummary(uint160 addressHash, int type, CAddressSummaryValue &summary, const CDBSnapshot *psnapshot = NULL);
 bool GetAddressUnspent(uint160 addressHash, int type,
-                       std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs);
+                       std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs,
+                       const CAddressUnspentKey *pafter = NULL, unsigned int limit = 0,
+                       const CAddressUnspentFilter &filter = CAddressUnspentFilter(), const CDBSnapshot *psnapshot = NULL);
+/** Unspent outputs of an address ordered by value, largest first */
+bool GetAddressUnspentByValue(uint160 addressHash, int type,
+                              std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs,
+                              const CAddressUnspentValueKey *pafter = NULL, unsigned int limit = 0,
+                              const CAddressUnspentFilter &filter = CAddressUnspentFilter(), const CDBSnapshot *psnapshot = NULL);
+/** The address index rows of a block that touch the addresses of a watch set */
+bool GetAddressWatchMatches(const std::string &name, const uint256 &blockHash,
+                            std::vector<std::pair<CAddressIndexKey, CAmount> > &matches);
+
+/**
+ * Return the addresses the address and spent indexes file an output script under,
+ * as pairs of hash and type (1 for key hashes, 2 for script hashes, 3 and 4 for the
+ * key and witness script hashes of P2WPKH and P2WSH outputs). Besides P2PKH and
+ * P2SH outputs these are the keys of P2PK and bare multisig outputs. A bare multisig output
+ * is filed with its full value under each of its keys, so it counts towards the
+ * balance of every one of them.
+ */
+void GetScriptIndexAddresses(const CScript &script, std::vector<std::pair<uint160, int> > &addresses);
+
+/** Optional indexes that can be built in the background after they are enabled */
+enum OptionalIndex {
+    OPTIONAL_INDEX_ADDRESS,
+    OPTIONAL_INDEX_SPENT,
+    OPTIONAL_INDEX_TIMESTAMP,
+    OPTIONAL_INDEX_COUNT
+};
+
+const char *GetOptionalIndexName(OptionalIndex index);
+bool IsOptionalIndexEnabled(OptionalIndex index);
+/** Enable an optional index on an existing database, it is built by ThreadBuildIndexes */
+bool EnableOptionalIndex(OptionalIndex index);
+/**
+ * Return whether an enabled optional index covers the whole active chain, and the
+ * height up to which it does in nHeight (-1 if it has not indexed any block yet).
+ */
+bool GetIndexSyncState(OptionalIndex index, int &nHeight);
+/**
+ * A consistent view of the database of an enabled optional index, or NULL.
+ * Queries that read an index several times pass it to every read.
+ */
+CDBSnapshot *GetIndexSnapshot(OptionalIndex index);
+/** Write the coin cache flushes handed to pcoinsWriter, aborting the node if a write fails */
+void ThreadWriteCoins();
+/** Build the optional indexes up to the active chain tip, then exit */
+void ThreadBuildIndexes();
+/** Run the thread that reads up to nBlocks blocks ahead of ConnectTip */
+void ThreadBlockPrefetch(unsigned int nBlocks);
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/**
+ * Read the block of pindex exactly as it is stored, including witness data,
+ * for sending it on without decoding its transactions. Only the hash of its
+ * header is checked against the index.
+ */
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vchBlock, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -523,6 +630,9 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the writer of flushed coins, between pcoinsTip and the coin database (protected by cs_main) */
+extern CCoinsViewDBWriter *pcoinsWriter;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
@@ -6,6 +6,7 @@
 #define BITCOIN_MEMUSAGE_H
 
 #include "indirectmap.h"
+#include "support/allocators/pool.h"
 
 #include <stdlib.h>
 
@@ -167,6 +168,16 @@ static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z>& m)
     return MallocUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
 }
 
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z, std::equal_to<X>, pool_allocator<std::pair<const X, Y> > >& m)
+{
+    // Count the nodes in use: the blocks of removed ones are only taken again by new nodes.
+    // Nodes too large for the pool come from the heap.
+    const CPoolResource* resource = m.get_allocator().resource;
+    return resource->UsedBytes() + MallocUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >)) * resource->NumHeapBlocks() +
+           MallocUsage(sizeof(void*) * m.bucket_count());
+}
+
 }
 
 #endif // BITCOIN_MEMUSAGE_H
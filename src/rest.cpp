@@ -214,6 +214,7 @@ static bool rest_block(HTTPRequest* req,
         return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
     CBlock block;
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
     CBlockIndex* pblockindex = NULL;
     {
         LOCK(cs_main);
@@ -224,13 +225,20 @@ static bool rest_block(HTTPRequest* req,
         if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not available (pruned data)");
 
-        if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
-            return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
+        // Binary and hex output is the block as stored, unless witness data has to be left out
+        if (rf != RF_JSON && RPCSerializationFlags() == 0) {
+            std::vector<unsigned char> vchBlock;
+            if (!ReadRawBlockFromDisk(vchBlock, pblockindex, Params().MessageStart()))
+                return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
+            ssBlock.write((const char*)vchBlock.data(), vchBlock.size());
+        } else {
+            if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
+                return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
+            if (rf != RF_JSON)
+                ssBlock << block;
+        }
     }
 
-    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
-    ssBlock << block;
-
     switch (rf) {
     case RF_BINARY: {
         string binaryBlock = ssBlock.str();
@@ -526,7 +534,7 @@ static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
                     CCoin coin;
                     coin.nTxVer = coins.nVersion;
                     coin.nHeight = coins.nHeight;
-                    coin.out = coins.vout.at(vOutPoints[i].n);
+                    coin.out = coins.vout[vOutPoints[i].n];
                     assert(!coin.out.IsNull());
                     outs.push_back(coin);
                 }
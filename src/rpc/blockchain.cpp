@@ -20,6 +20,7 @@
 #include "script/standard.h"
 #include "streams.h"
 #include "sync.h"
+#include "txcache.h"
 #include "txmempool.h"
 #include "util.h"
 #include "utilstrencodings.h"
@@ -36,6 +37,14 @@ using namespace std;
 extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry);
 void ScriptPubKeyToJSON(const CScript& scriptPubKey, UniValue& out, bool fIncludeHex);
 
+/** Throw unless an optional index covers the whole active chain */
+void EnsureIndexSynced(OptionalIndex index)
+{
+    int nHeight;
+    if (IsOptionalIndexEnabled(index) && !GetIndexSyncState(index, nHeight))
+        throw JSONRPCError(RPC_IN_WARMUP, strprintf("The %s index is syncing, it is at height %d", GetOptionalIndexName(index), nHeight));
+}
+
 double GetDifficulty(const CBlockIndex* blockindex)
 {
     // Floating point number that is a multiple of the minimum difficulty,
@@ -135,10 +144,9 @@ UniValue blockToDeltasJSON(const CBlock& block, const CBlockIndex* blockindex)
                 CSpentIndexKey spentKey(input.prevout.hash, input.prevout.n);
 
                 if (GetSpentIndex(spentKey, spentInfo)) {
-                    if (spentInfo.addressType == 1) {
-                        delta.push_back(Pair("address", CBitcoinAddress(CKeyID(spentInfo.addressHash)).ToString()));
-                    } else if (spentInfo.addressType == 2)  {
-                        delta.push_back(Pair("address", CBitcoinAddress(CScriptID(spentInfo.addressHash)).ToString()));
+                    CBitcoinAddress address;
+                    if (address.SetIndexKey(spentInfo.addressHash, spentInfo.addressType)) {
+                        delta.push_back(Pair("address", address.ToString()));
                     } else {
                         continue;
                     }
@@ -162,23 +170,21 @@ UniValue blockToDeltasJSON(const CBlock& block, const CBlockIndex* blockindex)
         for (unsigned int k = 0; k < tx.vout.size(); k++) {
             const CTxOut &out = tx.vout[k];
 
-            UniValue delta(UniValue::VOBJ);
+            std::vector<std::pair<uint160, int> > addresses;
+            GetScriptIndexAddresses(out.scriptPubKey, addresses);
 
-            if (out.scriptPubKey.IsPayToScriptHash()) {
-                vector<unsigned char> hashBytes(out.scriptPubKey.begin()+2, out.scriptPubKey.begin()+22);
-                delta.push_back(Pair("address", CBitcoinAddress(CScriptID(uint160(hashBytes))).ToString()));
+            for (std::vector<std::pair<uint160, int> >::const_iterator it = addresses.begin(); it != addresses.end(); it++) {
+                UniValue delta(UniValue::VOBJ);
 
-            } else if (out.scriptPubKey.IsPayToPublicKeyHash()) {
-                vector<unsigned char> hashBytes(out.scriptPubKey.begin()+3, out.scriptPubKey.begin()+23);
-                delta.push_back(Pair("address", CBitcoinAddress(CKeyID(uint160(hashBytes))).ToString()));
-            } else {
-                continue;
-            }
+                CBitcoinAddress address;
+                address.SetIndexKey(it->first, it->second);
+                delta.push_back(Pair("address", address.ToString()));
 
-            delta.push_back(Pair("satoshis", out.nValue));
-            delta.push_back(Pair("index", (int)k));
+                delta.push_back(Pair("satoshis", out.nValue));
+                delta.push_back(Pair("index", (int)k));
 
-            outputs.push_back(delta);
+                outputs.push_back(delta);
+            }
         }
 
         entry.push_back(Pair("outputs", outputs));
@@ -606,6 +612,8 @@ UniValue getblockhashes(const UniValue& params, bool fHelp)
             "    {\n"
             "      \"noOrphans\":true   (boolean) will only include blocks on the main chain\n"
             "      \"logicalTimes\":true   (boolean) will include logical timestamps with hashes\n"
+            "      \"limit\":20   (numeric) return at most this many blocks, 0 for all\n"
+            "      \"descending\":true   (boolean) return the latest blocks first\n"
             "    }\n"
             "\nResult:\n"
             "[\n"
@@ -621,32 +629,45 @@ UniValue getblockhashes(const UniValue& params, bool fHelp)
             + HelpExampleCli("getblockhashes", "1231614698 1231024505")
             + HelpExampleRpc("getblockhashes", "1231614698, 1231024505")
             + HelpExampleCli("getblockhashes", "1231614698 1231024505 '{\"noOrphans\":false, \"logicalTimes\":true}'")
+            + HelpExampleCli("getblockhashes", "1231614698 0 '{\"limit\":20, \"descending\":true}'")
             );
 
     unsigned int high = params[0].get_int();
     unsigned int low = params[1].get_int();
     bool fActiveOnly = false;
     bool fLogicalTS = false;
+    unsigned int limit = 0;
+    bool fReverse = false;
 
     if (params.size() > 2) {
         if (params[2].isObject()) {
             UniValue noOrphans = find_value(params[2].get_obj(), "noOrphans");
             UniValue returnLogical = find_value(params[2].get_obj(), "logicalTimes");
+            UniValue limitValue = find_value(params[2].get_obj(), "limit");
+            UniValue descending = find_value(params[2].get_obj(), "descending");
 
             if (noOrphans.isBool())
                 fActiveOnly = noOrphans.get_bool();
 
             if (returnLogical.isBool())
                 fLogicalTS = returnLogical.get_bool();
+
+            if (limitValue.isNum()) {
+                if (limitValue.get_int() < 0)
+                    throw JSONRPCError(RPC_INVALID_PARAMETER, "Limit is expected to be positive");
+                limit = limitValue.get_int();
+            }
+
+            if (descending.isBool())
+                fReverse = descending.get_bool();
         }
     }
 
-    std::vector<std::pair<uint256, unsigned int> > blockHashes;
+    EnsureIndexSynced(OPTIONAL_INDEX_TIMESTAMP);
 
-    if (fActiveOnly)
-        LOCK(cs_main);
+    std::vector<std::pair<uint256, unsigned int> > blockHashes;
 
-    if (!GetTimestampIndex(high, low, fActiveOnly, blockHashes)) {
+    if (!GetTimestampIndex(high, low, fActiveOnly, blockHashes, limit, fReverse)) {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for block hashes");
     }
 
@@ -809,6 +830,15 @@ UniValue getblock(const UniValue& params, bool fHelp)
     if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
 
+    // Without witness stripping the hex is just the block as stored
+    if (!fVerbose && RPCSerializationFlags() == 0)
+    {
+        std::vector<unsigned char> vchBlock;
+        if (!ReadRawBlockFromDisk(vchBlock, pblockindex, Params().MessageStart()))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+        return HexStr(vchBlock.begin(), vchBlock.end());
+    }
+
     if(!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
@@ -1084,6 +1114,51 @@ void BIP9SoftForkDescPushBack(UniValue& bip9_softforks, const std::string &name,
         bip9_softforks.push_back(Pair(name, BIP9SoftForkDesc(consensusParams, id)));
 }
 
+UniValue getindexinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getindexinfo\n"
+            "\nReturns the state of the optional indexes.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"name\": {            (string) The name of the index: address, spent or timestamp\n"
+            "    \"enabled\": true|false,   (boolean) Whether the index is enabled\n"
+            "    \"synced\": true|false,    (boolean) Whether the index covers the whole active chain\n"
+            "    \"height\": xxxxx,         (numeric) The height up to which the index covers the active chain\n"
+            "    \"progress\": xxxxx,       (numeric) The fraction of the active chain covered by the index\n"
+            "  },\n"
+            "  ...\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getindexinfo", "")
+            + HelpExampleRpc("getindexinfo", "")
+        );
+
+    int nChainHeight;
+    {
+        LOCK(cs_main);
+        nChainHeight = chainActive.Height();
+    }
+
+    UniValue result(UniValue::VOBJ);
+    for (int i = 0; i < OPTIONAL_INDEX_COUNT; i++) {
+        OptionalIndex index = (OptionalIndex)i;
+        int nHeight = -1;
+        bool fSynced = GetIndexSyncState(index, nHeight);
+
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("enabled", IsOptionalIndexEnabled(index)));
+        obj.push_back(Pair("synced", fSynced));
+        if (IsOptionalIndexEnabled(index)) {
+            obj.push_back(Pair("height", nHeight));
+            obj.push_back(Pair("progress", fSynced || nChainHeight <= 0 ? 1.0 : std::max(nHeight, 0) / (double)nChainHeight));
+        }
+        result.push_back(Pair(GetOptionalIndexName(index), obj));
+    }
+    return result;
+}
+
 UniValue getblockchaininfo(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -1318,6 +1393,45 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+UniValue gettxlookupcacheinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "gettxlookupcacheinfo\n"
+            "\nReturns details on the cache of transactions read through the transaction index.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"size\": xxxxx,               (numeric) Current tx count\n"
+            "  \"usage\": xxxxx,              (numeric) Total memory usage for the cache\n"
+            "  \"maxusage\": xxxxx,           (numeric) Maximum memory usage for the cache\n"
+            "  \"hits\": xxxxx,               (numeric) Lookups answered from the cache\n"
+            "  \"misses\": xxxxx,             (numeric) Lookups that went to the transaction index\n"
+            "  \"idlefiles\": xxxxx,          (numeric) Block files kept open between lookups\n"
+            "  \"filesreused\": xxxxx,        (numeric) Lookups that read through a block file kept open\n"
+            "  \"filesopened\": xxxxx         (numeric) Lookups that had to open a block file\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("gettxlookupcacheinfo", "")
+            + HelpExampleRpc("gettxlookupcacheinfo", "")
+        );
+
+    size_t nEntries, nUsage, nMaxUsage, nIdleFiles;
+    uint64_t nHits, nMisses, nReused, nOpened;
+    txLookupCache.GetStats(nEntries, nUsage, nMaxUsage, nHits, nMisses);
+    blockFileReadPool.GetStats(nIdleFiles, nReused, nOpened);
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("size", (int64_t) nEntries));
+    ret.push_back(Pair("usage", (int64_t) nUsage));
+    ret.push_back(Pair("maxusage", (int64_t) nMaxUsage));
+    ret.push_back(Pair("hits", (int64_t) nHits));
+    ret.push_back(Pair("misses", (int64_t) nMisses));
+    ret.push_back(Pair("idlefiles", (int64_t) nIdleFiles));
+    ret.push_back(Pair("filesreused", (int64_t) nReused));
+    ret.push_back(Pair("filesopened", (int64_t) nOpened));
+    return ret;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -1406,11 +1520,13 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getblockheader",         &getblockheader,         true  },
     { "blockchain",         "getchaintips",           &getchaintips,           true  },
     { "blockchain",         "getdifficulty",          &getdifficulty,          true  },
+    { "blockchain",         "getindexinfo",           &getindexinfo,           true  },
     { "blockchain",         "getmempoolancestors",    &getmempoolancestors,    true  },
     { "blockchain",         "getmempooldescendants",  &getmempooldescendants,  true  },
     { "blockchain",         "getmempoolentry",        &getmempoolentry,        true  },
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true  },
     { "blockchain",         "getrawmempool",          &getrawmempool,          true  },
+    { "blockchain",         "gettxlookupcacheinfo",   &gettxlookupcacheinfo,   true  },
     { "blockchain",         "gettxout",               &gettxout,               true  },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true  },
     { "blockchain",         "verifychain",            &verifychain,            true  },
@@ -110,9 +110,14 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "getspentinfo", 0},
     { "getaddresstxids", 0},
     { "getaddressbalance", 0},
+    { "getaddresssummary", 0},
     { "getaddressdeltas", 0},
     { "getaddressutxos", 0},
     { "getaddressmempool", 0},
+    { "getaddressmempoolupdates", 0},
+    { "addwatchaddresses", 0},
+    { "removewatchaddresses", 0},
+    { "getwatchsetmatches", 0},
 };
 
 class CRPCConvertTable
@@ -3,6 +3,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "addresswatch.h"
 #include "base58.h"
 #include "clientversion.h"
 #include "init.h"
@@ -11,6 +12,7 @@
 #include "netbase.h"
 #include "rpc/server.h"
 #include "timedata.h"
+#include "txdb.h"
 #include "txmempool.h"
 #include "util.h"
 #include "utilstrencodings.h"
@@ -22,11 +24,14 @@
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #include <univalue.h>
 
 using namespace std;
 
+void EnsureIndexSynced(OptionalIndex index);
+
 /**
  * @note Do not add or change anything in the information returned by this
  * method. `getinfo` exists for backwards-compatibility only. It combines
@@ -450,13 +455,11 @@ UniValue setmocktime(const UniValue& params, bool fHelp)
 
 bool getAddressFromIndex(const int &type, const uint160 &hash, std::string &address)
 {
-    if (type == 2) {
-        address = CBitcoinAddress(CScriptID(hash)).ToString();
-    } else if (type == 1) {
-        address = CBitcoinAddress(CKeyID(hash)).ToString();
-    } else {
+    CBitcoinAddress indexAddress;
+    if (!indexAddress.SetIndexKey(hash, type)) {
         return false;
     }
+    address = indexAddress.ToString();
     return true;
 }
 
@@ -496,11 +499,214 @@ bool getAddressesFromParams(const UniValue& params, std::vector<std::pair<uint16
     return true;
 }
 
+bool getPageFromParams(const UniValue& params, unsigned int &limit, std::string &cursor)
+{
+    if (!params[0].isObject()) {
+        return false;
+    }
+
+    UniValue limitValue = find_value(params[0].get_obj(), "limit");
+    UniValue cursorValue = find_value(params[0].get_obj(), "cursor");
+
+    if (limitValue.isNull()) {
+        if (!cursorValue.isNull()) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Cursor is only valid together with limit");
+        }
+        return false;
+    }
+
+    if (!limitValue.isNum() || limitValue.get_int() <= 0) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Limit is expected to be greater than zero");
+    }
+    limit = limitValue.get_int();
+
+    if (cursorValue.isStr()) {
+        cursor = cursorValue.get_str();
+    } else if (!cursorValue.isNull()) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Cursor is expected to be a string");
+    }
+
+    return true;
+}
+
+template <typename K>
+std::string encodeIndexCursor(const K &key)
+{
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << key;
+    return HexStr(ssKey.begin(), ssKey.end());
+}
+
+template <typename K>
+void decodeIndexCursor(const std::string &cursor, K &key)
+{
+    std::vector<unsigned char> data(ParseHex(cursor));
+    if (!IsHex(cursor) || data.size() != key.GetSerializeSize(SER_DISK, CLIENT_VERSION)) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+    }
+    CDataStream ssKey(data, SER_DISK, CLIENT_VERSION);
+    ssKey >> key;
+}
+
+bool addressKeySort(std::pair<uint160, int> a,
+                    std::pair<uint160, int> b) {
+    // Same order as the address part of the index keys in the database
+    if (a.second != b.second) {
+        return a.second < b.second;
+    }
+    return a.first < b.first;
+}
+
+/**
+ * Read one page of address index rows for several addresses, merged into block
+ * order. A page ends with the first transaction that brings it to limit rows, so
+ * the rows of a transaction are never split across pages. Returns whether rows
+ * follow the page, which then resumes behind the transaction of its last row.
+ */
+bool getAddressIndexPage(std::vector<std::pair<uint160, int> > addresses, int start, int end,
+                         const CAddressIndexPageKey *pafter, unsigned int limit,
+                         std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex)
+{
+    std::sort(addresses.begin(), addresses.end(), addressKeySort);
+    addresses.erase(std::unique(addresses.begin(), addresses.end()), addresses.end());
+
+    boost::scoped_ptr<CAddressIndexMergeCursor> pcursor(GetAddressIndexCursor(addresses, start, end, pafter));
+    if (!pcursor) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    }
+    for (; pcursor->Valid(); pcursor->Next()) {
+        const CAddressIndexKey &key = pcursor->GetKey();
+        if (addressIndex.size() >= limit &&
+            (key.blockHeight != addressIndex.back().first.blockHeight || key.txindex != addressIndex.back().first.txindex)) {
+            return true;
+        }
+        addressIndex.push_back(std::make_pair(key, pcursor->GetValue()));
+    }
+    if (pcursor->Failed()) {
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read address index");
+    }
+    return false;
+}
+
+std::string encodeAddressIndexPageCursor(const CAddressIndexKey &key)
+{
+    return encodeIndexCursor(CAddressIndexPageKey(key.blockHeight, key.txindex, key.txhash));
+}
+
 bool heightSort(std::pair<CAddressUnspentKey, CAddressUnspentValue> a,
                 std::pair<CAddressUnspentKey, CAddressUnspentValue> b) {
     return a.second.blockHeight < b.second.blockHeight;
 }
 
+bool valueSort(const std::pair<CAddressUnspentKey, CAddressUnspentValue> &a,
+               const std::pair<CAddressUnspentKey, CAddressUnspentValue> &b) {
+    // Largest first, ties in the order of the value-ordered index
+    if (a.second.satoshis != b.second.satoshis) {
+        return a.second.satoshis > b.second.satoshis;
+    }
+    return CAddressUnspentKeyCompare()(a.first, b.first);
+}
+
+/** First height of the active chain whose median time past is at least nTime */
+int getHeightFromMedianTime(int64_t nTime)
+{
+    AssertLockHeld(cs_main);
+    // The median time past never decreases along a chain, so it can be bisected
+    int nLow = 0;
+    int nHigh = chainActive.Height() + 1;
+    while (nLow < nHigh) {
+        int nMid = nLow + (nHigh - nLow) / 2;
+        if (chainActive[nMid]->GetMedianTimePast() < nTime) {
+            nLow = nMid + 1;
+        } else {
+            nHigh = nMid;
+        }
+    }
+    return nLow;
+}
+
+void getUnspentFilterFromParams(const UniValue& params, CAddressUnspentFilter &filter)
+{
+    if (!params[0].isObject()) {
+        return;
+    }
+    const UniValue &options = params[0].get_obj();
+
+    UniValue orderValue = find_value(options, "order");
+    if (orderValue.isStr() && orderValue.get_str() == "value") {
+        filter.fByValue = true;
+    } else if (!orderValue.isNull() && !(orderValue.isStr() && orderValue.get_str() == "outpoint")) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Order is expected to be \"outpoint\" or \"value\"");
+    }
+
+    UniValue minValue = find_value(options, "minsatoshis");
+    if (minValue.isNum()) {
+        filter.nMinValue = minValue.get_int64();
+    }
+    UniValue targetValue = find_value(options, "target");
+    if (targetValue.isNum()) {
+        filter.nTargetValue = targetValue.get_int64();
+        if (filter.nTargetValue <= 0) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Target is expected to be greater than zero");
+        }
+    }
+
+    UniValue startValue = find_value(options, "start");
+    UniValue endValue = find_value(options, "end");
+    UniValue minConfValue = find_value(options, "minconf");
+    UniValue minTimeValue = find_value(options, "mintime");
+    UniValue maxTimeValue = find_value(options, "maxtime");
+
+    // nMaxHeight < 0 means no upper bound, so whether there is one is tracked separately
+    bool fMaxHeight = false;
+    if (startValue.isNum()) {
+        filter.nMinHeight = std::max(filter.nMinHeight, startValue.get_int());
+    }
+    if (endValue.isNum()) {
+        filter.nMaxHeight = endValue.get_int();
+        fMaxHeight = true;
+    }
+    if (minConfValue.isNum() || minTimeValue.isNum() || maxTimeValue.isNum()) {
+        LOCK(cs_main);
+        if (minConfValue.isNum() && minConfValue.get_int() > 0) {
+            int nMaxHeight = chainActive.Height() - minConfValue.get_int() + 1;
+            filter.nMaxHeight = fMaxHeight ? std::min(filter.nMaxHeight, nMaxHeight) : nMaxHeight;
+            fMaxHeight = true;
+        }
+        if (minTimeValue.isNum()) {
+            filter.nMinHeight = std::max(filter.nMinHeight, getHeightFromMedianTime(minTimeValue.get_int64()));
+        }
+        if (maxTimeValue.isNum()) {
+            int nMaxHeight = getHeightFromMedianTime(maxTimeValue.get_int64() + 1) - 1;
+            filter.nMaxHeight = fMaxHeight ? std::min(filter.nMaxHeight, nMaxHeight) : nMaxHeight;
+            fMaxHeight = true;
+        }
+    }
+    if (fMaxHeight && filter.nMaxHeight < 0) {
+        // Nothing is confirmed deep or early enough, which is not the same as no upper bound
+        filter.nMaxHeight = 0;
+        filter.nMinHeight = 1;
+    }
+}
+
+/** Cut outputs behind the point where they reach the target amount of the filter, return whether they do */
+bool applyUnspentTarget(std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs,
+                        const CAddressUnspentFilter &filter)
+{
+    if (filter.nTargetValue <= 0) {
+        return false;
+    }
+    CAmount nTotal = 0;
+    for (size_t i = 0; i < unspentOutputs.size(); i++) {
+        nTotal += unspentOutputs[i].second.satoshis;
+        if (nTotal >= filter.nTargetValue) {
+            unspentOutputs.resize(i + 1);
+            return true;
+        }
+    }
+    return false;
+}
+
 bool timestampSort(std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> a,
                    std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> b) {
     return a.second.time < b.second.time;
@@ -577,12 +783,129 @@ UniValue getaddressmempool(const UniValue& params, bool fHelp)
     return result;
 }
 
+/** Longest wait of getaddressmempoolupdates, so that a call cannot hold an RPC thread indefinitely */
+static const int64_t MAX_ADDRESS_MEMPOOL_UPDATES_TIMEOUT = 60000;
+
+UniValue getaddressmempoolupdates(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1 || !params[0].isObject())
+        throw runtime_error(
+            "getaddressmempoolupdates\n"
+            "\nReturns the mempool deltas of addresses that appeared or disappeared after a sequence number,\n"
+            "waiting for the first one if there are none yet (requires addressindex to be enabled).\n"
+            "\nArguments:\n"
+            "{\n"
+            "  \"addresses\"\n"
+            "    [\n"
+            "      \"address\"  (string) The base58check encoded address\n"
+            "      ,...\n"
+            "    ],\n"
+            "  \"sequence\"  (number, optional, default=0) The sequence returned by the previous call\n"
+            + strprintf("  \"timeout\"  (number, optional, default=0) Wait at most this many milliseconds for a delta, up to %d\n", MAX_ADDRESS_MEMPOOL_UPDATES_TIMEOUT) +
+            "}\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"sequence\"  (number) The sequence to pass to the next call\n"
+            "  \"complete\"  (boolean) False if deltas after the given sequence were dropped from the log,\n"
+            "                the caller should then resynchronize with getaddressmempool\n"
+            "  \"deltas\"\n"
+            "    [\n"
+            "      {\n"
+            "        \"sequence\"  (number) The sequence of this delta\n"
+            "        \"removed\"  (boolean) Whether the delta left the mempool instead of entering it\n"
+            "        \"address\"  (string) The base58check encoded address\n"
+            "        \"txid\"  (string) The related txid\n"
+            "        \"index\"  (number) The related input or output index\n"
+            "        \"satoshis\"  (number) The difference of satoshis\n"
+            "        \"timestamp\"  (number) The time the transaction entered the mempool (seconds)\n"
+            "        \"prevtxid\"  (string) The previous txid (if spending)\n"
+            "        \"prevout\"  (string) The previous transaction output index (if spending)\n"
+            "      }\n"
+            "      ,...\n"
+            "    ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressmempoolupdates", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"], \"sequence\": 1200, \"timeout\": 30000}'")
+            + HelpExampleRpc("getaddressmempoolupdates", "{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"], \"sequence\": 1200, \"timeout\": 30000}")
+        );
+
+    if (!fAddressIndex) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled");
+    }
+
+    std::vector<std::pair<uint160, int> > addresses;
+
+    if (!getAddressesFromParams(params, addresses)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+    }
+    std::set<std::pair<uint160, int> > watched(addresses.begin(), addresses.end());
+
+    uint64_t nSequence = 0;
+    UniValue sequenceValue = find_value(params[0].get_obj(), "sequence");
+    if (sequenceValue.isNum()) {
+        if (sequenceValue.get_int64() < 0) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Sequence is expected to be positive");
+        }
+        nSequence = sequenceValue.get_int64();
+    }
+
+    int64_t nTimeout = 0;
+    UniValue timeoutValue = find_value(params[0].get_obj(), "timeout");
+    if (timeoutValue.isNum()) {
+        nTimeout = std::min(timeoutValue.get_int64(), MAX_ADDRESS_MEMPOOL_UPDATES_TIMEOUT);
+    }
+    int64_t nDeadline = GetTimeMillis() + nTimeout;
+
+    std::vector<CMempoolAddressDeltaLogEntry> entries;
+    uint64_t nLast = 0;
+    bool fComplete = mempool.getAddressDeltasSince(nSequence, watched, entries, nLast);
+    while (fComplete && entries.empty() && IsRPCRunning()) {
+        // Changes to other addresses wake us up as well, so keep waiting from the latest sequence
+        int64_t nRemaining = nDeadline - GetTimeMillis();
+        if (nRemaining <= 0) {
+            break;
+        }
+        // Wake up regularly to notice a shutdown
+        mempool.waitForAddressDeltas(nLast, std::min(nRemaining, (int64_t)1000));
+        fComplete = mempool.getAddressDeltasSince(nLast, watched, entries, nLast);
+    }
+
+    UniValue deltas(UniValue::VARR);
+    for (std::vector<CMempoolAddressDeltaLogEntry>::const_iterator it = entries.begin(); it != entries.end(); it++) {
+        std::string address;
+        if (!getAddressFromIndex(it->key.type, it->key.addressBytes, address)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+        }
+
+        UniValue delta(UniValue::VOBJ);
+        delta.push_back(Pair("sequence", (int64_t)it->nSequence));
+        delta.push_back(Pair("removed", !it->fAdded));
+        delta.push_back(Pair("address", address));
+        delta.push_back(Pair("txid", it->key.txhash.GetHex()));
+        delta.push_back(Pair("index", (int)it->key.index));
+        delta.push_back(Pair("satoshis", it->delta.amount));
+        delta.push_back(Pair("timestamp", it->delta.time));
+        if (it->delta.amount < 0) {
+            delta.push_back(Pair("prevtxid", it->delta.prevhash.GetHex()));
+            delta.push_back(Pair("prevout", (int)it->delta.prevout));
+        }
+        deltas.push_back(delta);
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("sequence", (int64_t)nLast));
+    result.push_back(Pair("complete", fComplete));
+    result.push_back(Pair("deltas", deltas));
+    return result;
+}
+
 UniValue getaddressutxos(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
         throw runtime_error(
             "getaddressutxos\n"
             "\nReturns all unspent outputs for an address (requires addressindex to be enabled).\n"
+            "A bare multisig output is listed under each of its keys.\n"
             "\nArguments:\n"
             "{\n"
             "  \"addresses\"\n"
@@ -591,8 +914,19 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
             "      ,...\n"
             "    ],\n"
             "  \"chainInfo\"  (boolean) Include chain info with results\n"
+            "  \"limit\"  (number, optional) Return at most this many outputs, ordered by address and outpoint\n"
+            "  \"cursor\"  (string, optional) The cursor returned by the previous page\n"
+            "  \"order\"  (string, optional, default=\"outpoint\") \"value\" to return the largest outputs of all addresses first\n"
+            "  \"minconf\"  (number, optional) Only outputs with at least this many confirmations\n"
+            "  \"start\"  (number, optional) Only outputs confirmed at or after this height\n"
+            "  \"end\"  (number, optional) Only outputs confirmed at or before this height\n"
+            "  \"mintime\"  (number, optional) Only outputs in blocks with a median time past at or after this time\n"
+            "  \"maxtime\"  (number, optional) Only outputs in blocks with a median time past at or before this time\n"
+            "  \"minsatoshis\"  (number, optional) Only outputs worth at least this many satoshis\n"
+            "  \"target\"  (number, optional) Stop once the returned outputs add up to this many satoshis\n"
             "}\n"
-            "\nResult\n"
+            "\nResult (if limit is given the outputs are returned in \"utxos\" together with the\n"
+            "\"cursor\" for the next page, which is omitted after the last page)\n"
             "[\n"
             "  {\n"
             "    \"address\"  (string) The address base58check encoded\n"
@@ -622,15 +956,101 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
 
+    EnsureIndexSynced(OPTIONAL_INDEX_ADDRESS);
+
+    unsigned int limit = 0;
+    std::string cursor;
+    bool fPaged = getPageFromParams(params, limit, cursor);
+
+    CAddressUnspentFilter filter;
+    getUnspentFilterFromParams(params, filter);
+
     std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentOutputs;
+    // Read all addresses as of the same moment, even while blocks are connected
+    boost::scoped_ptr<CDBSnapshot> psnapshot(GetIndexSnapshot(OPTIONAL_INDEX_ADDRESS));
+
+    if (filter.fByValue) {
+        // Each address contributes at most its own largest outputs up to the limit
+        // and target, which covers the largest outputs of all addresses together
+        CAddressUnspentValueKey afterKey;
+        if (!cursor.empty()) {
+            decodeIndexCursor(cursor, afterKey);
+        }
 
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (!GetAddressUnspent((*it).first, (*it).second, unspentOutputs)) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+        std::sort(addresses.begin(), addresses.end(), addressKeySort);
+        addresses.erase(std::unique(addresses.begin(), addresses.end()), addresses.end());
+
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+            CAddressUnspentValueKey resumeKey;
+            const CAddressUnspentValueKey *pafter = NULL;
+            if (!cursor.empty()) {
+                // Resume behind the cursor in the order of valueSort
+                std::pair<uint160, int> afterAddress = std::make_pair(afterKey.hashBytes, (int)afterKey.type);
+                resumeKey = afterKey;
+                resumeKey.type = (*it).second;
+                resumeKey.hashBytes = (*it).first;
+                if (addressKeySort(*it, afterAddress)) {
+                    resumeKey.txhash = uint256S(std::string(64, 'f'));
+                    resumeKey.index = 0xffffffff;
+                } else if (addressKeySort(afterAddress, *it)) {
+                    resumeKey.txhash.SetNull();
+                    resumeKey.index = 0;
+                }
+                pafter = &resumeKey;
+            }
+
+            if (!GetAddressUnspentByValue((*it).first, (*it).second, unspentOutputs, pafter, limit, filter, psnapshot.get())) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+            }
+        }
+
+        std::sort(unspentOutputs.begin(), unspentOutputs.end(), valueSort);
+        if (fPaged && unspentOutputs.size() > limit) {
+            unspentOutputs.resize(limit);
+        }
+    } else if (fPaged) {
+        CAddressUnspentKey afterKey;
+        if (!cursor.empty()) {
+            decodeIndexCursor(cursor, afterKey);
+        }
+
+        std::sort(addresses.begin(), addresses.end(), addressKeySort);
+        addresses.erase(std::unique(addresses.begin(), addresses.end()), addresses.end());
+
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+            if (unspentOutputs.size() >= limit) {
+                break;
+            }
+
+            const CAddressUnspentKey *pafter = NULL;
+            if (!cursor.empty()) {
+                std::pair<uint160, int> afterAddress = std::make_pair(afterKey.hashBytes, (int)afterKey.type);
+                if (addressKeySort(*it, afterAddress)) {
+                    continue;
+                }
+                if (!addressKeySort(afterAddress, *it)) {
+                    pafter = &afterKey;
+                }
+            }
+
+            if (!GetAddressUnspent((*it).first, (*it).second, unspentOutputs, pafter, limit - unspentOutputs.size(), filter, psnapshot.get())) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+            }
         }
+    } else {
+        CAddressUnspentFilter addressFilter = filter;
+        // The target applies to the outputs in height order, which is only known after the sort
+        addressFilter.nTargetValue = 0;
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+            if (!GetAddressUnspent((*it).first, (*it).second, unspentOutputs, NULL, 0, addressFilter, psnapshot.get())) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+            }
+        }
+
+        std::sort(unspentOutputs.begin(), unspentOutputs.end(), heightSort);
     }
 
-    std::sort(unspentOutputs.begin(), unspentOutputs.end(), heightSort);
+    bool fTargetReached = applyUnspentTarget(unspentOutputs, filter);
 
     UniValue utxos(UniValue::VARR);
 
@@ -650,25 +1070,55 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
         utxos.push_back(output);
     }
 
-    if (includeChainInfo) {
+    if (includeChainInfo || fPaged) {
         UniValue result(UniValue::VOBJ);
         result.push_back(Pair("utxos", utxos));
 
-        LOCK(cs_main);
-        result.push_back(Pair("hash", chainActive.Tip()->GetBlockHash().GetHex()));
-        result.push_back(Pair("height", (int)chainActive.Height()));
+        // No further page once the target is reached
+        if (fPaged && unspentOutputs.size() >= limit && !fTargetReached) {
+            if (filter.fByValue) {
+                const std::pair<CAddressUnspentKey, CAddressUnspentValue> &last = unspentOutputs.back();
+                result.push_back(Pair("cursor", encodeIndexCursor(CAddressUnspentValueKey(last.first, last.second.satoshis))));
+            } else {
+                result.push_back(Pair("cursor", encodeIndexCursor(unspentOutputs.back().first)));
+            }
+        }
+
+        if (includeChainInfo) {
+            LOCK(cs_main);
+            result.push_back(Pair("hash", chainActive.Tip()->GetBlockHash().GetHex()));
+            result.push_back(Pair("height", (int)chainActive.Height()));
+        }
         return result;
     } else {
         return utxos;
     }
 }
 
+UniValue getAddressDelta(const CAddressIndexKey &key, const CAmount &amount)
+{
+    std::string address;
+    if (!getAddressFromIndex(key.type, key.hashBytes, address)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+    }
+
+    UniValue delta(UniValue::VOBJ);
+    delta.push_back(Pair("satoshis", amount));
+    delta.push_back(Pair("txid", key.txhash.GetHex()));
+    delta.push_back(Pair("index", (int)key.index));
+    delta.push_back(Pair("blockindex", (int)key.txindex));
+    delta.push_back(Pair("height", key.blockHeight));
+    delta.push_back(Pair("address", address));
+    return delta;
+}
+
 UniValue getaddressdeltas(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1 || !params[0].isObject())
         throw runtime_error(
             "getaddressdeltas\n"
             "\nReturns all changes for an address (requires addressindex to be enabled).\n"
+            "A bare multisig output changes each of its keys by its full value.\n"
             "\nArguments:\n"
             "{\n"
             "  \"addresses\"\n"
@@ -679,8 +1129,12 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
             "  \"start\" (number) The start block height\n"
             "  \"end\" (number) The end block height\n"
             "  \"chainInfo\" (boolean) Include chain info in results, only applies if start and end specified\n"
+            "  \"limit\" (number, optional) Return about this many deltas, ordered by height and position in the block\n"
+            "  \"cursor\" (string, optional) The cursor returned by the previous page\n"
             "}\n"
-            "\nResult:\n"
+            "\nResult (if limit is given the deltas are returned in \"deltas\" together with the\n"
+            "\"cursor\" for the next page, which is omitted after the last page; the deltas of a\n"
+            "transaction are never split across pages):\n"
             "[\n"
             "  {\n"
             "    \"satoshis\"  (number) The difference of satoshis\n"
@@ -725,36 +1179,38 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
 
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    EnsureIndexSynced(OPTIONAL_INDEX_ADDRESS);
 
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (start > 0 && end > 0) {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-            }
-        } else {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-            }
-        }
-    }
+    unsigned int limit = 0;
+    std::string cursor;
+    bool fPaged = getPageFromParams(params, limit, cursor);
 
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
     UniValue deltas(UniValue::VARR);
+    bool fMore = false;
 
-    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=addressIndex.begin(); it!=addressIndex.end(); it++) {
-        std::string address;
-        if (!getAddressFromIndex(it->first.type, it->first.hashBytes, address)) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+    if (fPaged) {
+        CAddressIndexPageKey afterKey;
+        if (!cursor.empty()) {
+            decodeIndexCursor(cursor, afterKey);
         }
+        fMore = getAddressIndexPage(addresses, start, end, cursor.empty() ? NULL : &afterKey, limit, addressIndex);
 
-        UniValue delta(UniValue::VOBJ);
-        delta.push_back(Pair("satoshis", it->second));
-        delta.push_back(Pair("txid", it->first.txhash.GetHex()));
-        delta.push_back(Pair("index", (int)it->first.index));
-        delta.push_back(Pair("blockindex", (int)it->first.txindex));
-        delta.push_back(Pair("height", it->first.blockHeight));
-        delta.push_back(Pair("address", address));
-        deltas.push_back(delta);
+        for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=addressIndex.begin(); it!=addressIndex.end(); it++) {
+            deltas.push_back(getAddressDelta(it->first, it->second));
+        }
+    } else {
+        // Stream the rows of all addresses merged into block order
+        boost::scoped_ptr<CAddressIndexMergeCursor> pcursor(GetAddressIndexCursor(addresses, start, end));
+        if (!pcursor) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+        }
+        for (; pcursor->Valid(); pcursor->Next()) {
+            deltas.push_back(getAddressDelta(pcursor->GetKey(), pcursor->GetValue()));
+        }
+        if (pcursor->Failed()) {
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read address index");
+        }
     }
 
     UniValue result(UniValue::VOBJ);
@@ -781,11 +1237,255 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
         result.push_back(Pair("deltas", deltas));
         result.push_back(Pair("start", startInfo));
         result.push_back(Pair("end", endInfo));
-
-        return result;
+    } else if (fPaged) {
+        result.push_back(Pair("deltas", deltas));
     } else {
         return deltas;
     }
+
+    if (fMore) {
+        result.push_back(Pair("cursor", encodeAddressIndexPageCursor(addressIndex.back().first)));
+    }
+
+    return result;
+}
+
+std::string getWatchSetNameFromParams(const UniValue& params)
+{
+    if (!params[0].isObject()) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Expected an object");
+    }
+    UniValue nameValue = find_value(params[0].get_obj(), "name");
+    if (!nameValue.isStr() || nameValue.get_str().empty() || nameValue.get_str().size() > MAX_ADDRESS_WATCH_NAME_LENGTH) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Name is expected to be a string of 1 to %u characters", MAX_ADDRESS_WATCH_NAME_LENGTH));
+    }
+    return nameValue.get_str();
+}
+
+UniValue addwatchaddresses(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "addwatchaddresses\n"
+            "\nAdds addresses to a watch set, creating the set if needed. The address index rows of every new block\n"
+            "that touch the addresses of a set are collected while the block is connected, see getwatchsetmatches\n"
+            "(requires addressindex to be enabled).\n"
+            "\nArguments:\n"
+            "{\n"
+            "  \"name\"  (string, required) The name of the watch set\n"
+            "  \"addresses\"\n"
+            "    [\n"
+            "      \"address\"  (string) The base58check encoded address\n"
+            "      ,...\n"
+            "    ]\n"
+            "}\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"added\"  (number) The number of addresses that were not in the set yet\n"
+            "  \"addresses\"  (number) The number of addresses in the set\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("addwatchaddresses", "'{\"name\": \"payments\", \"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}'")
+            + HelpExampleRpc("addwatchaddresses", "{\"name\": \"payments\", \"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}")
+        );
+
+    if (!fAddressIndex) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled");
+    }
+
+    std::string name = getWatchSetNameFromParams(params);
+    std::vector<std::pair<uint160, int> > addresses;
+    if (!getAddressesFromParams(params, addresses)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+    }
+
+    unsigned int nAdded = 0;
+    if (!addressWatchSets.Add(name, addresses, nAdded)) {
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to write watch set");
+    }
+
+    std::map<std::string, unsigned int> sets;
+    addressWatchSets.List(sets);
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("added", (int64_t)nAdded));
+    result.push_back(Pair("addresses", (int64_t)sets[name]));
+    return result;
+}
+
+UniValue removewatchaddresses(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "removewatchaddresses\n"
+            "\nRemoves addresses from a watch set, the set is gone once it is empty (requires addressindex to be enabled).\n"
+            "\nArguments:\n"
+            "{\n"
+            "  \"name\"  (string, required) The name of the watch set\n"
+            "  \"addresses\"\n"
+            "    [\n"
+            "      \"address\"  (string) The base58check encoded address\n"
+            "      ,...\n"
+            "    ]\n"
+            "}\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"removed\"  (number) The number of addresses that were in the set\n"
+            "  \"addresses\"  (number) The number of addresses left in the set\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("removewatchaddresses", "'{\"name\": \"payments\", \"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}'")
+            + HelpExampleRpc("removewatchaddresses", "{\"name\": \"payments\", \"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}")
+        );
+
+    if (!fAddressIndex) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled");
+    }
+
+    std::string name = getWatchSetNameFromParams(params);
+    std::vector<std::pair<uint160, int> > addresses;
+    if (!getAddressesFromParams(params, addresses)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+    }
+
+    unsigned int nRemoved = 0;
+    if (!addressWatchSets.Remove(name, addresses, nRemoved)) {
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to write watch set");
+    }
+
+    std::map<std::string, unsigned int> sets;
+    addressWatchSets.List(sets);
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("removed", (int64_t)nRemoved));
+    result.push_back(Pair("addresses", (int64_t)(sets.count(name) ? sets[name] : 0)));
+    return result;
+}
+
+UniValue listwatchsets(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "listwatchsets\n"
+            "\nLists the watch sets and the number of addresses in each (requires addressindex to be enabled).\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"name\"  (string) The name of the watch set\n"
+            "    \"addresses\"  (number) The number of addresses in the set\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("listwatchsets", "")
+            + HelpExampleRpc("listwatchsets", "")
+        );
+
+    if (!fAddressIndex) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled");
+    }
+
+    std::map<std::string, unsigned int> sets;
+    addressWatchSets.List(sets);
+
+    UniValue result(UniValue::VARR);
+    for (std::map<std::string, unsigned int>::const_iterator it = sets.begin(); it != sets.end(); it++) {
+        UniValue set(UniValue::VOBJ);
+        set.push_back(Pair("name", it->first));
+        set.push_back(Pair("addresses", (int64_t)it->second));
+        result.push_back(set);
+    }
+    return result;
+}
+
+UniValue getwatchsetmatches(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getwatchsetmatches\n"
+            "\nReturns the address deltas of the addresses of a watch set, per block of the active chain\n"
+            "(requires addressindex to be enabled).\n"
+            "\nArguments:\n"
+            "{\n"
+            "  \"name\"  (string, required) The name of the watch set\n"
+            "  \"blockhash\"  (string, optional) A single block\n"
+            "  \"start\"  (number, optional) The first block height, when no blockhash is given\n"
+            "  \"end\"  (number, optional) The last block height, defaults to the tip\n"
+            "}\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"blockhash\"  (string) The block\n"
+            "    \"height\"  (number) The height of the block\n"
+            "    \"deltas\"  (array) The address deltas of the set in the block, as returned by getaddressdeltas\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nBlocks without a match are left out.\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getwatchsetmatches", "'{\"name\": \"payments\", \"start\": 1000, \"end\": 1010}'")
+            + HelpExampleRpc("getwatchsetmatches", "{\"name\": \"payments\", \"start\": 1000, \"end\": 1010}")
+        );
+
+    if (!fAddressIndex) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled");
+    }
+
+    std::string name = getWatchSetNameFromParams(params);
+    EnsureIndexSynced(OPTIONAL_INDEX_ADDRESS);
+
+    std::vector<const CBlockIndex*> blocks;
+    {
+        LOCK(cs_main);
+        UniValue hashValue = find_value(params[0].get_obj(), "blockhash");
+        if (hashValue.isStr()) {
+            BlockMap::iterator mi = mapBlockIndex.find(uint256S(hashValue.get_str()));
+            if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found in the active chain");
+            }
+            blocks.push_back(mi->second);
+        } else {
+            int start = 0;
+            int end = chainActive.Height();
+            UniValue startValue = find_value(params[0].get_obj(), "start");
+            UniValue endValue = find_value(params[0].get_obj(), "end");
+            if (startValue.isNum()) {
+                start = startValue.get_int();
+            }
+            if (endValue.isNum()) {
+                end = std::min(endValue.get_int(), end);
+            }
+            if (start < 0 || end < start) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Start and end are expected to be an ascending range of heights");
+            }
+            for (int nHeight = start; nHeight <= end; nHeight++) {
+                blocks.push_back(chainActive[nHeight]);
+            }
+        }
+    }
+
+    UniValue result(UniValue::VARR);
+    for (std::vector<const CBlockIndex*>::const_iterator it = blocks.begin(); it != blocks.end(); it++) {
+        std::vector<std::pair<CAddressIndexKey, CAmount> > matches;
+        if (!GetAddressWatchMatches(name, (*it)->GetBlockHash(), matches)) {
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read watch set matches");
+        }
+        if (matches.empty()) {
+            continue;
+        }
+
+        UniValue deltas(UniValue::VARR);
+        for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator mit = matches.begin(); mit != matches.end(); mit++) {
+            deltas.push_back(getAddressDelta(mit->first, mit->second));
+        }
+
+        UniValue block(UniValue::VOBJ);
+        block.push_back(Pair("blockhash", (*it)->GetBlockHash().GetHex()));
+        block.push_back(Pair("height", (*it)->nHeight));
+        block.push_back(Pair("deltas", deltas));
+        result.push_back(block);
+    }
+    return result;
 }
 
 UniValue getaddressbalance(const UniValue& params, bool fHelp)
@@ -794,6 +1494,7 @@ UniValue getaddressbalance(const UniValue& params, bool fHelp)
         throw runtime_error(
             "getaddressbalance\n"
             "\nReturns the balance for an address(es) (requires addressindex to be enabled).\n"
+            "The full value of a bare multisig output counts towards the balance of each of its keys.\n"
             "\nArguments:\n"
             "{\n"
             "  \"addresses\"\n"
@@ -818,22 +1519,32 @@ UniValue getaddressbalance(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
 
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    EnsureIndexSynced(OPTIONAL_INDEX_ADDRESS);
+
+    CAmount balance = 0;
+    CAmount received = 0;
+    boost::scoped_ptr<CDBSnapshot> psnapshot(GetIndexSnapshot(OPTIONAL_INDEX_ADDRESS));
 
     for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+        CAddressSummaryValue summary;
+        if (GetAddressSummary((*it).first, (*it).second, summary, psnapshot.get())) {
+            balance += summary.balance;
+            received += summary.received;
+            continue;
         }
-    }
 
-    CAmount balance = 0;
-    CAmount received = 0;
+        // No summary records, fall back to summing every delta of the address
+        std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+        if (!GetAddressIndex((*it).first, (*it).second, addressIndex, 0, 0, psnapshot.get())) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+        }
 
-    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=addressIndex.begin(); it!=addressIndex.end(); it++) {
-        if (it->second > 0) {
-            received += it->second;
+        for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator dit=addressIndex.begin(); dit!=addressIndex.end(); dit++) {
+            if (dit->second > 0) {
+                received += dit->second;
+            }
+            balance += dit->second;
         }
-        balance += it->second;
     }
 
     UniValue result(UniValue::VOBJ);
@@ -844,6 +1555,72 @@ UniValue getaddressbalance(const UniValue& params, bool fHelp)
 
 }
 
+UniValue getaddresssummary(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddresssummary\n"
+            "\nReturns the balance, totals and activity range for each address (requires addressindex to be enabled).\n"
+            "The full value of a bare multisig output counts towards the balance of each of its keys.\n"
+            "\nArguments:\n"
+            "{\n"
+            "  \"addresses\"\n"
+            "    [\n"
+            "      \"address\"  (string) The base58check encoded address\n"
+            "      ,...\n"
+            "    ]\n"
+            "}\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"address\"  (string) The base58check encoded address\n"
+            "    \"balance\"  (number) The current balance in satoshis\n"
+            "    \"received\"  (number) The total number of satoshis received (including change)\n"
+            "    \"txcount\"  (number) The number of transactions involving the address\n"
+            "    \"firstheight\"  (number) The height of the first block involving the address\n"
+            "    \"lastheight\"  (number) The height of the last block involving the address\n"
+            "  }\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddresssummary", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}'")
+            + HelpExampleRpc("getaddresssummary", "{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}")
+        );
+
+    std::vector<std::pair<uint160, int> > addresses;
+
+    if (!getAddressesFromParams(params, addresses)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+    }
+
+    EnsureIndexSynced(OPTIONAL_INDEX_ADDRESS);
+
+    UniValue result(UniValue::VARR);
+    boost::scoped_ptr<CDBSnapshot> psnapshot(GetIndexSnapshot(OPTIONAL_INDEX_ADDRESS));
+
+    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+        CAddressSummaryValue summary;
+        if (!GetAddressSummary((*it).first, (*it).second, summary, psnapshot.get())) {
+            throw JSONRPCError(RPC_MISC_ERROR, "Address summaries are not available, rebuild the address index with -reindex");
+        }
+
+        std::string address;
+        if (!getAddressFromIndex((*it).second, (*it).first, address)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+        }
+
+        UniValue entry(UniValue::VOBJ);
+        entry.push_back(Pair("address", address));
+        entry.push_back(Pair("balance", summary.balance));
+        entry.push_back(Pair("received", summary.received));
+        entry.push_back(Pair("txcount", (int64_t)summary.txCount));
+        entry.push_back(Pair("firstheight", summary.firstHeight));
+        entry.push_back(Pair("lastheight", summary.lastHeight));
+        result.push_back(entry);
+    }
+
+    return result;
+}
+
 UniValue getaddresstxids(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -859,8 +1636,11 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
             "    ]\n"
             "  \"start\" (number) The start block height\n"
             "  \"end\" (number) The end block height\n"
+            "  \"limit\" (number, optional) Read about this many index entries, ordered by height and position in the block\n"
+            "  \"cursor\" (string, optional) The cursor returned by the previous page\n"
             "}\n"
-            "\nResult:\n"
+            "\nResult (if limit is given the txids are returned in \"txids\" together with the\n"
+            "\"cursor\" for the next page, which is omitted after the last page):\n"
             "[\n"
             "  \"transactionid\"  (string) The transaction id\n"
             "  ,...\n"
@@ -876,6 +1656,8 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
 
+    EnsureIndexSynced(OPTIONAL_INDEX_ADDRESS);
+
     int start = 0;
     int end = 0;
     if (params[0].isObject()) {
@@ -887,50 +1669,88 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
         }
     }
 
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    unsigned int limit = 0;
+    std::string cursor;
+    if (getPageFromParams(params, limit, cursor)) {
+        CAddressIndexPageKey afterKey;
+        if (!cursor.empty()) {
+            decodeIndexCursor(cursor, afterKey);
+        }
 
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (start > 0 && end > 0) {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-            }
-        } else {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+        std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+        bool fMore = getAddressIndexPage(addresses, start, end, cursor.empty() ? NULL : &afterKey, limit, addressIndex);
+
+        // The rows of a transaction are adjacent and never split across pages
+        UniValue txids(UniValue::VARR);
+        for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=addressIndex.begin(); it!=addressIndex.end(); it++) {
+            if (it == addressIndex.begin() || it->first.txhash != (it - 1)->first.txhash) {
+                txids.push_back(it->first.txhash.GetHex());
             }
         }
+
+        UniValue result(UniValue::VOBJ);
+        result.push_back(Pair("txids", txids));
+        if (fMore) {
+            result.push_back(Pair("cursor", encodeAddressIndexPageCursor(addressIndex.back().first)));
+        }
+        return result;
     }
 
-    std::set<std::pair<int, std::string> > txids;
-    UniValue result(UniValue::VARR);
+    boost::scoped_ptr<CAddressIndexMergeCursor> pcursor(GetAddressIndexCursor(addresses, start, end));
+    if (!pcursor) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    }
 
-    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=addressIndex.begin(); it!=addressIndex.end(); it++) {
-        int height = it->first.blockHeight;
-        std::string txid = it->first.txhash.GetHex();
+    UniValue result(UniValue::VARR);
 
-        if (addresses.size() > 1) {
-            txids.insert(std::make_pair(height, txid));
-        } else {
-            if (txids.insert(std::make_pair(height, txid)).second) {
-                result.push_back(txid);
-            }
+    // The merged rows are in block order, so all rows of a transaction are adjacent
+    bool fFirst = true;
+    uint256 lastTxHash;
+    for (; pcursor->Valid(); pcursor->Next()) {
+        const CAddressIndexKey &key = pcursor->GetKey();
+        if (fFirst || key.txhash != lastTxHash) {
+            result.push_back(key.txhash.GetHex());
+            lastTxHash = key.txhash;
+            fFirst = false;
         }
     }
-
-    if (addresses.size() > 1) {
-        for (std::set<std::pair<int, std::string> >::const_iterator it=txids.begin(); it!=txids.end(); it++) {
-            result.push_back(it->second);
-        }
+    if (pcursor->Failed()) {
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read address index");
     }
 
     return result;
 
 }
 
+UniValue spentInfoToJSON(const CSpentIndexValue &value)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("txid", value.txid.GetHex()));
+    obj.push_back(Pair("index", (int)value.inputIndex));
+    obj.push_back(Pair("height", value.blockHeight));
+    return obj;
+}
+
+CSpentIndexKey spentKeyFromParam(const UniValue &param)
+{
+    if (!param.isObject()) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid txid or index");
+    }
+
+    UniValue txidValue = find_value(param.get_obj(), "txid");
+    UniValue indexValue = find_value(param.get_obj(), "index");
+
+    if (!txidValue.isStr() || !indexValue.isNum()) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid txid or index");
+    }
+
+    return CSpentIndexKey(ParseHashV(txidValue, "txid"), indexValue.get_int());
+}
+
 UniValue getspentinfo(const UniValue& params, bool fHelp)
 {
 
-    if (fHelp || params.size() != 1 || !params[0].isObject())
+    if (fHelp || params.size() != 1 || !(params[0].isObject() || params[0].isArray()))
         throw runtime_error(
             "getspentinfo\n"
             "\nReturns the txid and index where an output is spent.\n"
@@ -939,40 +1759,57 @@ UniValue getspentinfo(const UniValue& params, bool fHelp)
             "  \"txid\" (string) The hex string of the txid\n"
             "  \"index\" (number) The start block height\n"
             "}\n"
+            "\nAn array of such objects resolves many outputs in one call.\n"
             "\nResult:\n"
             "{\n"
             "  \"txid\"  (string) The transaction id\n"
             "  \"index\"  (number) The spending input index\n"
             "  ,...\n"
             "}\n"
+            "\nResult (for an array, in the order of the request):\n"
+            "[\n"
+            "  {...}  (object) As above, or null if the output is unspent\n"
+            "  ,...\n"
+            "]\n"
             "\nExamples:\n"
             + HelpExampleCli("getspentinfo", "'{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}'")
             + HelpExampleRpc("getspentinfo", "{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}")
+            + HelpExampleCli("getspentinfo", "'[{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}]'")
         );
 
-    UniValue txidValue = find_value(params[0].get_obj(), "txid");
-    UniValue indexValue = find_value(params[0].get_obj(), "index");
+    if (params[0].isArray()) {
+        const UniValue &outpoints = params[0].get_array();
+        std::vector<CSpentIndexKey> keys;
+        keys.reserve(outpoints.size());
+        for (unsigned int i = 0; i < outpoints.size(); i++) {
+            keys.push_back(spentKeyFromParam(outpoints[i]));
+        }
 
-    if (!txidValue.isStr() || !indexValue.isNum()) {
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid txid or index");
+        EnsureIndexSynced(OPTIONAL_INDEX_SPENT);
+
+        std::vector<CSpentIndexValue> values;
+        if (!GetSpentIndexes(keys, values)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+        }
+
+        UniValue result(UniValue::VARR);
+        for (size_t i = 0; i < values.size(); i++) {
+            result.push_back(values[i].IsNull() ? NullUniValue : spentInfoToJSON(values[i]));
+        }
+        return result;
     }
 
-    uint256 txid = ParseHashV(txidValue, "txid");
-    int outputIndex = indexValue.get_int();
+    CSpentIndexKey key = spentKeyFromParam(params[0]);
+
+    EnsureIndexSynced(OPTIONAL_INDEX_SPENT);
 
-    CSpentIndexKey key(txid, outputIndex);
     CSpentIndexValue value;
 
     if (!GetSpentIndex(key, value)) {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
     }
 
-    UniValue obj(UniValue::VOBJ);
-    obj.push_back(Pair("txid", value.txid.GetHex()));
-    obj.push_back(Pair("index", (int)value.inputIndex));
-    obj.push_back(Pair("height", value.blockHeight));
-
-    return obj;
+    return spentInfoToJSON(value);
 }
 
 
@@ -988,10 +1825,16 @@ static const CRPCCommand commands[] =
 
     /* Address index */
     { "addressindex",       "getaddressmempool",      &getaddressmempool,      true  },
+    { "addressindex",       "getaddressmempoolupdates", &getaddressmempoolupdates, true  },
     { "addressindex",       "getaddressutxos",        &getaddressutxos,        false },
     { "addressindex",       "getaddressdeltas",       &getaddressdeltas,       false },
     { "addressindex",       "getaddresstxids",        &getaddresstxids,        false },
     { "addressindex",       "getaddressbalance",      &getaddressbalance,      false },
+    { "addressindex",       "getaddresssummary",      &getaddresssummary,      false },
+    { "addressindex",       "addwatchaddresses",      &addwatchaddresses,      true  },
+    { "addressindex",       "removewatchaddresses",   &removewatchaddresses,   true  },
+    { "addressindex",       "listwatchsets",          &listwatchsets,          true  },
+    { "addressindex",       "getwatchsetmatches",     &getwatchsetmatches,     false },
 
     /* Blockchain */
     { "blockchain",         "getspentinfo",           &getspentinfo,           false },
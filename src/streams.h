@@ -365,6 +365,60 @@ public:
 
 
 
+/** Read-only stream over memory owned by someone else, such as a mapped file
+ * or a database slice.
+ *
+ * The memory must stay valid and unchanged for as long as the stream is used.
+ */
+class CSpanReader
+{
+private:
+    const char* pcur;
+    const char* pend;
+    int nType;
+    int nVersion;
+
+public:
+    CSpanReader(const unsigned char* pbegin, const unsigned char* pendIn, int nTypeIn, int nVersionIn) :
+        pcur((const char*)pbegin), pend((const char*)pendIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    CSpanReader(const char* pbegin, const char* pendIn, int nTypeIn, int nVersionIn) :
+        pcur(pbegin), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    //
+    // Stream subset
+    //
+    int GetType() const          { return nType; }
+    int GetVersion() const       { return nVersion; }
+    size_t size() const          { return pend - pcur; }
+    bool empty() const           { return pcur == pend; }
+
+    CSpanReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CSpanReader::read(): end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    CSpanReader& ignore(size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CSpanReader::ignore(): end of data");
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CSpanReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 /** Non-refcounted RAII wrapper for FILE*
  *
  * Will automatically close the file when it goes out of scope if not null.
@@ -582,6 +636,22 @@ public:
         return (*this);
     }
 
+    // skip a number of bytes, without copying them out of the buffer
+    CBufferedFile& ignore(size_t nSize) {
+        if (nSize + nReadPos > nReadLimit)
+            throw std::ios_base::failure("Ignore attempted past buffer limit");
+        while (nSize > 0) {
+            if (nReadPos == nSrcPos)
+                Fill();
+            size_t nNow = nSize;
+            if (nNow + nReadPos > nSrcPos)
+                nNow = nSrcPos - nReadPos;
+            nReadPos += nNow;
+            nSize -= nNow;
+        }
+        return (*this);
+    }
+
     // return the current reading position
     uint64_t GetPos() {
         return nReadPos;
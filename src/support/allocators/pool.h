@@ -0,0 +1,217 @@
+// Copyright (c) 2009-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+#define BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <new>
+#include <vector>
+
+/** Size of the first chunk of a CPoolResource, later ones double up to POOL_MAX_CHUNK_SIZE */
+static const size_t POOL_MIN_CHUNK_SIZE = 4096;
+static const size_t POOL_MAX_CHUNK_SIZE = 256 * 1024;
+
+/**
+ * Largest block a pool for the nodes of a node based container of T needs to
+ * serve: the value and up to four pointers for the links and cached hash of
+ * the node. Requests that do not fit are counted by NumHeapFallbacks().
+ */
+template <typename T>
+inline size_t PoolNodeSize()
+{
+    return sizeof(T) + 4 * sizeof(void*);
+}
+
+/**
+ * Memory for the nodes of a node based container. Blocks of up to
+ * nMaxBlockSize bytes are cut from large chunks, in multiples of the size of a
+ * pointer, and released blocks are kept on a free list per size, so a node
+ * costs its own size instead of a heap allocation with its bookkeeping, and
+ * nodes allocated one after another sit next to each other. Chunks start
+ * small and double in size, so that short-lived containers stay cheap.
+ *
+ * Chunks are only handed back to the heap by Clear() or the destructor, but
+ * released blocks are reused before the pool grows, so the blocks in use at
+ * its fullest bound what it takes from the heap.
+ */
+class CPoolResource
+{
+private:
+    // Disallow copies
+    CPoolResource(const CPoolResource&);
+    CPoolResource& operator=(const CPoolResource&);
+
+    //! free list entry, stored in the released block itself
+    struct ListNode {
+        ListNode* next;
+    };
+
+    //! blocks are multiples of this size, which is also their alignment
+    static size_t BlockAlign() { return sizeof(ListNode); }
+
+    const size_t nMaxBlockSize;
+    //! free lists by block size in units of BlockAlign()
+    std::vector<ListNode*> vFreeLists;
+    std::vector<char*> vChunks;
+    size_t nLastChunkSize;
+    size_t nChunkBytes;
+    size_t nUsedBytes;
+    //! single objects that were too large for the pool and came from the heap, ever and still in use
+    size_t nHeapFallbacks;
+    size_t nHeapBlocks;
+    //! unused rest of the last chunk
+    char* pAvailable;
+    char* pAvailableEnd;
+
+    void PushFree(void* p, size_t nUnits)
+    {
+        ListNode* node = new (p) ListNode;
+        node->next = vFreeLists[nUnits];
+        vFreeLists[nUnits] = node;
+    }
+
+    void AllocateChunk()
+    {
+        // The rest of the previous chunk is too small for the current request, but not for smaller ones
+        size_t nRest = (pAvailableEnd - pAvailable) / BlockAlign();
+        if (nRest > 0)
+            PushFree(pAvailable, nRest);
+
+        size_t nSize = vChunks.empty() ? POOL_MIN_CHUNK_SIZE : std::min(2 * nLastChunkSize, POOL_MAX_CHUNK_SIZE);
+        nSize = std::max(nSize, nMaxBlockSize);
+        vChunks.push_back(static_cast<char*>(::operator new(nSize)));
+        nLastChunkSize = nSize;
+        nChunkBytes += nSize;
+        pAvailable = vChunks.back();
+        pAvailableEnd = pAvailable + nSize;
+    }
+
+public:
+    explicit CPoolResource(size_t nMaxBlockSizeIn) :
+        nMaxBlockSize(std::max(nMaxBlockSizeIn, BlockAlign())), vFreeLists(nMaxBlockSize / BlockAlign() + 1),
+        nLastChunkSize(0), nChunkBytes(0), nUsedBytes(0), nHeapFallbacks(0), nHeapBlocks(0), pAvailable(NULL), pAvailableEnd(NULL)
+    {
+    }
+
+    ~CPoolResource()
+    {
+        Clear();
+    }
+
+    //! Whether a request is served from the pool rather than the heap
+    bool IsPooled(size_t nBytes, size_t nAlign) const
+    {
+        return nBytes > 0 && nBytes <= nMaxBlockSize && BlockAlign() % nAlign == 0;
+    }
+
+    void* Allocate(size_t nBytes, size_t nAlign)
+    {
+        if (!IsPooled(nBytes, nAlign)) {
+            nHeapFallbacks++;
+            nHeapBlocks++;
+            return ::operator new(nBytes);
+        }
+
+        size_t nUnits = (nBytes + BlockAlign() - 1) / BlockAlign();
+        nUsedBytes += nUnits * BlockAlign();
+        if (vFreeLists[nUnits] != NULL) {
+            ListNode* node = vFreeLists[nUnits];
+            vFreeLists[nUnits] = node->next;
+            return node;
+        }
+        if ((size_t)(pAvailableEnd - pAvailable) < nUnits * BlockAlign())
+            AllocateChunk();
+        void* p = pAvailable;
+        pAvailable += nUnits * BlockAlign();
+        return p;
+    }
+
+    void Deallocate(void* p, size_t nBytes, size_t nAlign)
+    {
+        if (!IsPooled(nBytes, nAlign)) {
+            nHeapBlocks--;
+            ::operator delete(p);
+            return;
+        }
+        size_t nUnits = (nBytes + BlockAlign() - 1) / BlockAlign();
+        nUsedBytes -= nUnits * BlockAlign();
+        PushFree(p, nUnits);
+    }
+
+    /** Free all chunks. Only valid when no block of the pool is in use. */
+    void Clear()
+    {
+        for (std::vector<char*>::iterator it = vChunks.begin(); it != vChunks.end(); it++)
+            ::operator delete(*it);
+        vChunks.clear();
+        std::fill(vFreeLists.begin(), vFreeLists.end(), (ListNode*)NULL);
+        nLastChunkSize = 0;
+        nChunkBytes = 0;
+        nUsedBytes = 0;
+        pAvailable = NULL;
+        pAvailableEnd = NULL;
+    }
+
+    size_t NumChunks() const { return vChunks.size(); }
+    //! Bytes taken from the heap for chunks, in use or not
+    size_t ChunkBytes() const { return nChunkBytes; }
+    //! Bytes of the blocks given out and not released yet
+    size_t UsedBytes() const { return nUsedBytes; }
+    size_t NumHeapFallbacks() const { return nHeapFallbacks; }
+    size_t NumHeapBlocks() const { return nHeapBlocks; }
+    size_t MaxBlockSize() const { return nMaxBlockSize; }
+};
+
+/**
+ * Allocator taking single objects from a CPoolResource, for the nodes of a
+ * node based container. Arrays, like the buckets of a hash map, come from the
+ * heap, so that emptying the container is enough to make the pool unused.
+ */
+template <typename T>
+struct pool_allocator {
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind {
+        typedef pool_allocator<U> other;
+    };
+
+    CPoolResource* resource;
+
+    explicit pool_allocator(CPoolResource* resourceIn) throw() : resource(resourceIn) {}
+    template <typename U>
+    pool_allocator(const pool_allocator<U>& a) throw() : resource(a.resource) {}
+
+    T* allocate(size_t n)
+    {
+        if (n != 1)
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        return static_cast<T*>(resource->Allocate(sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        if (n != 1) {
+            ::operator delete(p);
+            return;
+        }
+        resource->Deallocate(p, sizeof(T), alignof(T));
+    }
+
+    template <typename U>
+    bool operator==(const pool_allocator<U>& a) const { return resource == a.resource; }
+    template <typename U>
+    bool operator!=(const pool_allocator<U>& a) const { return resource != a.resource; }
+};
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_POOL_H
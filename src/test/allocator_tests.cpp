@@ -4,10 +4,12 @@
 
 #include "util.h"
 
+#include "support/allocators/pool.h"
 #include "support/allocators/secure.h"
 #include "test/test_bitcoin.h"
 
 #include <boost/test/unit_test.hpp>
+#include <boost/unordered_map.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(allocator_tests, BasicTestingSetup)
 
@@ -117,4 +119,92 @@ BOOST_AUTO_TEST_CASE(test_LockedPageManagerBase)
     BOOST_CHECK((last_unlock_len & (test_page_size-1)) == 0); // always unlock entire pages
 }
 
+BOOST_AUTO_TEST_CASE(pool_resource_blocks)
+{
+    CPoolResource pool(64);
+    BOOST_CHECK(pool.IsPooled(1, 1));
+    BOOST_CHECK(pool.IsPooled(64, sizeof(void*)));
+    BOOST_CHECK(!pool.IsPooled(65, 1));
+    BOOST_CHECK(!pool.IsPooled(0, 1));
+
+    // Blocks of one size are cut from the same chunk, one after another
+    char* a = static_cast<char*>(pool.Allocate(24, 8));
+    char* b = static_cast<char*>(pool.Allocate(20, 4));
+    BOOST_CHECK_EQUAL(b - a, 24);
+    BOOST_CHECK_EQUAL(pool.NumChunks(), 1U);
+    BOOST_CHECK_EQUAL(pool.ChunkBytes(), POOL_MIN_CHUNK_SIZE);
+    BOOST_CHECK_EQUAL(pool.UsedBytes(), 48U);
+
+    // Released blocks are given out again for the same size only
+    pool.Deallocate(a, 24, 8);
+    char* c = static_cast<char*>(pool.Allocate(40, 8));
+    BOOST_CHECK(c != a);
+    BOOST_CHECK(pool.Allocate(17, 1) == a);
+    BOOST_CHECK_EQUAL(pool.UsedBytes(), 88U);
+
+    // Larger requests go to the heap
+    void* big = pool.Allocate(1000, 8);
+    pool.Deallocate(big, 1000, 8);
+    BOOST_CHECK_EQUAL(pool.NumChunks(), 1U);
+
+    // Chunks double in size while more are needed
+    for (size_t i = 0; i < POOL_MIN_CHUNK_SIZE / 64 + 1; i++)
+        pool.Allocate(64, 8);
+    BOOST_CHECK_EQUAL(pool.NumChunks(), 2U);
+    BOOST_CHECK_EQUAL(pool.ChunkBytes(), 3 * POOL_MIN_CHUNK_SIZE);
+
+    pool.Clear();
+    BOOST_CHECK_EQUAL(pool.NumChunks(), 0U);
+    BOOST_CHECK_EQUAL(pool.ChunkBytes(), 0U);
+    BOOST_CHECK_EQUAL(pool.UsedBytes(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(pool_allocator_unordered_map)
+{
+    typedef pool_allocator<std::pair<const int, int> > Allocator;
+    typedef boost::unordered_map<int, int, boost::hash<int>, std::equal_to<int>, Allocator> Map;
+    CPoolResource pool(PoolNodeSize<Map::value_type>());
+    {
+        Map m(0, boost::hash<int>(), std::equal_to<int>(), Allocator(&pool));
+        for (int i = 0; i < 10000; i++)
+            m[i] = i;
+        size_t nChunkBytes = pool.ChunkBytes();
+        BOOST_CHECK(nChunkBytes > 0);
+        // The real nodes of the map fit the blocks the pool was made for
+        BOOST_CHECK_EQUAL(pool.NumHeapFallbacks(), 0U);
+
+        // Erased nodes make room for new ones without growing the pool
+        for (int i = 0; i < 5000; i++)
+            m.erase(i);
+        for (int i = 10000; i < 15000; i++)
+            m[i] = i;
+        BOOST_CHECK_EQUAL(pool.ChunkBytes(), nChunkBytes);
+        BOOST_CHECK_EQUAL(m.size(), 10000U);
+        for (int i = 5000; i < 15000; i++)
+            BOOST_CHECK_EQUAL(m[i], i);
+
+        // The bucket array is not taken from the pool, so an empty map leaves it unused
+        m.clear();
+        pool.Clear();
+        for (int i = 0; i < 100; i++)
+            m[i] = i;
+        BOOST_CHECK_EQUAL(m.size(), 100U);
+    }
+    BOOST_CHECK(pool.ChunkBytes() > 0);
+
+    // Nodes too large for the pool come from the heap and are counted
+    CPoolResource small(sizeof(int));
+    {
+        Map m(0, boost::hash<int>(), std::equal_to<int>(), Allocator(&small));
+        for (int i = 0; i < 10; i++)
+            m[i] = i;
+        BOOST_CHECK_EQUAL(small.NumHeapFallbacks(), 10U);
+        BOOST_CHECK_EQUAL(small.NumHeapBlocks(), 10U);
+        BOOST_CHECK_EQUAL(small.ChunkBytes(), 0U);
+        m.erase(0);
+        BOOST_CHECK_EQUAL(small.NumHeapBlocks(), 9U);
+    }
+    BOOST_CHECK_EQUAL(small.NumHeapBlocks(), 0U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
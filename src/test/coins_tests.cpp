@@ -9,8 +9,10 @@
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 #include "main.h"
+#include "txdb.h"
 #include "consensus/validation.h"
 
+#include <limits>
 #include <vector>
 #include <map>
 
@@ -415,4 +417,285 @@ BOOST_AUTO_TEST_CASE(ccoins_serialization)
     }
 }
 
+BOOST_AUTO_TEST_CASE(coins_cache_take_changes)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+    uint256 txidNew = GetRandHash(), txidSpent = GetRandHash(), txidGone = GetRandHash();
+    {
+        CCoinsModifier coins = cache.ModifyCoins(txidSpent);
+        coins->vout.resize(1);
+        coins->vout[0].nValue = 1;
+    }
+    BOOST_CHECK(cache.Flush());
+    {
+        CCoinsModifier coins = cache.ModifyCoins(txidSpent);
+        coins->Spend(0);
+    }
+    {
+        CCoinsModifier coins = cache.ModifyCoins(txidNew);
+        coins->vout.resize(1);
+        coins->vout[0].nValue = 2;
+    }
+    {
+        CCoinsModifier coins = cache.ModifyCoins(txidGone);
+        coins->vout.resize(1);
+        coins->vout[0].nValue = 3;
+    }
+    {
+        CCoinsModifier coins = cache.ModifyCoins(txidGone);
+        coins->Spend(0);
+    }
+
+    CPoolResource pool(PoolNodeSize<CCoinsMap::value_type>());
+    {
+        // Spent coins are written and dropped, new ones stay cached, and coins
+        // created and spent in between never reach the base
+        CCoinsMap mapCoins(0, SaltedTxidHasher(), std::equal_to<uint256>(), CCoinsMapAllocator(&pool));
+        cache.TakeChanges(mapCoins, std::numeric_limits<size_t>::max());
+        BOOST_CHECK_EQUAL(mapCoins.size(), 2U);
+        BOOST_CHECK_EQUAL(pool.NumHeapFallbacks(), 0U);
+        BOOST_CHECK(mapCoins[txidSpent].coins.IsPruned());
+        BOOST_CHECK_EQUAL(mapCoins[txidNew].coins.vout[0].nValue, 2);
+        BOOST_CHECK(cache.HaveCoinsInCache(txidNew));
+        BOOST_CHECK(!cache.HaveCoinsInCache(txidSpent));
+        BOOST_CHECK(!cache.HaveCoinsInCache(txidGone));
+        cache.SelfTest();
+
+        // The coins left in the cache are no longer modified
+        CCoinsMap mapCoinsAgain(0, SaltedTxidHasher(), std::equal_to<uint256>(), CCoinsMapAllocator(&pool));
+        cache.TakeChanges(mapCoinsAgain, std::numeric_limits<size_t>::max());
+        BOOST_CHECK(mapCoinsAgain.empty());
+        BOOST_CHECK(base.BatchWrite(mapCoins, uint256()));
+    }
+    {
+        {
+            CCoinsModifier coins = cache.ModifyCoins(txidNew);
+            coins->vout[0].nValue = 4;
+        }
+        CCoinsMap mapCoins(0, SaltedTxidHasher(), std::equal_to<uint256>(), CCoinsMapAllocator(&pool));
+        cache.TakeChanges(mapCoins, 0);
+        BOOST_CHECK_EQUAL(mapCoins.size(), 1U);
+        BOOST_CHECK_EQUAL(mapCoins[txidNew].coins.vout[0].nValue, 4);
+        BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+        cache.SelfTest();
+    }
+}
+
+static void AddTestCoins(CCoinsViewCache& cache, const uint256& txid, size_t nScriptSize)
+{
+    CCoinsModifier coins = cache.ModifyNewCoins(txid, false);
+    coins->vout.resize(1);
+    coins->vout[0].nValue = 1;
+    coins->vout[0].scriptPubKey.resize(nScriptSize);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_evict_least_recently_used)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+    uint256 txidA = GetRandHash(), txidB = GetRandHash(), txidC = GetRandHash(), txidD = GetRandHash(), txidE = GetRandHash();
+    CPoolResource pool(PoolNodeSize<CCoinsMap::value_type>());
+
+    // Coins last used for one best block age together, until the next one
+    AddTestCoins(cache, txidA, 10000);
+    AddTestCoins(cache, txidB, 10);
+    cache.SetBestBlock(GetRandHash());
+    AddTestCoins(cache, txidC, 10000);
+    cache.SetBestBlock(GetRandHash());
+    {
+        CCoinsMap mapCoins(0, SaltedTxidHasher(), std::equal_to<uint256>(), CCoinsMapAllocator(&pool));
+        cache.TakeChanges(mapCoins, std::numeric_limits<size_t>::max());
+        BOOST_CHECK_EQUAL(mapCoins.size(), 3U);
+        BOOST_CHECK(base.BatchWrite(mapCoins, cache.GetBestBlock()));
+    }
+    BOOST_CHECK(cache.AccessCoins(txidB));
+    AddTestCoins(cache, txidD, 10000);
+
+    // A and C are the oldest unmodified coins; D is modified, so it stays however old
+    cache.EvictUnmodified(15000);
+    BOOST_CHECK(!cache.HaveCoinsInCache(txidA));
+    BOOST_CHECK(cache.HaveCoinsInCache(txidB));
+    BOOST_CHECK(!cache.HaveCoinsInCache(txidC));
+    BOOST_CHECK(cache.HaveCoinsInCache(txidD));
+    cache.SelfTest();
+    cache.EvictUnmodified(0);
+    BOOST_CHECK(!cache.HaveCoinsInCache(txidB));
+    BOOST_CHECK(cache.HaveCoinsInCache(txidD));
+    cache.SelfTest();
+
+    // Older changes are moved out and dropped, recent ones copied and kept
+    BOOST_CHECK(cache.AccessCoins(txidB));
+    cache.SetBestBlock(GetRandHash());
+    AddTestCoins(cache, txidE, 10);
+    {
+        CCoinsMap mapCoins(0, SaltedTxidHasher(), std::equal_to<uint256>(), CCoinsMapAllocator(&pool));
+        cache.TakeChanges(mapCoins, 5000);
+        BOOST_CHECK_EQUAL(mapCoins.size(), 2U);
+        BOOST_CHECK_EQUAL(mapCoins[txidD].coins.vout[0].scriptPubKey.size(), 10000U);
+        BOOST_CHECK_EQUAL(mapCoins[txidE].coins.vout[0].nValue, 1);
+        BOOST_CHECK_EQUAL(cache.GetCacheSize(), 1U);
+        BOOST_CHECK(cache.HaveCoinsInCache(txidE));
+        cache.SelfTest();
+    }
+    {
+        CCoinsMap mapCoins(0, SaltedTxidHasher(), std::equal_to<uint256>(), CCoinsMapAllocator(&pool));
+        cache.TakeChanges(mapCoins, std::numeric_limits<size_t>::max());
+        BOOST_CHECK(mapCoins.empty());
+        cache.TakeChanges(mapCoins, 0);
+        BOOST_CHECK(mapCoins.empty());
+    }
+    // The buckets of the emptied map still count, with no entries left to drop
+    cache.EvictUnmodified(1);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+    cache.SelfTest();
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_fetched_coins)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+    uint256 txidCached = GetRandHash(), txidFetched = GetRandHash();
+    AddTestCoins(cache, txidCached, 10);
+
+    // Coins read ahead never replace what the cache has already
+    CCoins coins;
+    coins.vout.resize(1);
+    coins.vout[0].nValue = 5;
+    cache.CacheFetchedCoins(txidCached, coins);
+    BOOST_CHECK_EQUAL(cache.AccessCoins(txidCached)->vout[0].nValue, 1);
+    cache.CacheFetchedCoins(txidFetched, coins);
+    BOOST_CHECK_EQUAL(cache.AccessCoins(txidFetched)->vout[0].nValue, 5);
+    cache.SelfTest();
+
+    // and are not modified, so there is nothing to write for them
+    CPoolResource pool(PoolNodeSize<CCoinsMap::value_type>());
+    CCoinsMap mapCoins(0, SaltedTxidHasher(), std::equal_to<uint256>(), CCoinsMapAllocator(&pool));
+    cache.TakeChanges(mapCoins, std::numeric_limits<size_t>::max());
+    BOOST_CHECK_EQUAL(mapCoins.size(), 1U);
+    BOOST_CHECK(mapCoins.count(txidCached));
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_output_records, TestingSetup)
+{
+    CCoinsViewDB db(1 << 20, true, true);
+    CCoinsViewCache cache(&db);
+    uint256 txidA = GetRandHash(), txidB = GetRandHash();
+    {
+        CCoinsModifier coins = cache.ModifyNewCoins(txidA, false);
+        coins->nHeight = 10;
+        coins->vout.resize(3);
+        for (unsigned int i = 0; i < coins->vout.size(); i++) {
+            coins->vout[i].nValue = i + 1;
+            coins->vout[i].scriptPubKey = CScript() << OP_TRUE;
+        }
+    }
+    cache.ModifyNewCoins(txidB, true)->vout.resize(1);
+    cache.SetBestBlock(GetRandHash());
+    BOOST_CHECK(cache.Flush());
+
+    // The outputs are put back together, and only unspent ones are stored
+    CCoins coins;
+    BOOST_CHECK(db.GetCoins(txidA, coins));
+    BOOST_CHECK(coins == *cache.AccessCoins(txidA));
+    BOOST_CHECK(!db.HaveCoins(txidB));
+
+    cache.ModifyCoins(txidA)->Spend(1);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(db.GetCoins(txidA, coins));
+    BOOST_CHECK(coins.vout[1].IsNull());
+    BOOST_CHECK(coins == *cache.AccessCoins(txidA));
+
+    // The cursor sees one entry per transaction
+    boost::scoped_ptr<CCoinsViewCursor> pcursor(db.Cursor());
+    uint256 txid;
+    BOOST_CHECK(pcursor->Valid() && pcursor->GetKey(txid) && pcursor->GetValue(coins));
+    BOOST_CHECK(txid == txidA);
+    BOOST_CHECK(coins == *cache.AccessCoins(txidA));
+    pcursor->Next();
+    BOOST_CHECK(!pcursor->Valid());
+
+    cache.ModifyCoins(txidA)->Clear();
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!db.HaveCoins(txidA));
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_stored_outputs, TestingSetup)
+{
+    CCoinsViewDB db(1 << 20, true, true);
+    CCoinsViewCache cache(&db);
+    // txidSmall has its stored outputs recorded in the cache, txidLarge has too many for that
+    uint256 txidSmall = GetRandHash(), txidLarge = GetRandHash();
+    const unsigned int nOutputs[2] = {4, 70};
+    for (int i = 0; i < 2; i++) {
+        CCoinsModifier coins = cache.ModifyNewCoins(i == 0 ? txidSmall : txidLarge, false);
+        coins->nHeight = 10;
+        coins->vout.resize(nOutputs[i]);
+        for (unsigned int n = 0; n < coins->vout.size(); n++) {
+            coins->vout[n].nValue = n + 1;
+            coins->vout[n].scriptPubKey = CScript() << OP_TRUE;
+        }
+    }
+    cache.SetBestBlock(GetRandHash());
+    BOOST_CHECK(cache.Flush());
+
+    // Spend outputs, and restore one of them before the flush
+    CTxOut restored = cache.AccessCoins(txidSmall)->vout[1];
+    cache.ModifyCoins(txidSmall)->Spend(1);
+    cache.ModifyCoins(txidSmall)->Spend(3);
+    cache.ModifyCoins(txidSmall)->vout[1] = restored;
+    cache.ModifyCoins(txidLarge)->Spend(2);
+    cache.ModifyCoins(txidLarge)->Spend(69);
+
+    // Changes that reach the database through a second cache
+    {
+        CCoinsViewCache child(&cache);
+        child.ModifyCoins(txidSmall)->Spend(0);
+        child.ModifyCoins(txidLarge)->Spend(66);
+        BOOST_CHECK(child.Flush());
+    }
+
+    CCoins expected[2] = {*cache.AccessCoins(txidSmall), *cache.AccessCoins(txidLarge)};
+    BOOST_CHECK(cache.Flush());
+    CCoins coins;
+    BOOST_CHECK(db.GetCoins(txidSmall, coins));
+    BOOST_CHECK(coins == expected[0]);
+    BOOST_CHECK(!coins.IsAvailable(0) && coins.IsAvailable(1) && coins.IsAvailable(2) && coins.vout.size() == 3);
+    BOOST_CHECK(db.GetCoins(txidLarge, coins));
+    BOOST_CHECK(coins == expected[1]);
+    BOOST_CHECK(coins.vout.size() == 69);
+
+    // Spending the last outputs erases them all
+    cache.ModifyCoins(txidSmall)->Clear();
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!db.HaveCoins(txidSmall));
+
+    // A transaction disconnected and connected again at another height before the flush
+    // keeps its stored outputs, which must still be written with the new height
+    uint256 txidMoved = GetRandHash();
+    {
+        CCoinsModifier coins = cache.ModifyNewCoins(txidMoved, false);
+        coins->vout.assign(3, CTxOut(5, CScript() << OP_TRUE));
+        coins->nHeight = 10;
+    }
+    BOOST_CHECK(cache.Flush());
+    {
+        CCoinsViewCache disconnect(&cache);
+        disconnect.ModifyCoins(txidMoved)->Clear();
+        BOOST_CHECK(disconnect.Flush());
+    }
+    {
+        CCoinsViewCache connect(&cache);
+        {
+            CCoinsModifier coins = connect.ModifyNewCoins(txidMoved, false);
+            coins->vout.assign(3, CTxOut(5, CScript() << OP_TRUE));
+            coins->nHeight = 12;
+        }
+        BOOST_CHECK(connect.Flush());
+    }
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(db.GetCoins(txidMoved, coins));
+    BOOST_CHECK(coins.nHeight == 12 && coins.vout.size() == 3);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -169,6 +169,96 @@ BOOST_AUTO_TEST_CASE(dbwrapper_iterator)
     }
 }
 
+// Test bounded range iteration
+BOOST_AUTO_TEST_CASE(dbwrapper_range)
+{
+    // Perform tests both obfuscated and non-obfuscated.
+    for (int i = 0; i < 2; i++) {
+        bool obfuscate = (bool)i;
+        path ph = temp_directory_path() / unique_path();
+        CDBWrapper dbw(ph, (1 << 20), true, false, obfuscate);
+
+        // Keys of three prefixes, the last one at the top of the key space
+        const char prefixes[] = {'a', 'b', (char)0xff};
+        for (int p = 0; p < 3; p++) {
+            for (uint32_t n = 0; n < 10; n++)
+                BOOST_CHECK(dbw.Write(std::make_pair(prefixes[p], n), (uint64_t)(p * 100 + n)));
+        }
+
+        std::pair<char, uint32_t> key_res;
+        uint64_t val_res;
+
+        boost::scoped_ptr<CDBRange> range(dbw.NewPrefixRange('b'));
+        for (uint32_t n = 0; n < 10; n++) {
+            BOOST_CHECK(range->Valid());
+            BOOST_CHECK(range->GetKey(key_res));
+            BOOST_CHECK(range->GetValue(val_res));
+            BOOST_CHECK_EQUAL(key_res.first, 'b');
+            BOOST_CHECK_EQUAL(key_res.second, n);
+            BOOST_CHECK_EQUAL(val_res, 100 + n);
+            range->Next();
+        }
+        BOOST_CHECK(!range->Valid());
+
+        // A prefix made of 0xff bytes has no successor and runs to the end
+        range.reset(dbw.NewPrefixRange((char)0xff));
+        unsigned int count = 0;
+        for (; range->Valid(); range->Next())
+            count++;
+        BOOST_CHECK_EQUAL(count, 10U);
+
+        // Half-open bounds and resuming behind a key
+        range.reset(dbw.NewRange(std::make_pair('a', (uint32_t)3), std::make_pair('a', (uint32_t)7)));
+        range->SeekAfter(std::make_pair('a', (uint32_t)4));
+        BOOST_CHECK(range->GetKey(key_res));
+        BOOST_CHECK_EQUAL(key_res.second, 5U);
+        range->Next();
+        range->Next();
+        BOOST_CHECK(!range->Valid());
+
+        // Reverse ranges visit the same keys from the top down
+        range.reset(dbw.NewPrefixRange('b', true));
+        for (uint32_t n = 10; n-- > 0; range->Next()) {
+            BOOST_CHECK(range->Valid());
+            BOOST_CHECK(range->GetKey(key_res));
+            BOOST_CHECK_EQUAL(key_res.first, 'b');
+            BOOST_CHECK_EQUAL(key_res.second, n);
+        }
+        BOOST_CHECK(!range->Valid());
+
+        range.reset(dbw.NewPrefixRange((char)0xff, true));
+        BOOST_CHECK(range->GetKey(key_res));
+        BOOST_CHECK_EQUAL(key_res.second, 9U);
+
+        range.reset(dbw.NewRange(std::make_pair('a', (uint32_t)3), std::make_pair('a', (uint32_t)7), true));
+        BOOST_CHECK(range->GetKey(key_res));
+        BOOST_CHECK_EQUAL(key_res.second, 6U);
+        range->SeekAfter(std::make_pair('a', (uint32_t)4));
+        BOOST_CHECK(range->GetKey(key_res));
+        BOOST_CHECK_EQUAL(key_res.second, 3U);
+        range->Next();
+        BOOST_CHECK(!range->Valid());
+
+        // A range over a snapshot does not see writes made after it was taken
+        {
+            CDBSnapshot snapshot(dbw);
+            BOOST_CHECK(dbw.Write(std::make_pair('b', (uint32_t)10), (uint64_t)110));
+            BOOST_CHECK(dbw.Erase(std::make_pair('b', (uint32_t)0)));
+            range.reset(dbw.NewPrefixRange('b', false, &snapshot));
+            count = 0;
+            BOOST_CHECK(range->GetKey(key_res));
+            BOOST_CHECK_EQUAL(key_res.second, 0U);
+            for (; range->Valid(); range->Next())
+                count++;
+            BOOST_CHECK_EQUAL(count, 10U);
+            range.reset();
+        }
+        range.reset(dbw.NewPrefixRange('b'));
+        BOOST_CHECK(range->GetKey(key_res));
+        BOOST_CHECK_EQUAL(key_res.second, 1U);
+    }
+}
+
 // Test that we do not obfuscation if there is existing data.
 BOOST_AUTO_TEST_CASE(existing_data_no_obfuscate)
 {
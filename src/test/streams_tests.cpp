@@ -64,4 +64,57 @@ BOOST_AUTO_TEST_CASE(streams_serializedata_xor)
             std::string(ds.begin(), ds.end()));  
 }         
 
+BOOST_AUTO_TEST_CASE(streams_span_reader)
+{
+    CDataStream ds(SER_DISK, 0);
+    ds << (uint32_t)0x01020304 << std::string("span") << (uint8_t)7;
+    std::vector<unsigned char> data(ds.begin(), ds.end());
+
+    CSpanReader reader(&data[0], &data[0] + data.size(), SER_DISK, 0);
+    uint32_t a;
+    std::string b;
+    uint8_t c;
+    reader >> a >> b;
+    BOOST_CHECK_EQUAL(a, 0x01020304U);
+    BOOST_CHECK_EQUAL(b, "span");
+    BOOST_CHECK_EQUAL(reader.size(), 1U);
+    reader >> c;
+    BOOST_CHECK_EQUAL(c, 7);
+    BOOST_CHECK(reader.empty());
+
+    // Reading past the end throws and does not read outside of the span
+    BOOST_CHECK_THROW(reader >> c, std::ios_base::failure);
+    CSpanReader shortReader(&data[0], &data[0] + 2, SER_DISK, 0);
+    BOOST_CHECK_THROW(shortReader >> a, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(streams_buffered_file_ignore)
+{
+    FILE* file = tmpfile();
+    std::vector<unsigned char> data(100);
+    for (unsigned int i = 0; i < data.size(); i++)
+        data[i] = i;
+    fwrite(&data[0], 1, data.size(), file);
+    rewind(file);
+
+    // Skip across the end of the ring buffer several times
+    CBufferedFile bf(file, 16, 4, SER_DISK, 0);
+    uint8_t c;
+    bf >> c;
+    BOOST_CHECK_EQUAL(c, 0);
+    bf.ignore(40);
+    BOOST_CHECK_EQUAL(bf.GetPos(), 41U);
+    bf >> c;
+    BOOST_CHECK_EQUAL(c, 41);
+
+    // The limit applies to skipped bytes as to read ones
+    BOOST_CHECK(bf.SetLimit(60));
+    BOOST_CHECK_THROW(bf.ignore(20), std::ios_base::failure);
+    bf.SetLimit();
+    bf.ignore(57);
+    bf >> c;
+    BOOST_CHECK_EQUAL(c, 99);
+    BOOST_CHECK_THROW(bf.ignore(1), std::ios_base::failure);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,155 @@
+// Copyright (c) 2009-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txcache.h"
+
+#include "core_memusage.h"
+#include "main.h"
+#include "memusage.h"
+
+CTxLookupCache txLookupCache;
+CBlockFileReadPool blockFileReadPool;
+
+CTxLookupCache::CTxLookupCache() : nUsage(0), nMaxUsage(0), nHits(0), nMisses(0)
+{
+}
+
+void CTxLookupCache::EraseEntry(EntryMap::iterator it)
+{
+    nUsage -= it->second->nUsage;
+    listEntries.erase(it->second);
+    mapEntries.erase(it);
+}
+
+void CTxLookupCache::SetMaxUsage(size_t nMaxUsageIn)
+{
+    LOCK(cs);
+    nMaxUsage = nMaxUsageIn;
+    while (nUsage > nMaxUsage)
+        EraseEntry(mapEntries.find(listEntries.back().txid));
+}
+
+bool CTxLookupCache::Get(const uint256 &txid, std::shared_ptr<const CTransaction> &ptx, uint256 &hashBlock)
+{
+    LOCK(cs);
+    EntryMap::iterator it = mapEntries.find(txid);
+    if (it == mapEntries.end()) {
+        nMisses++;
+        return false;
+    }
+    nHits++;
+    listEntries.splice(listEntries.begin(), listEntries, it->second);
+    ptx = it->second->ptx;
+    hashBlock = it->second->hashBlock;
+    return true;
+}
+
+void CTxLookupCache::Insert(const std::shared_ptr<const CTransaction> &ptx, const uint256 &hashBlock)
+{
+    LOCK(cs);
+    const uint256 &txid = ptx->GetHash();
+    EntryMap::iterator it = mapEntries.find(txid);
+    if (it != mapEntries.end())
+        EraseEntry(it);
+
+    CEntry entry;
+    entry.txid = txid;
+    entry.ptx = ptx;
+    entry.hashBlock = hashBlock;
+    entry.nUsage = RecursiveDynamicUsage(*ptx) + memusage::DynamicUsage(ptx) +
+                   memusage::MallocUsage(sizeof(CEntry) + 2 * sizeof(void*)) +
+                   memusage::MallocUsage(sizeof(memusage::boost_unordered_node<std::pair<const uint256, EntryList::iterator> >));
+    if (entry.nUsage > nMaxUsage)
+        return;
+
+    while (nUsage + entry.nUsage > nMaxUsage)
+        EraseEntry(mapEntries.find(listEntries.back().txid));
+    listEntries.push_front(entry);
+    mapEntries.insert(std::make_pair(txid, listEntries.begin()));
+    nUsage += entry.nUsage;
+}
+
+void CTxLookupCache::Erase(const uint256 &txid)
+{
+    LOCK(cs);
+    EntryMap::iterator it = mapEntries.find(txid);
+    if (it != mapEntries.end())
+        EraseEntry(it);
+}
+
+void CTxLookupCache::Clear()
+{
+    LOCK(cs);
+    listEntries.clear();
+    mapEntries.clear();
+    nUsage = 0;
+}
+
+void CTxLookupCache::GetStats(size_t &nEntriesOut, size_t &nUsageOut, size_t &nMaxUsageOut, uint64_t &nHitsOut, uint64_t &nMissesOut) const
+{
+    LOCK(cs);
+    nEntriesOut = mapEntries.size();
+    nUsageOut = nUsage;
+    nMaxUsageOut = nMaxUsage;
+    nHitsOut = nHits;
+    nMissesOut = nMisses;
+}
+
+CBlockFileReadPool::CBlockFileReadPool() : nReused(0), nOpened(0)
+{
+}
+
+FILE* CBlockFileReadPool::Acquire(const CDiskBlockPos &pos)
+{
+    {
+        LOCK(cs);
+        for (std::list<std::pair<int, FILE*> >::iterator it = listFiles.begin(); it != listFiles.end(); it++) {
+            if (it->first != pos.nFile)
+                continue;
+            FILE* file = it->second;
+            listFiles.erase(it);
+            nReused++;
+            // The buffer may hold bytes from past the end of the data written
+            // when it was filled, which blocks written since have replaced. A
+            // seek within the buffer may be served from it, but the end of the
+            // file lies past every buffered byte, so seeking there drops it.
+            if (fseek(file, 0, SEEK_END) || fseek(file, pos.nPos, SEEK_SET)) {
+                fclose(file);
+                return NULL;
+            }
+            return file;
+        }
+        nOpened++;
+    }
+    // Pruning is incompatible with -txindex, so the files of pooled handles are never unlinked
+    return OpenBlockFile(pos, true);
+}
+
+void CBlockFileReadPool::Release(int nFile, FILE* file)
+{
+    if (file == NULL)
+        return;
+    LOCK(cs);
+    listFiles.push_front(std::make_pair(nFile, file));
+    if (listFiles.size() > MAX_BLOCK_FILE_READ_POOL) {
+        fclose(listFiles.back().second);
+        listFiles.pop_back();
+    }
+}
+
+void CBlockFileReadPool::Clear()
+{
+    LOCK(cs);
+    for (std::list<std::pair<int, FILE*> >::iterator it = listFiles.begin(); it != listFiles.end(); it++)
+        fclose(it->second);
+    listFiles.clear();
+}
+
+void CBlockFileReadPool::GetStats(size_t &nIdleOut, uint64_t &nReusedOut, uint64_t &nOpenedOut) const
+{
+    LOCK(cs);
+    nIdleOut = listFiles.size();
+    nReusedOut = nReused;
+    nOpenedOut = nOpened;
+}
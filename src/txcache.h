@@ -0,0 +1,101 @@
+// Copyright (c) 2009-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXCACHE_H
+#define BITCOIN_TXCACHE_H
+
+#include "coins.h"
+#include "primitives/transaction.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <list>
+#include <memory>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+struct CDiskBlockPos;
+
+/** Default for -txlookupcache, in MiB */
+static const unsigned int DEFAULT_TX_LOOKUP_CACHE = 16;
+/** Number of idle block file handles kept open for transaction index lookups */
+static const unsigned int MAX_BLOCK_FILE_READ_POOL = 8;
+
+/**
+ * Transactions decoded by transaction index lookups, together with the block
+ * that holds them. The least recently used ones are dropped to stay within
+ * the memory limit. Like the transaction index, an entry keeps the block it was
+ * read from after that block is disconnected; it must be erased when a block that
+ * indexes the txid again is connected.
+ */
+class CTxLookupCache
+{
+private:
+    struct CEntry {
+        uint256 txid;
+        std::shared_ptr<const CTransaction> ptx;
+        uint256 hashBlock;
+        size_t nUsage;
+    };
+    typedef std::list<CEntry> EntryList;
+    typedef boost::unordered_map<uint256, EntryList::iterator, SaltedTxidHasher> EntryMap;
+
+    mutable CCriticalSection cs;
+    //! entries from the most to the least recently used
+    EntryList listEntries;
+    EntryMap mapEntries;
+    size_t nUsage;
+    size_t nMaxUsage;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    void EraseEntry(EntryMap::iterator it);
+
+public:
+    CTxLookupCache();
+
+    //! Set the memory limit in bytes, 0 disables the cache
+    void SetMaxUsage(size_t nMaxUsageIn);
+    bool Get(const uint256 &txid, std::shared_ptr<const CTransaction> &ptx, uint256 &hashBlock);
+    void Insert(const std::shared_ptr<const CTransaction> &ptx, const uint256 &hashBlock);
+    void Erase(const uint256 &txid);
+    void Clear();
+
+    void GetStats(size_t &nEntriesOut, size_t &nUsageOut, size_t &nMaxUsageOut, uint64_t &nHitsOut, uint64_t &nMissesOut) const;
+};
+
+/**
+ * Read-only handles on block files, kept open between transaction index
+ * lookups. A handle is lent to one reader at a time and handed back once it
+ * is done, so that readers never share a file position.
+ */
+class CBlockFileReadPool
+{
+private:
+    mutable CCriticalSection cs;
+    //! idle handles from the most to the least recently returned, with their file number
+    std::list<std::pair<int, FILE*> > listFiles;
+    uint64_t nReused;
+    uint64_t nOpened;
+
+public:
+    CBlockFileReadPool();
+
+    //! Get a handle positioned at pos, or NULL if the file cannot be opened
+    FILE* Acquire(const CDiskBlockPos &pos);
+    //! Hand back a handle from Acquire on file nFile
+    void Release(int nFile, FILE* file);
+    void Clear();
+
+    void GetStats(size_t &nIdleOut, uint64_t &nReusedOut, uint64_t &nOpenedOut) const;
+};
+
+extern CTxLookupCache txLookupCache;
+extern CBlockFileReadPool blockFileReadPool;
+
+#endif // BITCOIN_TXCACHE_H
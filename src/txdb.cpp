@@ -6,27 +6,41 @@
 #include "txdb.h"
 
 #include "chainparams.h"
+#include "consensus/consensus.h"
 #include "hash.h"
+#include "memusage.h"
 #include "pow.h"
 #include "uint256.h"
 
 #include <stdint.h>
+#include <algorithm>
+#include <limits>
 
 #include <boost/thread.hpp>
 
 using namespace std;
 
+static const char DB_COIN = 'C';
+//! Coins of whole transactions, as stored before the upgrade to records per output
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
 static const char DB_ADDRESSINDEX = 'a';
 static const char DB_ADDRESSUNSPENTINDEX = 'u';
+static const char DB_ADDRESSUNSPENTVALUEINDEX = 'v';
+static const char DB_ADDRESSSUMMARYINDEX = 'y';
+static const char DB_ADDRESSWATCH = 'w';
+static const char DB_ADDRESSWATCHSET = 'W';
+static const char DB_ADDRESSWATCHMATCH = 'm';
 static const char DB_TIMESTAMPINDEX = 's';
 static const char DB_BLOCKHASHINDEX = 'z';
 static const char DB_SPENTINDEX = 'p';
 static const char DB_BLOCK_INDEX = 'b';
+//! Blocks an optional index covers that the block index may not have stored yet
+static const char DB_INDEX_BLOCK = 'h';
 
 static const char DB_BEST_BLOCK = 'B';
+static const char DB_INDEX_VERSION = 'V';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
@@ -36,12 +50,72 @@ CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(Get
 {
 }
 
+CCoinsHeader::CCoinsHeader(const CCoins &coins) : fCoinBase(coins.fCoinBase), nHeight(coins.nHeight), nVersion(coins.nVersion)
+{
+    for (uint32_t n = 0; n < coins.vout.size(); n++)
+        if (!coins.vout[n].IsNull())
+            SetStored(n);
+}
+
+void CCoinsHeader::SetStored(uint32_t n)
+{
+    if (n / 8 >= vStored.size())
+        vStored.resize(n / 8 + 1);
+    vStored[n / 8] |= 1 << (n % 8);
+}
+
+/**
+ * Read the header and output records of the transaction at the current
+ * position of range into coins, and move range past them. Returns false if a
+ * record cannot be read or is missing; the rest of the transaction is
+ * skipped all the same.
+ */
+static bool ReadCoinsOutputs(CDBRange &range, uint256 &txid, CCoins &coins, unsigned int &nValueSize)
+{
+    // The header sorts right before the outputs, whose keys extend its key by the index
+    std::pair<char, uint256> keyHeader;
+    CCoinsOutputKey key;
+    CCoinsHeader header;
+    bool fOk = range.GetKey(keyHeader) && !range.GetKey(key) && range.GetValue(header);
+    txid = keyHeader.second;
+    coins.Clear();
+    coins.fCoinBase = header.fCoinBase;
+    coins.nHeight = header.nHeight;
+    coins.nVersion = header.nVersion;
+    nValueSize = 0;
+    if (fOk) {
+        nValueSize += range.GetValueSize();
+        range.Next();
+    }
+    while (range.Valid() && range.GetKey(key) && key.txid == txid) {
+        CTxOut txout;
+        CTxOutCompressor txoutCompressor(txout);
+        if (fOk && header.IsStored(key.n) && range.GetValue(txoutCompressor)) {
+            if (key.n >= coins.vout.size())
+                coins.vout.resize(key.n + 1);
+            coins.vout[key.n] = txout;
+            nValueSize += range.GetValueSize();
+        } else {
+            fOk = false;
+        }
+        range.Next();
+    }
+    for (uint32_t n = 0; fOk && n < header.GetSize(); n++)
+        fOk = !header.IsStored(n) || coins.IsAvailable(n);
+    return fOk;
+}
+
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+    if (!db.Exists(make_pair(DB_COIN, txid)))
+        return false;
+    boost::scoped_ptr<CDBRange> prange(const_cast<CDBWrapper&>(db).NewPrefixLookup(make_pair(DB_COIN, txid)));
+    uint256 txidRead;
+    unsigned int nValueSize;
+    return ReadCoinsOutputs(*prange, txidRead, coins, nValueSize);
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+    return db.Exists(make_pair(DB_COIN, txid));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
@@ -52,29 +126,390 @@ uint256 CCoinsViewDB::GetBestBlock() const {
 }
 
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    bool fOk = WriteCoins(mapCoins, hashBlock);
+    mapCoins.clear();
+    return fOk;
+}
+
+bool CCoinsViewDB::WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock) {
     CDBBatch batch(db);
-    size_t count = 0;
-    size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
-        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(make_pair(DB_COINS, it->first));
-            else
-                batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
-            changed++;
+    size_t changed = 0, written = 0, erased = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        changed++;
+        const CCoins &coins = it->second.coins;
+
+        // Find out which outputs are stored: the cache knows for most entries, the header
+        // tells for the others, and a FRESH entry has none
+        CCoinsHeader stored;
+        bool fRewrite = false;
+        if (it->second.flags & CCoinsCacheEntry::STORED) {
+            for (uint32_t n = 0; n < 64; n++)
+                if ((it->second.nStored >> n) & 1)
+                    stored.SetStored(n);
+        } else if (!(it->second.flags & CCoinsCacheEntry::FRESH)) {
+            // Outputs of a duplicate coinbase or of a transaction connected again at another
+            // height are stored with other metadata, and have to be written again
+            if (db.Read(make_pair(DB_COIN, it->first), stored))
+                fRewrite = !stored.IsSameTransaction(coins);
         }
-        count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+
+        CCoinsHeader header(coins);
+        for (uint32_t n = 0; n < std::max(header.GetSize(), stored.GetSize()); n++) {
+            bool fUnspent = header.IsStored(n);
+            bool fStored = stored.IsStored(n);
+            if (fUnspent && (!fStored || fRewrite)) {
+                batch.Write(CCoinsOutputKey(DB_COIN, it->first, n), CTxOutCompressor(REF(coins.vout[n])));
+                written++;
+            } else if (fStored && !fUnspent) {
+                batch.Erase(CCoinsOutputKey(DB_COIN, it->first, n));
+                erased++;
+            }
+        }
+        if (!header.vStored.empty())
+            batch.Write(make_pair(DB_COIN, it->first), header);
+        else if (!(it->second.flags & CCoinsCacheEntry::FRESH))
+            batch.Erase(make_pair(DB_COIN, it->first));
     }
     if (!hashBlock.IsNull())
         batch.Write(DB_BEST_BLOCK, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    LogPrint("coindb", "Committing %u changed transactions (%u outputs written, %u erased) to coin database...\n",
+        (unsigned int)changed, (unsigned int)written, (unsigned int)erased);
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe, bool compression, int maxOpenFiles) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, false, compression, maxOpenFiles) {
+bool CCoinsViewDB::Upgrade() {
+    static const size_t nBatchRecords = 100000;
+
+    boost::scoped_ptr<CDBRange> prange(db.NewPrefixRange(DB_COINS));
+    if (!prange->Valid())
+        return true;
+    LogPrintf("%s: upgrading the coin database to one record per output...\n", __func__);
+
+    CDBBatch batch(db);
+    size_t nTransactions = 0, nOutputs = 0, nBatch = 0;
+    int nLastProgress = 0;
+    for (; prange->Valid(); prange->Next()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, uint256> key;
+        CCoins coins;
+        if (!prange->GetKey(key) || !prange->GetValue(coins))
+            return error("%s: failed to read coins record", __func__);
+        for (uint32_t n = 0; n < coins.vout.size(); n++) {
+            if (!coins.vout[n].IsNull()) {
+                batch.Write(CCoinsOutputKey(DB_COIN, key.second, n), CTxOutCompressor(coins.vout[n]));
+                nOutputs++;
+                nBatch++;
+            }
+        }
+        if (!coins.IsPruned()) {
+            batch.Write(make_pair(DB_COIN, key.second), CCoinsHeader(coins));
+            nBatch++;
+        }
+        // A transaction is converted in one batch, so an interrupted upgrade is simply resumed
+        batch.Erase(key);
+        nTransactions++;
+        if (++nBatch >= nBatchRecords) {
+            db.WriteBatch(batch);
+            batch.Clear();
+            nBatch = 0;
+            // The records are in the order of the serialized txids, whose first byte tells how far along we are
+            int nProgress = *key.second.begin() * 100 / 256;
+            if (nProgress >= nLastProgress + 10) {
+                LogPrintf("%s: upgrading the coin database... [%d%%]\n", __func__, nProgress);
+                nLastProgress = nProgress;
+            }
+        }
+    }
+    db.WriteBatch(batch);
+
+    LogPrintf("%s: converted %u transactions to %u output records\n", __func__, nTransactions, nOutputs);
+    // Reclaim the space of the erased records
+    db.CompactRange(make_pair(DB_COINS, uint256()), make_pair(DB_COINS, uint256S(std::string(64, 'f'))));
+    return true;
+}
+
+CCoinsWriteBatch::CCoinsWriteBatch() : pool(PoolNodeSize<CCoinsMap::value_type>()),
+    mapCoins(0, SaltedTxidHasher(), std::equal_to<uint256>(), CCoinsMapAllocator(&pool))
+{
+}
+
+CCoinsViewDBWriter::CCoinsViewDBWriter(CCoinsViewDB *dbIn) : db(dbIn), fWriting(false), fFailed(false), nPendingUsage(0)
+{
+}
+
+bool CCoinsViewDBWriter::GetCoins(const uint256 &txid, CCoins &coins) const {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (pbatch) {
+            CCoinsMap::const_iterator it = pbatch->mapCoins.find(txid);
+            if (it != pbatch->mapCoins.end()) {
+                coins = it->second.coins;
+                return !coins.IsPruned();
+            }
+        }
+    }
+    return db->GetCoins(txid, coins);
+}
+
+bool CCoinsViewDBWriter::HaveCoins(const uint256 &txid) const {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (pbatch) {
+            CCoinsMap::const_iterator it = pbatch->mapCoins.find(txid);
+            if (it != pbatch->mapCoins.end())
+                return !it->second.coins.IsPruned();
+        }
+    }
+    return db->HaveCoins(txid);
+}
+
+uint256 CCoinsViewDBWriter::GetBestBlock() const {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (pbatch && !pbatch->hashBlock.IsNull())
+            return pbatch->hashBlock;
+    }
+    return db->GetBestBlock();
+}
+
+bool CCoinsViewDBWriter::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    if (!WaitForWrite())
+        return false;
+    return db->BatchWrite(mapCoins, hashBlock);
+}
+
+CCoinsViewCursor *CCoinsViewDBWriter::Cursor() const {
+    return db->Cursor();
+}
+
+bool CCoinsViewDBWriter::WritePending(boost::unique_lock<boost::mutex> &lock)
+{
+    while (fWriting)
+        cond.wait(lock);
+    if (!pbatch || fFailed)
+        return !fFailed;
+
+    // The batch is left alone while it is written, so readers can still use it
+    fWriting = true;
+    lock.unlock();
+    bool fOk = db->WriteCoins(pbatch->mapCoins, pbatch->hashBlock);
+    lock.lock();
+    fWriting = false;
+    if (fOk) {
+        pbatch.reset();
+        nPendingUsage = 0;
+    } else
+        fFailed = true;
+    cond.notify_all();
+    return fOk;
+}
+
+bool CCoinsViewDBWriter::StartWrite(CCoinsWriteBatch *pbatchIn)
+{
+    boost::scoped_ptr<CCoinsWriteBatch> pbatchNew(pbatchIn);
+    size_t nUsage = memusage::DynamicUsage(pbatchNew->mapCoins);
+    for (CCoinsMap::const_iterator it = pbatchNew->mapCoins.begin(); it != pbatchNew->mapCoins.end(); it++)
+        nUsage += it->second.coins.DynamicMemoryUsage();
+    boost::this_thread::disable_interruption di;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (!WritePending(lock))
+        return false;
+    pbatch.swap(pbatchNew);
+    nPendingUsage = nUsage;
+    cond.notify_all();
+    return true;
+}
+
+bool CCoinsViewDBWriter::WaitForWrite()
+{
+    boost::this_thread::disable_interruption di;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return WritePending(lock);
+}
+
+size_t CCoinsViewDBWriter::PendingUsage() const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return nPendingUsage;
+}
+
+bool CCoinsViewDBWriter::ThreadWrite()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (true) {
+        while (!pbatch || fWriting || fFailed)
+            cond.wait(lock);
+        int64_t nStart = GetTimeMillis();
+        size_t nCoins = pbatch->mapCoins.size();
+        if (!WritePending(lock))
+            return error("%s: failed to write to the coin database", __func__);
+        LogPrint("coindb", "%s: wrote %u coins in %dms\n", __func__, nCoins, GetTimeMillis() - nStart);
+    }
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe, bool compression, int maxOpenFiles, const CIndexDBCacheSizes &indexCacheIn, bool fWipeIndexes, const boost::filesystem::path &indexDirIn) :
+    CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, false, compression, maxOpenFiles),
+    indexDir(indexDirIn.empty() ? GetDataDir() / "blocks" / "index" : indexDirIn), indexCache(indexCacheIn),
+    fIndexMemory(fMemory), fIndexWipe(fWipe || fWipeIndexes), fIndexCompression(compression), nIndexMaxOpenFiles(maxOpenFiles) {
+}
+
+CDBWrapper &CBlockTreeDB::OpenIndexDB(boost::scoped_ptr<CDBWrapper> &pdb, const char *name, size_t nCacheSize) {
+    LOCK(cs_indexDBs);
+    if (!pdb)
+        pdb.reset(new CDBWrapper(indexDir / name, nCacheSize, fIndexMemory, fIndexWipe, false, fIndexCompression, nIndexMaxOpenFiles));
+    return *pdb;
+}
+
+CDBWrapper &CBlockTreeDB::GetTxIndexDB() {
+    return OpenIndexDB(pTxIndexDB, "txindex", indexCache.nTxIndex);
+}
+
+CDBWrapper &CBlockTreeDB::GetIndexDB(OptionalIndex index) {
+    switch (index) {
+    case OPTIONAL_INDEX_ADDRESS: return OpenIndexDB(pAddressIndexDB, "address", indexCache.nAddressIndex);
+    case OPTIONAL_INDEX_SPENT: return OpenIndexDB(pSpentIndexDB, "spent", indexCache.nSpentIndex);
+    case OPTIONAL_INDEX_TIMESTAMP: return OpenIndexDB(pTimestampIndexDB, "timestamp", indexCache.nTimestampIndex);
+    default: assert(!"unknown optional index");
+    }
+    return *this;
+}
+
+/** Whether the database holds any record with the given prefix */
+static bool HaveIndexRecords(CDBWrapper &db, char prefix)
+{
+    boost::scoped_ptr<CDBRange> prange(db.NewPrefixRange(prefix));
+    return prange->Valid();
+}
+
+/** Move all records with the given prefix from one database to another, in bounded batches */
+template <typename K, typename V>
+static bool MoveIndexRecords(CDBWrapper &from, CDBWrapper &to, char prefix, size_t &nMoved)
+{
+    static const size_t nBatchRecords = 10000;
+
+    boost::scoped_ptr<CDBIterator> pcursor(from.NewIterator());
+    pcursor->Seek(prefix);
+
+    CDBBatch batchWrite(to);
+    CDBBatch batchErase(from);
+    size_t nBatch = 0;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, K> key;
+        if (!pcursor->GetKey(key) || key.first != prefix)
+            break;
+        V value;
+        if (!pcursor->GetValue(value))
+            return error("%s: failed to read index record with prefix '%c'", __func__, prefix);
+        batchWrite.Write(key, value);
+        batchErase.Erase(key);
+        if (++nBatch == nBatchRecords) {
+            // Write the copies before dropping the originals, so an interrupted move is simply resumed
+            to.WriteBatch(batchWrite, true);
+            from.WriteBatch(batchErase);
+            batchWrite.Clear();
+            batchErase.Clear();
+            nMoved += nBatch;
+            nBatch = 0;
+        }
+        pcursor->Next();
+    }
+
+    to.WriteBatch(batchWrite, true);
+    from.WriteBatch(batchErase);
+    nMoved += nBatch;
+
+    // Reclaim the space of the erased records
+    from.CompactRange(prefix, (char)(prefix + 1));
+    return true;
+}
+
+/** Erase all records with the given prefix, in bounded batches */
+template <typename K>
+static void EraseIndexRecords(CDBWrapper &db, char prefix, size_t &nErased)
+{
+    static const size_t nBatchRecords = 10000;
+
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(prefix);
+
+    CDBBatch batch(db);
+    size_t nBatch = 0;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, K> key;
+        if (!pcursor->GetKey(key) || key.first != prefix)
+            break;
+        batch.Erase(key);
+        if (++nBatch == nBatchRecords) {
+            db.WriteBatch(batch);
+            batch.Clear();
+            nErased += nBatch;
+            nBatch = 0;
+        }
+        pcursor->Next();
+    }
+
+    db.WriteBatch(batch);
+    nErased += nBatch;
+}
+
+bool CBlockTreeDB::WipeIndex(OptionalIndex index) {
+    if (index < 0 || index >= OPTIONAL_INDEX_COUNT)
+        return false;
+
+    CDBWrapper &db = GetIndexDB(index);
+    size_t nErased = 0;
+    switch (index) {
+    case OPTIONAL_INDEX_ADDRESS:
+        EraseIndexRecords<CAddressIndexKey>(db, DB_ADDRESSINDEX, nErased);
+        EraseIndexRecords<CAddressUnspentKey>(db, DB_ADDRESSUNSPENTINDEX, nErased);
+        EraseIndexRecords<CAddressUnspentValueKey>(db, DB_ADDRESSUNSPENTVALUEINDEX, nErased);
+        EraseIndexRecords<CAddressIndexIteratorKey>(db, DB_ADDRESSSUMMARYINDEX, nErased);
+        EraseIndexRecords<CAddressWatchMatchKey>(db, DB_ADDRESSWATCHMATCH, nErased);
+        db.CompactRange(DB_ADDRESSINDEX, (char)(DB_ADDRESSSUMMARYINDEX + 1));
+        break;
+    case OPTIONAL_INDEX_SPENT:
+        EraseIndexRecords<CSpentIndexKey>(db, DB_SPENTINDEX, nErased);
+        db.CompactRange(DB_SPENTINDEX, (char)(DB_SPENTINDEX + 1));
+        break;
+    case OPTIONAL_INDEX_TIMESTAMP:
+        EraseIndexRecords<CTimestampIndexKey>(db, DB_TIMESTAMPINDEX, nErased);
+        EraseIndexRecords<CTimestampBlockIndexKey>(db, DB_BLOCKHASHINDEX, nErased);
+        db.CompactRange(DB_TIMESTAMPINDEX, (char)(DB_BLOCKHASHINDEX + 1));
+        break;
+    default:
+        return false;
+    }
+    LogPrintf("%s: erased %u records of the %s index\n", __func__, nErased, GetOptionalIndexName(index));
+    return EraseIndexBlocks(index) && db.Erase(DB_BEST_BLOCK, true);
+}
+
+bool CBlockTreeDB::MoveIndexesToOwnDatabases() {
+    // Only open the index databases there are records for
+    size_t nMoved = 0;
+    if ((HaveIndexRecords(*this, DB_TXINDEX) &&
+         !MoveIndexRecords<uint256, CDiskTxPos>(*this, GetTxIndexDB(), DB_TXINDEX, nMoved)) ||
+        (HaveIndexRecords(*this, DB_ADDRESSINDEX) &&
+         !MoveIndexRecords<CAddressIndexKey, CAmount>(*this, GetIndexDB(OPTIONAL_INDEX_ADDRESS), DB_ADDRESSINDEX, nMoved)) ||
+        (HaveIndexRecords(*this, DB_ADDRESSUNSPENTINDEX) &&
+         !MoveIndexRecords<CAddressUnspentKey, CAddressUnspentValue>(*this, GetIndexDB(OPTIONAL_INDEX_ADDRESS), DB_ADDRESSUNSPENTINDEX, nMoved)) ||
+        (HaveIndexRecords(*this, DB_ADDRESSSUMMARYINDEX) &&
+         !MoveIndexRecords<CAddressIndexIteratorKey, CAddressSummaryValue>(*this, GetIndexDB(OPTIONAL_INDEX_ADDRESS), DB_ADDRESSSUMMARYINDEX, nMoved)) ||
+        (HaveIndexRecords(*this, DB_SPENTINDEX) &&
+         !MoveIndexRecords<CSpentIndexKey, CSpentIndexValue>(*this, GetIndexDB(OPTIONAL_INDEX_SPENT), DB_SPENTINDEX, nMoved)) ||
+        (HaveIndexRecords(*this, DB_TIMESTAMPINDEX) &&
+         !MoveIndexRecords<CTimestampIndexKey, int>(*this, GetIndexDB(OPTIONAL_INDEX_TIMESTAMP), DB_TIMESTAMPINDEX, nMoved)) ||
+        (HaveIndexRecords(*this, DB_BLOCKHASHINDEX) &&
+         !MoveIndexRecords<CTimestampBlockIndexKey, CTimestampBlockIndexValue>(*this, GetIndexDB(OPTIONAL_INDEX_TIMESTAMP), DB_BLOCKHASHINDEX, nMoved)))
+        return false;
+
+    if (nMoved > 0)
+        LogPrintf("%s: moved %u index records out of the block index database\n", __func__, nMoved);
+    return true;
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -99,46 +534,49 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 
 CCoinsViewCursor *CCoinsViewDB::Cursor() const
 {
-    CCoinsViewDBCursor *i = new CCoinsViewDBCursor(const_cast<CDBWrapper*>(&db)->NewIterator(), GetBestBlock());
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
-    i->pcursor->Seek(DB_COINS);
-    // Cache key of first record
-    i->pcursor->GetKey(i->keyTmp);
-    return i;
+    return new CCoinsViewDBCursor(const_cast<CDBWrapper&>(db).NewPrefixRange(DB_COIN), GetBestBlock());
+}
+
+CCoinsViewDBCursor::CCoinsViewDBCursor(CDBRange* prangeIn, const uint256 &hashBlockIn) :
+    CCoinsViewCursor(hashBlockIn), prange(prangeIn), fValid(false), fValueOk(false), nValueSize(0)
+{
+    Next();
 }
 
 bool CCoinsViewDBCursor::GetKey(uint256 &key) const
 {
-    // Return cached key
-    if (keyTmp.first == DB_COINS) {
-        key = keyTmp.second;
-        return true;
-    }
-    return false;
+    if (!fValid)
+        return false;
+    key = txid;
+    return true;
 }
 
-bool CCoinsViewDBCursor::GetValue(CCoins &coins) const
+bool CCoinsViewDBCursor::GetValue(CCoins &coinsOut) const
 {
-    return pcursor->GetValue(coins);
+    if (!fValid || !fValueOk)
+        return false;
+    coinsOut = coins;
+    return true;
 }
 
 unsigned int CCoinsViewDBCursor::GetValueSize() const
 {
-    return pcursor->GetValueSize();
+    return nValueSize;
 }
 
 bool CCoinsViewDBCursor::Valid() const
 {
-    return keyTmp.first == DB_COINS;
+    return fValid;
 }
 
 void CCoinsViewDBCursor::Next()
 {
-    pcursor->Next();
-    if (!pcursor->Valid() || !pcursor->GetKey(keyTmp))
-        keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
+    fValid = prange->Valid();
+    if (fValid)
+        fValueOk = ReadCoinsOutputs(*prange, txid, coins, nValueSize);
 }
 
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
@@ -154,23 +592,53 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
 }
 
 bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
-    return Read(make_pair(DB_TXINDEX, txid), pos);
+    return GetTxIndexDB().Read(make_pair(DB_TXINDEX, txid), pos);
 }
 
 bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
-    CDBBatch batch(*this);
+    CDBWrapper &db = GetTxIndexDB();
+    CDBBatch batch(db);
     for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
         batch.Write(make_pair(DB_TXINDEX, it->first), it->second);
-    return WriteBatch(batch);
+    return db.WriteBatch(batch);
 }
 
 
 bool CBlockTreeDB::ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value) {
-    return Read(make_pair(DB_SPENTINDEX, key), value);
+    return GetIndexDB(OPTIONAL_INDEX_SPENT).Read(make_pair(DB_SPENTINDEX, key), value);
 }
 
-bool CBlockTreeDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect) {
-    CDBBatch batch(*this);
+bool CBlockTreeDB::ReadSpentIndexes(const std::vector<CSpentIndexKey> &keys, std::vector<CSpentIndexValue> &values, const CDBSnapshot *psnapshot) {
+    // Visit the keys in database order, so that the iterator only ever moves forward
+    std::vector<std::pair<std::string, size_t> > vKeys;
+    vKeys.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+        vKeys.push_back(std::make_pair(CDBRange::EncodeKey(make_pair(DB_SPENTINDEX, keys[i])), i));
+    std::sort(vKeys.begin(), vKeys.end());
+
+    boost::scoped_ptr<CDBIterator> pcursor(GetIndexDB(OPTIONAL_INDEX_SPENT).NewIterator(psnapshot));
+    for (std::vector<std::pair<std::string, size_t> >::const_iterator it = vKeys.begin(); it != vKeys.end(); it++) {
+        boost::this_thread::interruption_point();
+        leveldb::Slice slKey(it->first);
+        // Outputs of one transaction are adjacent, often the previous hit was followed by this key
+        if (!pcursor->Valid() || pcursor->GetKeySlice().compare(slKey) != 0) {
+            if (it != vKeys.begin() && it->first == (it - 1)->first) {
+                values[it->second] = values[(it - 1)->second];
+                continue;
+            }
+            pcursor->Seek(slKey);
+            if (!pcursor->Valid() || pcursor->GetKeySlice().compare(slKey) != 0)
+                continue;
+        }
+        if (!pcursor->GetValue(values[it->second]))
+            return error("failed to get spent index value");
+        pcursor->Next();
+    }
+
+    return true;
+}
+
+void CBlockTreeDB::UpdateSpentIndex(CDBBatch &batch, const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect) {
     for (std::vector<std::pair<CSpentIndexKey,CSpentIndexValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
         if (it->second.IsNull()) {
             batch.Erase(make_pair(DB_SPENTINDEX, it->first));
@@ -178,138 +646,387 @@ bool CBlockTreeDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey,
             batch.Write(make_pair(DB_SPENTINDEX, it->first), it->second);
         }
     }
-    return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect) {
-    CDBBatch batch(*this);
+void CBlockTreeDB::UpdateAddressUnspentIndex(CDBBatch &batch, const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect) {
     for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
-        if (it->second.IsNull()) {
+        if (it->second.IsSpent()) {
             batch.Erase(make_pair(DB_ADDRESSUNSPENTINDEX, it->first));
+            batch.Erase(make_pair(DB_ADDRESSUNSPENTVALUEINDEX, CAddressUnspentValueKey(it->first, it->second.satoshis)));
         } else {
             batch.Write(make_pair(DB_ADDRESSUNSPENTINDEX, it->first), it->second);
+            batch.Write(make_pair(DB_ADDRESSUNSPENTVALUEINDEX, CAddressUnspentValueKey(it->first, it->second.satoshis)), it->second);
         }
     }
-    return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
-                                           std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs) {
-
-    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+static CAddressUnspentKey GetUnspentKey(const CAddressUnspentKey &key) { return key; }
+static CAddressUnspentKey GetUnspentKey(const CAddressUnspentValueKey &key) { return key.GetUnspentKey(); }
 
-    pcursor->Seek(make_pair(DB_ADDRESSUNSPENTINDEX, CAddressIndexIteratorKey(type, addressHash)));
-
-    while (pcursor->Valid()) {
+/** Append the rows of a range of either unspent index that pass the filter */
+template <typename K>
+static bool ReadAddressUnspentRange(CDBRange &range, unsigned int limit, const CAddressUnspentFilter &filter,
+                                    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs)
+{
+    unsigned int count = 0;
+    CAmount nTotal = 0;
+    while (range.Valid()) {
         boost::this_thread::interruption_point();
-        std::pair<char,CAddressUnspentKey> key;
-        if (pcursor->GetKey(key) && key.first == DB_ADDRESSUNSPENTINDEX && key.second.hashBytes == addressHash) {
-            CAddressUnspentValue nValue;
-            if (pcursor->GetValue(nValue)) {
-                unspentOutputs.push_back(make_pair(key.second, nValue));
-                pcursor->Next();
-            } else {
-                return error("failed to get address unspent value");
-            }
-        } else {
+        if (limit > 0 && count >= limit) {
             break;
         }
+        if (filter.nTargetValue > 0 && nTotal >= filter.nTargetValue) {
+            break;
+        }
+        std::pair<char, K> key;
+        CAddressUnspentValue nValue;
+        if (!range.GetKey(key) || !range.GetValue(nValue)) {
+            return error("failed to get address unspent value");
+        }
+        if (filter.Matches(nValue)) {
+            unspentOutputs.push_back(make_pair(GetUnspentKey(key.second), nValue));
+            nTotal += nValue.satoshis;
+            count++;
+        }
+        range.Next();
     }
 
     return true;
 }
 
-bool CBlockTreeDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
-    CDBBatch batch(*this);
+bool CBlockTreeDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
+                                           std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs,
+                                           const CAddressUnspentKey *pafter, unsigned int limit,
+                                           const CAddressUnspentFilter &filter, const CDBSnapshot *psnapshot) {
+
+    boost::scoped_ptr<CDBRange> prange(GetIndexDB(OPTIONAL_INDEX_ADDRESS).NewPrefixRange(make_pair(DB_ADDRESSUNSPENTINDEX, CAddressIndexIteratorKey(type, addressHash)),
+                                                                                       false, psnapshot));
+
+    if (pafter) {
+        // Resume directly behind the last key returned by a previous call
+        prange->SeekAfter(make_pair(DB_ADDRESSUNSPENTINDEX, *pafter));
+    }
+
+    return ReadAddressUnspentRange<CAddressUnspentKey>(*prange, limit, filter, unspentOutputs);
+}
+
+bool CBlockTreeDB::ReadAddressUnspentValueIndex(uint160 addressHash, int type,
+                                                std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs,
+                                                const CAddressUnspentValueKey *pafter, unsigned int limit,
+                                                const CAddressUnspentFilter &filter, const CDBSnapshot *psnapshot) {
+
+    std::pair<char, CAddressIndexIteratorKey> prefix(DB_ADDRESSUNSPENTVALUEINDEX, CAddressIndexIteratorKey(type, addressHash));
+    std::string strBegin = CDBRange::EncodeKey(prefix);
+    std::string strEnd = CDBRange::PrefixEnd(strBegin);
+    if (filter.nMinValue > 0) {
+        // Smaller outputs sort behind the first key of the amount just below the minimum
+        CAddressUnspentValueKey endKey(CAddressUnspentKey(type, addressHash, uint256(), 0), filter.nMinValue - 1);
+        strEnd = CDBRange::EncodeKey(make_pair(DB_ADDRESSUNSPENTVALUEINDEX, endKey));
+    }
+    boost::scoped_ptr<CDBRange> prange(new CDBRange(GetIndexDB(OPTIONAL_INDEX_ADDRESS).NewIterator(psnapshot), strBegin, strEnd));
+
+    if (pafter) {
+        prange->SeekAfter(make_pair(DB_ADDRESSUNSPENTVALUEINDEX, *pafter));
+    }
+
+    return ReadAddressUnspentRange<CAddressUnspentValueKey>(*prange, limit, filter, unspentOutputs);
+}
+
+void CBlockTreeDB::WriteAddressIndex(CDBBatch &batch, const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
     for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
         batch.Write(make_pair(DB_ADDRESSINDEX, it->first), it->second);
-    return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
-    CDBBatch batch(*this);
+void CBlockTreeDB::EraseAddressIndex(CDBBatch &batch, const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
     for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
         batch.Erase(make_pair(DB_ADDRESSINDEX, it->first));
-    return WriteBatch(batch);
 }
 
 bool CBlockTreeDB::ReadAddressIndex(uint160 addressHash, int type,
                                     std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
-                                    int start, int end) {
+                                    int start, int end, const CDBSnapshot *psnapshot) {
 
-    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    boost::scoped_ptr<CDBRange> prange(NewAddressIndexRange(addressHash, type, start, end, psnapshot));
+
+    while (prange->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char,CAddressIndexKey> key;
+        if (!prange->GetKey(key)) {
+            return error("failed to get address index key");
+        }
+        CAmount nValue;
+        if (!prange->GetValue(nValue)) {
+            return error("failed to get address index value");
+        }
+        addressIndex.push_back(make_pair(key.second, nValue));
+        prange->Next();
+    }
+
+    return true;
+}
 
+CDBRange *CBlockTreeDB::NewAddressIndexRange(const uint160 &addressHash, int type, int start, int end, const CDBSnapshot *psnapshot)
+{
+    // Heights are stored big-endian, so a height window is a plain key range
+    std::pair<char, CAddressIndexIteratorKey> prefix(DB_ADDRESSINDEX, CAddressIndexIteratorKey(type, addressHash));
+    std::string strBegin = CDBRange::EncodeKey(prefix);
+    std::string strEnd = CDBRange::PrefixEnd(strBegin);
     if (start > 0 && end > 0) {
-        pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorHeightKey(type, addressHash, start)));
-    } else {
-        pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorKey(type, addressHash)));
+        strBegin = CDBRange::EncodeKey(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorHeightKey(type, addressHash, start)));
     }
+    if (end > 0 && end < std::numeric_limits<int>::max()) {
+        strEnd = CDBRange::EncodeKey(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorHeightKey(type, addressHash, end + 1)));
+    }
+    return new CDBRange(GetIndexDB(OPTIONAL_INDEX_ADDRESS).NewIterator(psnapshot), strBegin, strEnd);
+}
 
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        std::pair<char,CAddressIndexKey> key;
-        if (pcursor->GetKey(key) && key.first == DB_ADDRESSINDEX && key.second.hashBytes == addressHash) {
-            if (end > 0 && key.second.blockHeight > end) {
-                break;
-            }
-            CAmount nValue;
-            if (pcursor->GetValue(nValue)) {
-                addressIndex.push_back(make_pair(key.second, nValue));
-                pcursor->Next();
-            } else {
-                return error("failed to get address index value");
-            }
-        } else {
-            break;
+CAddressIndexMergeCursor *CBlockTreeDB::AddressIndexCursor(const std::vector<std::pair<uint160, int> > &addresses, int start, int end,
+                                                           const CAddressIndexPageKey *pafter)
+{
+    CAddressIndexMergeCursor *i = new CAddressIndexMergeCursor();
+    i->sources.reserve(addresses.size());
+    // All addresses are read as of the same moment, even while blocks are connected
+    i->psnapshot = new CDBSnapshot(GetIndexDB(OPTIONAL_INDEX_ADDRESS));
+
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = addresses.begin(); it != addresses.end(); it++) {
+        CAddressIndexMergeCursor::Source source;
+        source.prange = NewAddressIndexRange(it->first, it->second, start, end, i->psnapshot);
+        if (pafter) {
+            // Resume behind the last row of the address in the transaction of the previous page
+            source.prange->SeekAfter(make_pair(DB_ADDRESSINDEX, CAddressIndexKey(it->second, it->first, pafter->blockHeight, pafter->txindex,
+                                                                                 pafter->txhash, std::numeric_limits<uint32_t>::max(), true)));
+        }
+        i->sources.push_back(source);
+        if (i->ReadSource(i->sources.back())) {
+            i->heap.push_back(i->sources.size() - 1);
         }
     }
 
+    std::make_heap(i->heap.begin(), i->heap.end(), CAddressIndexMergeCursor::SourceCompare(&i->sources));
+    return i;
+}
+
+CAddressIndexMergeCursor::~CAddressIndexMergeCursor()
+{
+    for (std::vector<Source>::iterator it = sources.begin(); it != sources.end(); it++)
+        delete it->prange;
+    delete psnapshot;
+}
+
+bool CAddressIndexMergeCursor::SourceCompare::operator()(size_t a, size_t b) const
+{
+    // std::*_heap keep the largest element in front, so invert the order
+    const CAddressIndexKey &keyA = (*sources)[a].key;
+    const CAddressIndexKey &keyB = (*sources)[b].key;
+    if (keyA.blockHeight != keyB.blockHeight)
+        return keyA.blockHeight > keyB.blockHeight;
+    if (keyA.txindex != keyB.txindex)
+        return keyA.txindex > keyB.txindex;
+    return a > b;
+}
+
+bool CAddressIndexMergeCursor::ReadSource(Source &source)
+{
+    if (!source.prange->Valid())
+        return false;
+
+    std::pair<char, CAddressIndexKey> key;
+    if (!source.prange->GetKey(key) || !source.prange->GetValue(source.value)) {
+        fFailed = true;
+        return false;
+    }
+    source.key = key.second;
     return true;
 }
 
-bool CBlockTreeDB::WriteTimestampIndex(const CTimestampIndexKey &timestampIndex) {
+const CAddressIndexKey &CAddressIndexMergeCursor::GetKey() const
+{
+    return sources[heap.front()].key;
+}
+
+CAmount CAddressIndexMergeCursor::GetValue() const
+{
+    return sources[heap.front()].value;
+}
+
+bool CAddressIndexMergeCursor::Valid() const
+{
+    return !fFailed && !heap.empty();
+}
+
+void CAddressIndexMergeCursor::Next()
+{
+    SourceCompare compare(&sources);
+    std::pop_heap(heap.begin(), heap.end(), compare);
+    Source &source = sources[heap.back()];
+    source.prange->Next();
+    if (ReadSource(source)) {
+        std::push_heap(heap.begin(), heap.end(), compare);
+    } else {
+        heap.pop_back();
+    }
+}
+
+bool CBlockTreeDB::ReadAddressIndexLastHeight(uint160 addressHash, int type, int beforeHeight, int &height) {
+
+    boost::scoped_ptr<CDBIterator> pcursor(GetIndexDB(OPTIONAL_INDEX_ADDRESS).NewIterator());
+
+    // Position on the first record at or above beforeHeight, then step back once
+    pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorHeightKey(type, addressHash, beforeHeight)));
+    if (pcursor->Valid()) {
+        pcursor->Prev();
+    } else {
+        pcursor->SeekToLast();
+    }
+
+    std::pair<char,CAddressIndexKey> key;
+    if (pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_ADDRESSINDEX &&
+        key.second.type == (unsigned int)type && key.second.hashBytes == addressHash) {
+        height = key.second.blockHeight;
+        return true;
+    }
+
+    return false;
+}
+
+bool CBlockTreeDB::ReadAddressSummaryIndex(uint160 addressHash, int type, CAddressSummaryValue &summary, const CDBSnapshot *psnapshot) {
+    return GetIndexDB(OPTIONAL_INDEX_ADDRESS).Read(make_pair(DB_ADDRESSSUMMARYINDEX, CAddressIndexIteratorKey(type, addressHash)), summary, psnapshot);
+}
+
+void CBlockTreeDB::UpdateAddressSummaryIndex(CDBBatch &batch, const std::vector<std::pair<CAddressIndexIteratorKey, CAddressSummaryValue> >&vect) {
+    for (std::vector<std::pair<CAddressIndexIteratorKey, CAddressSummaryValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        if (it->second.IsNull()) {
+            batch.Erase(make_pair(DB_ADDRESSSUMMARYINDEX, it->first));
+        } else {
+            batch.Write(make_pair(DB_ADDRESSSUMMARYINDEX, it->first), it->second);
+        }
+    }
+}
+
+bool CBlockTreeDB::UpdateAddressWatchSet(const std::string &name, const std::vector<std::pair<uint160, int> > &addresses, bool fAdd) {
     CDBBatch batch(*this);
-    batch.Write(make_pair(DB_TIMESTAMPINDEX, timestampIndex), 0);
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = addresses.begin(); it != addresses.end(); it++) {
+        if (fAdd) {
+            batch.Write(make_pair(DB_ADDRESSWATCH, CAddressWatchKey(it->second, it->first, name)), '\0');
+            batch.Write(make_pair(DB_ADDRESSWATCHSET, CAddressWatchSetKey(name, it->second, it->first)), '\0');
+        } else {
+            batch.Erase(make_pair(DB_ADDRESSWATCH, CAddressWatchKey(it->second, it->first, name)));
+            batch.Erase(make_pair(DB_ADDRESSWATCHSET, CAddressWatchSetKey(name, it->second, it->first)));
+        }
+    }
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::ReadTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes) {
+bool CBlockTreeDB::HaveAddressWatch(const std::string &name, uint160 addressHash, int type) {
+    return Exists(make_pair(DB_ADDRESSWATCHSET, CAddressWatchSetKey(name, type, addressHash)));
+}
 
-    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+bool CBlockTreeDB::ReadAddressWatchSetNames(uint160 addressHash, int type, std::vector<std::string> &names) {
+    boost::scoped_ptr<CDBRange> prange(NewPrefixRange(make_pair(DB_ADDRESSWATCH, CAddressIndexIteratorKey(type, addressHash))));
 
-    pcursor->Seek(make_pair(DB_TIMESTAMPINDEX, CTimestampIndexIteratorKey(low)));
+    while (prange->Valid()) {
+        std::pair<char, CAddressWatchKey> key;
+        if (!prange->GetKey(key))
+            return error("failed to get address watch key");
+        names.push_back(key.second.name);
+        prange->Next();
+    }
 
-    while (pcursor->Valid()) {
+    return true;
+}
+
+bool CBlockTreeDB::ReadAddressWatchSets(boost::function<void(const CAddressWatchSetKey&)> visit) {
+    boost::scoped_ptr<CDBRange> prange(NewPrefixRange(DB_ADDRESSWATCHSET));
+
+    while (prange->Valid()) {
         boost::this_thread::interruption_point();
-        std::pair<char, CTimestampIndexKey> key;
-        if (pcursor->GetKey(key) && key.first == DB_TIMESTAMPINDEX && key.second.timestamp < high) {
-            if (fActiveOnly) {
-                if (HashOnchainActive(key.second.blockHash)) {
-                    hashes.push_back(std::make_pair(key.second.blockHash, key.second.timestamp));
-                }
-            } else {
-                hashes.push_back(std::make_pair(key.second.blockHash, key.second.timestamp));
-            }
+        std::pair<char, CAddressWatchSetKey> key;
+        if (!prange->GetKey(key))
+            return error("failed to get address watch set key");
+        visit(key.second);
+        prange->Next();
+    }
+
+    return true;
+}
 
-            pcursor->Next();
+void CBlockTreeDB::UpdateAddressWatchMatches(CDBBatch &batch, const std::vector<std::pair<CAddressWatchMatchKey, std::vector<std::pair<CAddressIndexKey, CAmount> > > > &vect) {
+    for (std::vector<std::pair<CAddressWatchMatchKey, std::vector<std::pair<CAddressIndexKey, CAmount> > > >::const_iterator it = vect.begin(); it != vect.end(); it++) {
+        if (it->second.empty()) {
+            batch.Erase(make_pair(DB_ADDRESSWATCHMATCH, it->first));
         } else {
-            break;
+            batch.Write(make_pair(DB_ADDRESSWATCHMATCH, it->first), it->second);
         }
     }
+}
+
+bool CBlockTreeDB::ReadAddressWatchMatches(const CAddressWatchMatchKey &key, std::vector<std::pair<CAddressIndexKey, CAmount> > &matches) {
+    // Blocks without a match have no row
+    CDBWrapper &db = GetIndexDB(OPTIONAL_INDEX_ADDRESS);
+    if (!db.Exists(make_pair(DB_ADDRESSWATCHMATCH, key)))
+        return true;
+    return db.Read(make_pair(DB_ADDRESSWATCHMATCH, key), matches);
+}
+
+bool CBlockTreeDB::EraseAddressWatchMatches(const std::string &name) {
+    CDBWrapper &db = GetIndexDB(OPTIONAL_INDEX_ADDRESS);
+    boost::scoped_ptr<CDBRange> prange(db.NewPrefixRange(make_pair(DB_ADDRESSWATCHMATCH, name)));
+    CDBBatch batch(db);
+    while (prange->Valid()) {
+        std::pair<char, CAddressWatchMatchKey> key;
+        if (!prange->GetKey(key))
+            return error("failed to get address watch match key");
+        batch.Erase(key);
+        prange->Next();
+    }
+    return db.WriteBatch(batch);
+}
+
+void CBlockTreeDB::WriteTimestampIndex(CDBBatch &batch, const CTimestampIndexKey &timestampIndex, int nHeight) {
+    batch.Write(make_pair(DB_TIMESTAMPINDEX, timestampIndex), nHeight);
+}
+
+bool CBlockTreeDB::ReadTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes,
+                                      unsigned int limit, bool fReverse, const CDBSnapshot *psnapshot) {
+
+    // Test membership against the chain as it was when the scan started, without cs_main
+    const CBlockIndex* pindexTip = fActiveOnly ? GetActiveTipView() : NULL;
+
+    // The rows are keyed by logical timestamp, so they carry it without a lookup per block
+    boost::scoped_ptr<CDBRange> prange(GetIndexDB(OPTIONAL_INDEX_TIMESTAMP).NewRange(make_pair(DB_TIMESTAMPINDEX, CTimestampIndexIteratorKey(low)),
+                                                                                     make_pair(DB_TIMESTAMPINDEX, CTimestampIndexIteratorKey(high)), fReverse, psnapshot));
+
+    while (prange->Valid() && (limit == 0 || hashes.size() < limit)) {
+        boost::this_thread::interruption_point();
+        std::pair<char, CTimestampIndexKey> key;
+        if (!prange->GetKey(key)) {
+            return error("failed to get timestamp index key");
+        }
+        bool fInclude = true;
+        if (fActiveOnly) {
+            int nHeight;
+            if (!prange->GetValue(nHeight)) {
+                return error("failed to get timestamp index value");
+            }
+            fInclude = IsInChainView(pindexTip, key.second.blockHash, nHeight);
+        }
+        if (fInclude) {
+            hashes.push_back(std::make_pair(key.second.blockHash, key.second.timestamp));
+        }
+        prange->Next();
+    }
 
     return true;
 }
 
-bool CBlockTreeDB::WriteTimestampBlockIndex(const CTimestampBlockIndexKey &blockhashIndex, const CTimestampBlockIndexValue &logicalts) {
-    CDBBatch batch(*this);
+void CBlockTreeDB::WriteTimestampBlockIndex(CDBBatch &batch, const CTimestampBlockIndexKey &blockhashIndex, const CTimestampBlockIndexValue &logicalts) {
     batch.Write(make_pair(DB_BLOCKHASHINDEX, blockhashIndex), logicalts);
-    return WriteBatch(batch);
 }
 
 bool CBlockTreeDB::ReadTimestampBlockIndex(const uint256 &hash, unsigned int &ltimestamp) {
 
     CTimestampBlockIndexValue(lts);
-    if (!Read(std::make_pair(DB_BLOCKHASHINDEX, hash), lts))
+    if (!GetIndexDB(OPTIONAL_INDEX_TIMESTAMP).Read(std::make_pair(DB_BLOCKHASHINDEX, hash), lts))
 	return false;
 
     ltimestamp = lts.ltimestamp;
@@ -328,6 +1045,58 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+CDBSnapshot *CBlockTreeDB::NewIndexSnapshot(OptionalIndex index) {
+    return new CDBSnapshot(GetIndexDB(index));
+}
+
+bool CBlockTreeDB::WriteIndexBestBlock(OptionalIndex index, const uint256 &hash) {
+    return GetIndexDB(index).Write(DB_BEST_BLOCK, hash);
+}
+
+bool CBlockTreeDB::ReadIndexBestBlock(OptionalIndex index, uint256 &hash) {
+    return GetIndexDB(index).Read(DB_BEST_BLOCK, hash);
+}
+
+CDBBatch *CBlockTreeDB::NewIndexBatch(OptionalIndex index) {
+    return new CDBBatch(GetIndexDB(index));
+}
+
+bool CBlockTreeDB::WriteIndexBatch(OptionalIndex index, CDBBatch &batch, const uint256 &hashBestBlock) {
+    batch.Write(DB_BEST_BLOCK, hashBestBlock);
+    return GetIndexDB(index).WriteBatch(batch);
+}
+
+void CBlockTreeDB::WriteIndexBlock(CDBBatch &batch, const uint256 &hash, const uint256 &hashPrev) {
+    batch.Write(make_pair(DB_INDEX_BLOCK, hash), hashPrev);
+}
+
+bool CBlockTreeDB::ReadIndexBlock(OptionalIndex index, const uint256 &hash, uint256 &hashPrev) {
+    return GetIndexDB(index).Read(make_pair(DB_INDEX_BLOCK, hash), hashPrev);
+}
+
+bool CBlockTreeDB::EraseIndexBlocks(OptionalIndex index) {
+    CDBWrapper &db = GetIndexDB(index);
+    CDBBatch batch(db);
+    boost::scoped_ptr<CDBRange> prange(db.NewPrefixRange(DB_INDEX_BLOCK));
+    for (; prange->Valid(); prange->Next()) {
+        std::pair<char, uint256> key;
+        if (prange->GetKey(key))
+            batch.Erase(key);
+    }
+    return db.WriteBatch(batch);
+}
+
+bool CBlockTreeDB::WriteIndexVersion(OptionalIndex index, int nVersion) {
+    return GetIndexDB(index).Write(DB_INDEX_VERSION, nVersion);
+}
+
+bool CBlockTreeDB::ReadIndexVersion(OptionalIndex index, int &nVersion) {
+    // Indexes without a version predate versioning
+    nVersion = 1;
+    GetIndexDB(index).Read(DB_INDEX_VERSION, nVersion);
+    return true;
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex)
 {
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
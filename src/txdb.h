@@ -18,6 +18,9 @@
 #include <vector>
 
 #include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
 
 class CBlockIndex;
 class CCoinsViewDBCursor;
@@ -37,6 +40,20 @@ static const int64_t nMaxBlockDBCache = 2;
 static const int64_t nMaxBlockDBAndTxIndexCache = 1024;
 //! Max memory allocated to coin DB specific cache (MiB)
 static const int64_t nMaxCoinsDBCache = 8;
+//! Memory allocated to the database of an optional index that is not enabled (MiB)
+static const int64_t nMinIndexDBCache = 1;
+
+/** Cache sizes (in bytes) of the databases of the optional indexes */
+struct CIndexDBCacheSizes
+{
+    size_t nTxIndex;
+    size_t nAddressIndex;
+    size_t nSpentIndex;
+    size_t nTimestampIndex;
+
+    CIndexDBCacheSizes(size_t nCacheSize = nMinIndexDBCache << 20) :
+        nTxIndex(nCacheSize), nAddressIndex(nCacheSize), nSpentIndex(nCacheSize), nTimestampIndex(nCacheSize) {}
+};
 
 struct CDiskTxPos : public CDiskBlockPos
 {
@@ -63,7 +80,86 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
-/** CCoinsView backed by the coin database (chainstate/) */
+/**
+ * Key of an unspent output in the coin database: the record type, its txid
+ * and its index. The value is the output, compressed as by CTxOutCompressor.
+ * The key of the CCoinsHeader of the transaction is a prefix of it.
+ */
+struct CCoinsOutputKey
+{
+    char chType;
+    uint256 txid;
+    uint32_t n;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(chType);
+        READWRITE(txid);
+        READWRITE(VARINT(n));
+    }
+
+    CCoinsOutputKey(char chTypeIn, const uint256 &txidIn, uint32_t nIn) : chType(chTypeIn), txid(txidIn), n(nIn) {}
+
+    CCoinsOutputKey() : chType(0), n(0) {}
+};
+
+/**
+ * The record stored under the record type and the txid alone, ahead of the
+ * outputs of a transaction that has any unspent. A lookup reads it with a
+ * single Get, which leveldb's bloom filters answer for most transactions
+ * without coins, and a write learns from it which outputs are stored:
+ * - VARINT(nHeight * 2 + fCoinBase)
+ * - VARINT(nVersion)
+ * - a bitmask of the stored outputs, bit n % 8 of byte n / 8 for output n
+ */
+struct CCoinsHeader
+{
+    bool fCoinBase;
+    int nHeight;
+    int nVersion;
+    std::vector<unsigned char> vStored;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersionIn) {
+        unsigned int nCode = nHeight * 2 + (fCoinBase ? 1 : 0);
+        READWRITE(VARINT(nCode));
+        if (ser_action.ForRead()) {
+            fCoinBase = nCode & 1;
+            nHeight = nCode >> 1;
+        }
+        READWRITE(VARINT(nVersion));
+        READWRITE(vStored);
+    }
+
+    //! The header of the unspent outputs of coins
+    explicit CCoinsHeader(const CCoins &coins);
+
+    CCoinsHeader() : fCoinBase(false), nHeight(0), nVersion(0) {}
+
+    void SetStored(uint32_t n);
+
+    bool IsStored(uint32_t n) const {
+        return n / 8 < vStored.size() && ((vStored[n / 8] >> (n % 8)) & 1);
+    }
+
+    //! One more than the highest output index the bitmask can hold
+    uint32_t GetSize() const { return vStored.size() * 8; }
+
+    //! Whether the stored outputs were written for the same transaction, at the same height, as coins
+    bool IsSameTransaction(const CCoins &coins) const {
+        return fCoinBase == coins.fCoinBase && nHeight == coins.nHeight && nVersion == coins.nVersion;
+    }
+};
+
+/**
+ * CCoinsView backed by the coin database (chainstate/), which stores every
+ * unspent output under its own key, so that spending one output of a
+ * transaction only erases that key, and rewrites its CCoinsHeader.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
@@ -75,10 +171,75 @@ public:
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    //! Like BatchWrite, but leaves mapCoins as it is
+    bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
+    CCoinsViewCursor *Cursor() const;
+
+    //! Convert the records of whole transactions written by earlier versions to records per output
+    bool Upgrade();
+};
+
+/** Changes taken from the coins cache, on their way to the coin database */
+struct CCoinsWriteBatch
+{
+    CPoolResource pool;
+    CCoinsMap mapCoins;
+    uint256 hashBlock;
+
+    CCoinsWriteBatch();
+};
+
+/**
+ * CCoinsView in front of the coin database that writes a batch of changes
+ * to it on a background thread, so that the coins cache can be flushed
+ * without holding cs_main during the write. Until the batch is written, its
+ * coins are served from memory, and any further write waits for it, so the
+ * database and its best block only ever move from one flushed state to the
+ * next.
+ */
+class CCoinsViewDBWriter : public CCoinsView
+{
+private:
+    CCoinsViewDB *db;
+
+    mutable boost::mutex mutex;
+    boost::condition_variable cond;
+    //! the batch waiting to be written or being written, if any
+    boost::scoped_ptr<CCoinsWriteBatch> pbatch;
+    bool fWriting;
+    //! a write failed, after which the batch stays in memory and nothing more is written
+    bool fFailed;
+    //! memory used by the pending batch, counted against the coin cache size
+    size_t nPendingUsage;
+
+    //! Write the pending batch, or wait for the thread writing it; called and returns with lock held
+    bool WritePending(boost::unique_lock<boost::mutex> &lock);
+
+public:
+    CCoinsViewDBWriter(CCoinsViewDB *dbIn);
+
+    bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    bool HaveCoins(const uint256 &txid) const;
+    uint256 GetBestBlock() const;
+    //! Write mapCoins directly, after the pending batch
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    //! A cursor over the database only, which lacks the pending batch until WaitForWrite()
     CCoinsViewCursor *Cursor() const;
+
+    /** Hand a batch to the writing thread, after the previous one is written. Takes ownership of pbatchIn. */
+    bool StartWrite(CCoinsWriteBatch *pbatchIn);
+    /** Wait until the pending batch is written, writing it in this thread if the writing thread has not started */
+    bool WaitForWrite();
+    /** Memory used by the batch waiting to be written or being written */
+    size_t PendingUsage() const;
+    /** Write each batch handed over by StartWrite, until a write fails */
+    bool ThreadWrite();
 };
 
-/** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
+/**
+ * Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB, one
+ * transaction at a time, with the records of its outputs put together.
+ */
 class CCoinsViewDBCursor: public CCoinsViewCursor
 {
 public:
@@ -92,23 +253,103 @@ public:
     void Next();
 
 private:
-    CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn):
-        CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn) {}
-    boost::scoped_ptr<CDBIterator> pcursor;
-    std::pair<char, uint256> keyTmp;
+    CCoinsViewDBCursor(CDBRange* prangeIn, const uint256 &hashBlockIn);
+    boost::scoped_ptr<CDBRange> prange;
+    //! the transaction at the cursor, whose outputs are read ahead
+    bool fValid;
+    bool fValueOk;
+    uint256 txid;
+    CCoins coins;
+    unsigned int nValueSize;
 
     friend class CCoinsViewDB;
 };
 
-/** Access to the block database (blocks/index/) */
+/**
+ * Iterates over the address index rows of several addresses at once, merged
+ * into block order (height, then position in the block). Only one row per
+ * address is held in memory at any time.
+ */
+class CAddressIndexMergeCursor
+{
+public:
+    ~CAddressIndexMergeCursor();
+
+    const CAddressIndexKey &GetKey() const;
+    CAmount GetValue() const;
+
+    bool Valid() const;
+    void Next();
+
+    //! Whether a row could not be decoded; the cursor is no longer Valid() in that case
+    bool Failed() const { return fFailed; }
+
+private:
+    struct Source {
+        CDBRange *prange;
+        CAddressIndexKey key;
+        CAmount value;
+    };
+
+    /** Orders sources for a min-heap on (height, txindex) */
+    struct SourceCompare {
+        const std::vector<Source> *sources;
+        SourceCompare(const std::vector<Source> *sourcesIn) : sources(sourcesIn) {}
+        bool operator()(size_t a, size_t b) const;
+    };
+
+    CAddressIndexMergeCursor() : psnapshot(NULL), fFailed(false) {}
+    bool ReadSource(Source &source);
+
+    //! the state of the database all sources read
+    CDBSnapshot *psnapshot;
+    std::vector<Source> sources;
+    std::vector<size_t> heap;
+    bool fFailed;
+
+    friend class CBlockTreeDB;
+};
+
+/**
+ * Access to the block database (blocks/index/). The transaction and optional
+ * indexes each live in their own database below it (blocks/index/<name>/, or
+ * below -indexdir), so that they have their own cache and are compacted
+ * independently of the block index. An index database is only opened when the
+ * index is first used, so disabled indexes hold no files open.
+ */
 class CBlockTreeDB : public CDBWrapper
 {
 public:
-    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool compression = true, int maxOpenFiles = 1000);
+    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool compression = true, int maxOpenFiles = 1000,
+                 const CIndexDBCacheSizes &indexCache = CIndexDBCacheSizes(), bool fWipeIndexes = false,
+                 const boost::filesystem::path &indexDir = boost::filesystem::path());
 private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
+
+    //! settings the index databases are opened with
+    boost::filesystem::path indexDir;
+    CIndexDBCacheSizes indexCache;
+    bool fIndexMemory;
+    bool fIndexWipe;
+    bool fIndexCompression;
+    int nIndexMaxOpenFiles;
+
+    CCriticalSection cs_indexDBs;
+    boost::scoped_ptr<CDBWrapper> pTxIndexDB;
+    boost::scoped_ptr<CDBWrapper> pAddressIndexDB;
+    boost::scoped_ptr<CDBWrapper> pSpentIndexDB;
+    boost::scoped_ptr<CDBWrapper> pTimestampIndexDB;
+
+    CDBWrapper &OpenIndexDB(boost::scoped_ptr<CDBWrapper> &pdb, const char *name, size_t nCacheSize);
+    CDBWrapper &GetTxIndexDB();
+    CDBWrapper &GetIndexDB(OptionalIndex index);
+
+    /** Range over the address index rows of one address, optionally limited to heights [start, end] */
+    CDBRange *NewAddressIndexRange(const uint160 &addressHash, int type, int start, int end, const CDBSnapshot *psnapshot = NULL);
 public:
+    /** Move index records left in the block index database by older versions into the index databases */
+    bool MoveIndexesToOwnDatabases();
     bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
     bool ReadLastBlockFile(int &nFile);
@@ -117,21 +358,78 @@ public:
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
-    bool UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect);
-    bool UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect);
+    /** Look up many spent index keys in one sweep; values of keys without a row are left untouched */
+    bool ReadSpentIndexes(const std::vector<CSpentIndexKey> &keys, std::vector<CSpentIndexValue> &values, const CDBSnapshot *psnapshot = NULL);
+    void UpdateSpentIndex(CDBBatch &batch, const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect);
+    void UpdateAddressUnspentIndex(CDBBatch &batch, const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect);
     bool ReadAddressUnspentIndex(uint160 addressHash, int type,
-                                 std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect);
-    bool WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
-    bool EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
+                                 std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect,
+                                 const CAddressUnspentKey *pafter = NULL, unsigned int limit = 0,
+                                 const CAddressUnspentFilter &filter = CAddressUnspentFilter(), const CDBSnapshot *psnapshot = NULL);
+    /** Like ReadAddressUnspentIndex, but largest outputs first */
+    bool ReadAddressUnspentValueIndex(uint160 addressHash, int type,
+                                      std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect,
+                                      const CAddressUnspentValueKey *pafter = NULL, unsigned int limit = 0,
+                                      const CAddressUnspentFilter &filter = CAddressUnspentFilter(), const CDBSnapshot *psnapshot = NULL);
+    void WriteAddressIndex(CDBBatch &batch, const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
+    void EraseAddressIndex(CDBBatch &batch, const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
     bool ReadAddressIndex(uint160 addressHash, int type,
                           std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
-                          int start = 0, int end = 0);
-    bool WriteTimestampIndex(const CTimestampIndexKey &timestampIndex);
-    bool ReadTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &vect);
-    bool WriteTimestampBlockIndex(const CTimestampBlockIndexKey &blockhashIndex, const CTimestampBlockIndexValue &logicalts);
+                          int start = 0, int end = 0, const CDBSnapshot *psnapshot = NULL);
+    CAddressIndexMergeCursor *AddressIndexCursor(const std::vector<std::pair<uint160, int> > &addresses, int start = 0, int end = 0,
+                                                 const CAddressIndexPageKey *pafter = NULL);
+    bool ReadAddressIndexLastHeight(uint160 addressHash, int type, int beforeHeight, int &height);
+    bool ReadAddressSummaryIndex(uint160 addressHash, int type, CAddressSummaryValue &summary, const CDBSnapshot *psnapshot = NULL);
+    void UpdateAddressSummaryIndex(CDBBatch &batch, const std::vector<std::pair<CAddressIndexIteratorKey, CAddressSummaryValue> > &vect);
+    /**
+     * Add (fAdd) or remove addresses of a watch set. The sets live in the block
+     * index database, so that they survive rebuilding the address index.
+     */
+    bool UpdateAddressWatchSet(const std::string &name, const std::vector<std::pair<uint160, int> > &addresses, bool fAdd);
+    bool HaveAddressWatch(const std::string &name, uint160 addressHash, int type);
+    bool ReadAddressWatchSetNames(uint160 addressHash, int type, std::vector<std::string> &names);
+    /** Call visit for the membership of every address in every watch set, ordered by set */
+    bool ReadAddressWatchSets(boost::function<void(const CAddressWatchSetKey&)> visit);
+    /** Store the matches of watch sets in blocks; an empty list erases the row */
+    void UpdateAddressWatchMatches(CDBBatch &batch, const std::vector<std::pair<CAddressWatchMatchKey, std::vector<std::pair<CAddressIndexKey, CAmount> > > > &vect);
+    bool ReadAddressWatchMatches(const CAddressWatchMatchKey &key, std::vector<std::pair<CAddressIndexKey, CAmount> > &matches);
+    bool EraseAddressWatchMatches(const std::string &name);
+    void WriteTimestampIndex(CDBBatch &batch, const CTimestampIndexKey &timestampIndex, int nHeight);
+    /** Blocks with a logical timestamp in [low, high), at most limit of them (0 for all), latest first with fReverse */
+    bool ReadTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &vect,
+                            unsigned int limit = 0, bool fReverse = false, const CDBSnapshot *psnapshot = NULL);
+    void WriteTimestampBlockIndex(CDBBatch &batch, const CTimestampBlockIndexKey &blockhashIndex, const CTimestampBlockIndexValue &logicalts);
     bool ReadTimestampBlockIndex(const uint256 &hash, unsigned int &logicalTS);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
+    /** A consistent view of the database of an optional index, for queries made of several reads */
+    CDBSnapshot *NewIndexSnapshot(OptionalIndex index);
+    /** The last block an optional index covers, a null hash if it does not cover any yet */
+    bool WriteIndexBestBlock(OptionalIndex index, const uint256 &hash);
+    bool ReadIndexBestBlock(OptionalIndex index, uint256 &hash);
+    /**
+     * The methods above that take a batch add rows to it. Get a batch for the
+     * database of an index here, and write it together with the new position
+     * of the index, so that the rows of a block and the position that covers
+     * them are stored at once or not at all.
+     */
+    CDBBatch *NewIndexBatch(OptionalIndex index);
+    bool WriteIndexBatch(OptionalIndex index, CDBBatch &batch, const uint256 &hashBestBlock);
+    /**
+     * Record in an index batch that the index covers the block hash, which
+     * follows hashPrev. The block index only stores new blocks when the chain
+     * state is flushed, so after a crash these records tell which blocks an
+     * index covers beyond the ones the block index knows. They are erased
+     * once the block index has stored the blocks.
+     */
+    void WriteIndexBlock(CDBBatch &batch, const uint256 &hash, const uint256 &hashPrev);
+    bool ReadIndexBlock(OptionalIndex index, const uint256 &hash, uint256 &hashPrev);
+    bool EraseIndexBlocks(OptionalIndex index);
+    /** The version of the rows of an optional index, 1 if it was created before indexes were versioned */
+    bool WriteIndexVersion(OptionalIndex index, int nVersion);
+    bool ReadIndexVersion(OptionalIndex index, int &nVersion);
+    /** Erase all rows and the position of an optional index */
+    bool WipeIndex(OptionalIndex index);
     bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
 };
 
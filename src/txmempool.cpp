@@ -453,140 +453,149 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
 
 void CTxMemPool::addAddressIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view)
 {
-    LOCK(cs);
     const CTransaction& tx = entry.GetTx();
-    std::vector<CMempoolAddressDeltaKey> inserted;
+    std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > rows;
 
     uint256 txhash = tx.GetHash();
+    std::vector<std::pair<uint160, int> > addresses;
     for (unsigned int j = 0; j < tx.vin.size(); j++) {
         const CTxIn input = tx.vin[j];
         const CTxOut &prevout = view.GetOutputFor(input);
-        if (prevout.scriptPubKey.IsPayToScriptHash()) {
-            vector<unsigned char> hashBytes(prevout.scriptPubKey.begin()+2, prevout.scriptPubKey.begin()+22);
-            CMempoolAddressDeltaKey key(2, uint160(hashBytes), txhash, j, 1);
-            CMempoolAddressDelta delta(entry.GetTime(), prevout.nValue * -1, input.prevout.hash, input.prevout.n);
-            mapAddress.insert(make_pair(key, delta));
-            inserted.push_back(key);
-        } else if (prevout.scriptPubKey.IsPayToPublicKeyHash()) {
-            vector<unsigned char> hashBytes(prevout.scriptPubKey.begin()+3, prevout.scriptPubKey.begin()+23);
-            CMempoolAddressDeltaKey key(1, uint160(hashBytes), txhash, j, 1);
+        GetScriptIndexAddresses(prevout.scriptPubKey, addresses);
+        for (std::vector<std::pair<uint160, int> >::const_iterator it = addresses.begin(); it != addresses.end(); it++) {
+            CMempoolAddressDeltaKey key(it->second, it->first, txhash, j, 1);
             CMempoolAddressDelta delta(entry.GetTime(), prevout.nValue * -1, input.prevout.hash, input.prevout.n);
-            mapAddress.insert(make_pair(key, delta));
-            inserted.push_back(key);
+            rows.push_back(make_pair(key, delta));
         }
     }
 
     for (unsigned int k = 0; k < tx.vout.size(); k++) {
         const CTxOut &out = tx.vout[k];
-        if (out.scriptPubKey.IsPayToScriptHash()) {
-            vector<unsigned char> hashBytes(out.scriptPubKey.begin()+2, out.scriptPubKey.begin()+22);
-            CMempoolAddressDeltaKey key(2, uint160(hashBytes), txhash, k, 0);
-            mapAddress.insert(make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
-            inserted.push_back(key);
-        } else if (out.scriptPubKey.IsPayToPublicKeyHash()) {
-            vector<unsigned char> hashBytes(out.scriptPubKey.begin()+3, out.scriptPubKey.begin()+23);
-            std::pair<addressDeltaMap::iterator,bool> ret;
-            CMempoolAddressDeltaKey key(1, uint160(hashBytes), txhash, k, 0);
-            mapAddress.insert(make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
-            inserted.push_back(key);
+        GetScriptIndexAddresses(out.scriptPubKey, addresses);
+        for (std::vector<std::pair<uint160, int> >::const_iterator it = addresses.begin(); it != addresses.end(); it++) {
+            CMempoolAddressDeltaKey key(it->second, it->first, txhash, k, 0);
+            rows.push_back(make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
         }
     }
 
-    mapAddressInserted.insert(make_pair(txhash, inserted));
+    mapAddress.Insert(txhash, rows);
+    addressDeltaLog.Append(rows, true);
 }
 
 bool CTxMemPool::getAddressIndex(std::vector<std::pair<uint160, int> > &addresses,
                                  std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > &results)
 {
-    LOCK(cs);
     for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        addressDeltaMap::iterator ait = mapAddress.lower_bound(CMempoolAddressDeltaKey((*it).second, (*it).first));
-        while (ait != mapAddress.end() && (*ait).first.addressBytes == (*it).first && (*ait).first.type == (*it).second) {
-            results.push_back(*ait);
-            ait++;
-        }
+        mapAddress.GetRange(CMempoolAddressDeltaKey((*it).second, (*it).first), CMempoolAddressRange((*it).second, (*it).first), results);
     }
     return true;
 }
 
 bool CTxMemPool::removeAddressIndex(const uint256 txhash)
 {
-    LOCK(cs);
-    addressDeltaMapInserted::iterator it = mapAddressInserted.find(txhash);
+    std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > rows;
+    mapAddress.Remove(txhash, &rows);
+    if (!rows.empty())
+        addressDeltaLog.Append(rows, false);
+    return true;
+}
 
-    if (it != mapAddressInserted.end()) {
-        std::vector<CMempoolAddressDeltaKey> keys = (*it).second;
-        for (std::vector<CMempoolAddressDeltaKey>::iterator mit = keys.begin(); mit != keys.end(); mit++) {
-            mapAddress.erase(*mit);
-        }
-        mapAddressInserted.erase(it);
+void CMempoolAddressDeltaLog::SetMaxEntries(size_t nMaxEntriesIn)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    nMaxEntries = nMaxEntriesIn;
+    while (entries.size() > nMaxEntries)
+        entries.pop_front();
+}
+
+void CMempoolAddressDeltaLog::Append(const std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > &rows, bool fAdded)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        for (std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> >::const_iterator it = rows.begin(); it != rows.end(); it++)
+            entries.push_back(CMempoolAddressDeltaLogEntry(nNextSequence++, fAdded, it->first, it->second));
+        while (entries.size() > nMaxEntries)
+            entries.pop_front();
+    }
+    cond.notify_all();
+}
+
+bool CMempoolAddressDeltaLog::GetSince(uint64_t nSequence, const std::set<std::pair<uint160, int> > &addresses,
+                                       std::vector<CMempoolAddressDeltaLogEntry> &result, uint64_t &nLast) const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    nLast = nNextSequence - 1;
+    if (nSequence > nLast)
+        return false; // from before a restart, the subscriber has to start over
+    if (nSequence == nLast)
+        return true;
+
+    // Sequence numbers are contiguous, so the first entry to return can be computed
+    uint64_t nFirst = entries.empty() ? nNextSequence : entries.front().nSequence;
+    bool fComplete = nSequence + 1 >= nFirst;
+    size_t nStart = fComplete ? nSequence + 1 - nFirst : 0;
+    for (std::deque<CMempoolAddressDeltaLogEntry>::const_iterator it = entries.begin() + nStart; it != entries.end(); it++) {
+        if (addresses.empty() || addresses.count(std::make_pair(it->key.addressBytes, it->key.type)))
+            result.push_back(*it);
     }
+    return fComplete;
+}
 
+bool CMempoolAddressDeltaLog::WaitForSequence(uint64_t nSequence, int64_t nTimeoutMillis) const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(nTimeoutMillis);
+    while (nNextSequence - 1 <= nSequence) {
+        if (!cond.timed_wait(lock, deadline))
+            return nNextSequence - 1 > nSequence;
+    }
     return true;
 }
 
 void CTxMemPool::addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view)
 {
-    LOCK(cs);
-
     const CTransaction& tx = entry.GetTx();
-    std::vector<CSpentIndexKey> inserted;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > rows;
 
     uint256 txhash = tx.GetHash();
+    std::vector<std::pair<uint160, int> > addresses;
     for (unsigned int j = 0; j < tx.vin.size(); j++) {
         const CTxIn input = tx.vin[j];
         const CTxOut &prevout = view.GetOutputFor(input);
         uint160 addressHash;
-        int addressType;
-
-        if (prevout.scriptPubKey.IsPayToScriptHash()) {
-            addressHash = uint160(vector<unsigned char> (prevout.scriptPubKey.begin()+2, prevout.scriptPubKey.begin()+22));
-            addressType = 2;
-        } else if (prevout.scriptPubKey.IsPayToPublicKeyHash()) {
-            addressHash = uint160(vector<unsigned char> (prevout.scriptPubKey.begin()+3, prevout.scriptPubKey.begin()+23));
-            addressType = 1;
-        } else {
-            addressHash.SetNull();
-            addressType = 0;
+        int addressType = 0;
+
+        GetScriptIndexAddresses(prevout.scriptPubKey, addresses);
+        if (addresses.size() == 1) {
+            addressHash = addresses[0].first;
+            addressType = addresses[0].second;
         }
 
         CSpentIndexKey key = CSpentIndexKey(input.prevout.hash, input.prevout.n);
         CSpentIndexValue value = CSpentIndexValue(txhash, j, -1, prevout.nValue, addressType, addressHash);
 
-        mapSpent.insert(make_pair(key, value));
-        inserted.push_back(key);
-
+        rows.push_back(make_pair(key, value));
     }
 
-    mapSpentInserted.insert(make_pair(txhash, inserted));
+    mapSpent.Insert(txhash, rows);
 }
 
 bool CTxMemPool::getSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value)
 {
-    LOCK(cs);
-    mapSpentIndex::iterator it;
+    return mapSpent.Find(key, value);
+}
 
-    it = mapSpent.find(key);
-    if (it != mapSpent.end()) {
-        value = it->second;
-        return true;
+void CTxMemPool::getSpentIndexes(const std::vector<CSpentIndexKey> &keys, std::vector<CSpentIndexValue> &values)
+{
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (values[i].IsNull())
+            mapSpent.Find(keys[i], values[i]);
     }
-    return false;
 }
 
 bool CTxMemPool::removeSpentIndex(const uint256 txhash)
 {
-    LOCK(cs);
-    mapSpentIndexInserted::iterator it = mapSpentInserted.find(txhash);
-
-    if (it != mapSpentInserted.end()) {
-        std::vector<CSpentIndexKey> keys = (*it).second;
-        for (std::vector<CSpentIndexKey>::iterator mit = keys.begin(); mit != keys.end(); mit++) {
-            mapSpent.erase(*mit);
-        }
-        mapSpentInserted.erase(it);
-    }
-
+    mapSpent.Remove(txhash);
     return true;
 }
 
@@ -6,14 +6,18 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <deque>
 #include <list>
+#include <map>
 #include <memory>
 #include <set>
+#include <vector>
 
 #include "addressindex.h"
 #include "spentindex.h"
 #include "amount.h"
 #include "coins.h"
+#include "crypto/common.h"
 #include "indirectmap.h"
 #include "primitives/transaction.h"
 #include "sync.h"
@@ -22,6 +26,9 @@
 #include "boost/multi_index_container.hpp"
 #include "boost/multi_index/ordered_index.hpp"
 #include "boost/multi_index/hashed_index.hpp"
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
 class CAutoFile;
 class CBlockIndex;
@@ -38,6 +45,9 @@ inline bool AllowFree(double dPriority)
     return dPriority > AllowFreeThreshold();
 }
 
+/** Default for -mempooladdresslog, the number of address index changes kept for getaddressmempoolupdates */
+static const unsigned int DEFAULT_MEMPOOL_ADDRESS_LOG_SIZE = 100000;
+
 /** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
@@ -329,6 +339,180 @@ struct TxMempoolInfo
     CFeeRate feeRate;
 };
 
+/**
+ * Key-value index over mempool transactions, split into shards by a hash of
+ * the key. Each shard is guarded by its own reader/writer lock, and the keys
+ * inserted per transaction are tracked in separate shards by txid. Lookups
+ * therefore never wait for CTxMemPool::cs, and only wait for a writer that
+ * is changing the same shard. A transaction becomes visible shard by shard,
+ * so a lookup across shards may see only part of a transaction being added.
+ */
+template <typename K, typename V, typename Compare, typename ShardHasher>
+class CMempoolShardedIndex
+{
+public:
+    static const unsigned int SHARDS = 16;
+
+    typedef std::map<K, V, Compare> indexMap;
+
+    /** Add the rows of transaction txhash */
+    void Insert(const uint256 &txhash, const std::vector<std::pair<K, V> > &rows)
+    {
+        std::vector<K> keys;
+        keys.reserve(rows.size());
+        for (typename std::vector<std::pair<K, V> >::const_iterator it = rows.begin(); it != rows.end(); it++) {
+            Shard &shard = shards[ShardHasher()(it->first) % SHARDS];
+            boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+            shard.map.insert(*it);
+            keys.push_back(it->first);
+        }
+
+        TxShard &txShard = txShards[txhash.GetCheapHash() % SHARDS];
+        LOCK(txShard.cs);
+        txShard.mapInserted.insert(std::make_pair(txhash, keys));
+    }
+
+    /** Remove all rows added for transaction txhash, and return them in pRemoved if given */
+    void Remove(const uint256 &txhash, std::vector<std::pair<K, V> > *pRemoved = NULL)
+    {
+        std::vector<K> keys;
+        {
+            TxShard &txShard = txShards[txhash.GetCheapHash() % SHARDS];
+            LOCK(txShard.cs);
+            typename std::map<uint256, std::vector<K> >::iterator it = txShard.mapInserted.find(txhash);
+            if (it == txShard.mapInserted.end())
+                return;
+            keys.swap(it->second);
+            txShard.mapInserted.erase(it);
+        }
+
+        for (typename std::vector<K>::const_iterator it = keys.begin(); it != keys.end(); it++) {
+            Shard &shard = shards[ShardHasher()(*it) % SHARDS];
+            boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+            typename indexMap::iterator mit = shard.map.find(*it);
+            if (mit == shard.map.end())
+                continue;
+            if (pRemoved)
+                pRemoved->push_back(*mit);
+            shard.map.erase(mit);
+        }
+    }
+
+    bool Find(const K &key, V &value) const
+    {
+        const Shard &shard = shards[ShardHasher()(key) % SHARDS];
+        boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+        typename indexMap::const_iterator it = shard.map.find(key);
+        if (it == shard.map.end())
+            return false;
+        value = it->second;
+        return true;
+    }
+
+    /**
+     * Append the rows from keyBegin on for as long as fInRange accepts them.
+     * keyBegin and all keys in the range must map to the same shard.
+     */
+    template <typename Range>
+    void GetRange(const K &keyBegin, const Range &fInRange, std::vector<std::pair<K, V> > &results) const
+    {
+        const Shard &shard = shards[ShardHasher()(keyBegin) % SHARDS];
+        boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+        for (typename indexMap::const_iterator it = shard.map.lower_bound(keyBegin); it != shard.map.end() && fInRange(it->first); it++)
+            results.push_back(*it);
+    }
+
+private:
+    struct Shard {
+        mutable boost::shared_mutex mutex;
+        indexMap map;
+    };
+
+    struct TxShard {
+        CCriticalSection cs;
+        std::map<uint256, std::vector<K> > mapInserted;
+    };
+
+    Shard shards[SHARDS];
+    TxShard txShards[SHARDS];
+};
+
+/** One change to the mempool address index, see CMempoolAddressDeltaLog */
+struct CMempoolAddressDeltaLogEntry
+{
+    uint64_t nSequence;
+    //! whether the row entered the mempool, or left it (confirmed, replaced or evicted)
+    bool fAdded;
+    CMempoolAddressDeltaKey key;
+    CMempoolAddressDelta delta;
+
+    CMempoolAddressDeltaLogEntry(uint64_t nSequenceIn, bool fAddedIn, const CMempoolAddressDeltaKey &keyIn, const CMempoolAddressDelta &deltaIn) :
+        nSequence(nSequenceIn), fAdded(fAddedIn), key(keyIn), delta(deltaIn) {}
+};
+
+/**
+ * Bounded log of the rows added to and removed from the mempool address
+ * index, numbered by an increasing sequence. Subscribers remember the last
+ * sequence they have seen and fetch only what changed since, instead of
+ * re-reading the index for every address they watch.
+ */
+class CMempoolAddressDeltaLog
+{
+public:
+    CMempoolAddressDeltaLog() : nMaxEntries(DEFAULT_MEMPOOL_ADDRESS_LOG_SIZE), nNextSequence(1) {}
+
+    void SetMaxEntries(size_t nMaxEntriesIn);
+
+    void Append(const std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > &rows, bool fAdded);
+
+    /**
+     * Append the entries after nSequence for the given addresses (all if empty)
+     * and set nLast to the last sequence in the log. Return false if entries
+     * after nSequence have already been dropped from the log.
+     */
+    bool GetSince(uint64_t nSequence, const std::set<std::pair<uint160, int> > &addresses,
+                  std::vector<CMempoolAddressDeltaLogEntry> &entries, uint64_t &nLast) const;
+
+    /** Wait at most nTimeoutMillis for an entry after nSequence, return whether there is one */
+    bool WaitForSequence(uint64_t nSequence, int64_t nTimeoutMillis) const;
+
+private:
+    mutable boost::mutex mutex;
+    mutable boost::condition_variable cond;
+    std::deque<CMempoolAddressDeltaLogEntry> entries;
+    size_t nMaxEntries;
+    uint64_t nNextSequence;
+};
+
+/** Shards the mempool address index by address, so that the rows of an address share a shard */
+struct CMempoolAddressShardHasher
+{
+    size_t operator()(const CMempoolAddressDeltaKey &key) const {
+        return ReadLE32(key.addressBytes.begin());
+    }
+};
+
+/** Shards the mempool spent index by the txid of the spent output */
+struct CMempoolSpentShardHasher
+{
+    size_t operator()(const CSpentIndexKey &key) const {
+        return key.txid.GetCheapHash();
+    }
+};
+
+/** Selects the mempool address index rows of one address */
+struct CMempoolAddressRange
+{
+    int type;
+    uint160 addressBytes;
+
+    CMempoolAddressRange(int typeIn, const uint160 &addressBytesIn) : type(typeIn), addressBytes(addressBytesIn) {}
+
+    bool operator()(const CMempoolAddressDeltaKey &key) const {
+        return key.type == type && key.addressBytes == addressBytes;
+    }
+};
+
 /**
  * CTxMemPool stores valid-according-to-the-current-best-chain
  * transactions that may be included in the next block.
@@ -486,17 +670,13 @@ private:
     typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
     txlinksMap mapLinks;
 
-    typedef std::map<CMempoolAddressDeltaKey, CMempoolAddressDelta, CMempoolAddressDeltaKeyCompare> addressDeltaMap;
-    addressDeltaMap mapAddress;
-
-    typedef std::map<uint256, std::vector<CMempoolAddressDeltaKey> > addressDeltaMapInserted;
-    addressDeltaMapInserted mapAddressInserted;
-
-    typedef std::map<CSpentIndexKey, CSpentIndexValue, CSpentIndexKeyCompare> mapSpentIndex;
-    mapSpentIndex mapSpent;
+    // The address and spent indexes have their own locks and are not guarded by cs
+    typedef CMempoolShardedIndex<CMempoolAddressDeltaKey, CMempoolAddressDelta, CMempoolAddressDeltaKeyCompare, CMempoolAddressShardHasher> addressDeltaIndex;
+    addressDeltaIndex mapAddress;
+    CMempoolAddressDeltaLog addressDeltaLog;
 
-    typedef std::map<uint256, std::vector<CSpentIndexKey> > mapSpentIndexInserted;
-    mapSpentIndexInserted mapSpentInserted;
+    typedef CMempoolShardedIndex<CSpentIndexKey, CSpentIndexValue, CSpentIndexKeyCompare, CMempoolSpentShardHasher> spentIndex;
+    spentIndex mapSpent;
 
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
@@ -535,9 +715,22 @@ public:
     bool getAddressIndex(std::vector<std::pair<uint160, int> > &addresses,
                          std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > &results);
     bool removeAddressIndex(const uint256 txhash);
+    /** See CMempoolAddressDeltaLog */
+    void setAddressDeltaLogSize(size_t nEntries) { addressDeltaLog.SetMaxEntries(nEntries); }
+    bool getAddressDeltasSince(uint64_t nSequence, const std::set<std::pair<uint160, int> > &addresses,
+                               std::vector<CMempoolAddressDeltaLogEntry> &entries, uint64_t &nLast) const
+    {
+        return addressDeltaLog.GetSince(nSequence, addresses, entries, nLast);
+    }
+    bool waitForAddressDeltas(uint64_t nSequence, int64_t nTimeoutMillis) const
+    {
+        return addressDeltaLog.WaitForSequence(nSequence, nTimeoutMillis);
+    }
 
     void addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view);
     bool getSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
+    /** Fill the values that are still null with the spends of those keys in the mempool */
+    void getSpentIndexes(const std::vector<CSpentIndexKey> &keys, std::vector<CSpentIndexValue> &values);
     bool removeSpentIndex(const uint256 txhash);
 
     void removeRecursive(const CTransaction &tx, std::list<CTransaction>& removed);
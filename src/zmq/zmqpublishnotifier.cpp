@@ -4,7 +4,9 @@
 
 #include "chainparams.h"
 #include "zmqpublishnotifier.h"
+#include "addresswatch.h"
 #include "main.h"
+#include "txmempool.h"
 #include "util.h"
 #include "rpc/server.h"
 
@@ -14,6 +16,8 @@ static const char *MSG_HASHBLOCK = "hashblock";
 static const char *MSG_HASHTX    = "hashtx";
 static const char *MSG_RAWBLOCK  = "rawblock";
 static const char *MSG_RAWTX     = "rawtx";
+static const char *MSG_ADDRESSDELTA = "addressdelta";
+static const char *MSG_WATCHSET  = "watchset";
 
 // Internal function to send multipart message
 static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
@@ -190,3 +194,66 @@ bool CZMQPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &tr
     ss << transaction;
     return SendMessage(MSG_RAWTX, &(*ss.begin()), ss.size());
 }
+
+bool CZMQPublishWatchSetNotifier::NotifyBlock(const CBlockIndex *pindex)
+{
+    // Only the new tip is announced, walk back to the last block published, so every
+    // block connected since then is published, also after a reorganisation
+    std::vector<const CBlockIndex*> blocks;
+    for (const CBlockIndex *pwalk = pindex; pwalk; pwalk = pwalk->pprev) {
+        if (pindexLast && pindexLast->nHeight >= pwalk->nHeight && pindexLast->GetAncestor(pwalk->nHeight) == pwalk)
+            break;
+        blocks.push_back(pwalk);
+        if (!pindexLast)
+            break;
+    }
+    pindexLast = pindex;
+
+    std::map<std::string, unsigned int> sets;
+    addressWatchSets.List(sets);
+    for (std::vector<const CBlockIndex*>::reverse_iterator it = blocks.rbegin(); it != blocks.rend(); it++) {
+        for (std::map<std::string, unsigned int>::const_iterator itSet = sets.begin(); itSet != sets.end(); itSet++) {
+            std::vector<std::pair<CAddressIndexKey, CAmount> > matches;
+            if (!GetAddressWatchMatches(itSet->first, (*it)->GetBlockHash(), matches) || matches.empty())
+                continue;
+
+            LogPrint("zmq", "zmq: Publish watchset %s %s\n", itSet->first, (*it)->GetBlockHash().GetHex());
+            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+            ss << itSet->first << (*it)->GetBlockHash() << (*it)->nHeight << matches;
+            if (!SendMessage(MSG_WATCHSET, &(*ss.begin()), ss.size()))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool CZMQPublishAddressDeltaNotifier::PublishDeltas()
+{
+    std::vector<CMempoolAddressDeltaLogEntry> entries;
+    std::set<std::pair<uint160, int> > all;
+    uint64_t nLast;
+    if (!mempool.getAddressDeltasSince(nLastSequence, all, entries, nLast))
+        LogPrint("zmq", "zmq: Address deltas after %d were dropped before they could be published\n", nLastSequence);
+    nLastSequence = nLast;
+
+    for (std::vector<CMempoolAddressDeltaLogEntry>::const_iterator it = entries.begin(); it != entries.end(); it++) {
+        // Subscribers can spot gaps by the log sequence, which unlike the message sequence survives dropped entries
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << it->nSequence << it->fAdded << (unsigned char)it->key.type << it->key.addressBytes;
+        ss << it->key.txhash << (uint32_t)it->key.index << (unsigned char)it->key.spending;
+        ss << it->delta.amount << it->delta.time << it->delta.prevhash << (uint32_t)it->delta.prevout;
+        if (!SendMessage(MSG_ADDRESSDELTA, &(*ss.begin()), ss.size()))
+            return false;
+    }
+    return true;
+}
+
+bool CZMQPublishAddressDeltaNotifier::NotifyBlock(const CBlockIndex *pindex)
+{
+    return PublishDeltas();
+}
+
+bool CZMQPublishAddressDeltaNotifier::NotifyTransaction(const CTransaction &transaction)
+{
+    return PublishDeltas();
+}
@@ -52,4 +52,31 @@ public:
     bool NotifyTransaction(const CTransaction &transaction);
 };
 
+/** Publishes the matches of each watch set in the blocks connected since the last notification */
+class CZMQPublishWatchSetNotifier : public CZMQAbstractPublishNotifier
+{
+private:
+    const CBlockIndex *pindexLast; //!< last block whose matches were published
+
+public:
+    CZMQPublishWatchSetNotifier() : pindexLast(NULL) {}
+
+    bool NotifyBlock(const CBlockIndex *pindex);
+};
+
+/** Publishes the mempool address delta log, one message per change, whenever a transaction or block is announced */
+class CZMQPublishAddressDeltaNotifier : public CZMQAbstractPublishNotifier
+{
+private:
+    uint64_t nLastSequence; //!< last address delta log entry published
+
+    bool PublishDeltas();
+
+public:
+    CZMQPublishAddressDeltaNotifier() : nLastSequence(0) {}
+
+    bool NotifyBlock(const CBlockIndex *pindex);
+    bool NotifyTransaction(const CTransaction &transaction);
+};
+
 #endif // BITCOIN_ZMQ_ZMQPUBLISHNOTIFIER_H